@@ -1,125 +1,48 @@
 #ifndef __ATOMIC_CL
 #define __ATOMIC_CL
 
-// Just a global counter (since Intel cant seem to handle local mem fences?)
-uint workgroup_counter_inc(__global volatile uint* counter, bool active)
-{
-	if (active)
-	{
-		return atomic_inc(counter);
-	} else {
-		return 0;
-	}
-}
-
-/*// Write to local buffer and parallel prefix sum
-// http://http.developer.nvidia.com/GPUGems3/gpugems3_ch39.html
-uint workgroup_counter_inc(__global volatile uint* counter, bool active)
+// Local memory that the kernel has to provide to workgroup_counter_inc (declaring __local variables outside of kernel
+// functions is not allowed by the OpenCL 1.2 spec and is rejected by the Intel compiler).
+#define WORKGROUP_COUNTER_MAX_SIZE 64
+#define WORKGROUP_COUNTER_SCRATCH_SIZE (WORKGROUP_COUNTER_MAX_SIZE + 1)
+
+#ifdef USE_WORKGROUP_COMPACTION
+// Work group aggregated counter: prefix sum over the active flags in local memory and a single global atomic per work
+// group. Must be reached by all threads of the work group (at most WORKGROUP_COUNTER_MAX_SIZE threads). The output
+// order of the active threads matches their order within the work group.
+uint workgroup_counter_inc(__global volatile uint* counter, bool active, __local uint* scratch)
 {
 	size_t lid = get_local_id(0);
-	__local uint data[64];
-	int offset = 1;
-	
-	data[lid] = active;
-
-	for (int d = 64/2; d > 0; d /= 2)
-	{
-		barrier(CLK_LOCAL_MEM_FENCE);
-		if (lid < d)
-		{
-			int ai = offset * (2 * lid + 1) - 1;
-			int bi = offset * (2 * lid + 2) - 1;
-			data[bi] += data[ai];
-		}
-		offset *= 2;
-	}
+	size_t groupSize = get_local_size(0);
 
+	// Inclusive scan (Hillis & Steele)
+	scratch[lid] = active;
 	barrier(CLK_LOCAL_MEM_FENCE);
-	if (lid == 0)
-		data[63] = 0;
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	for (int d = 1; d < 64; d *= 2)
+	for (uint offset = 1; offset < groupSize; offset *= 2)
 	{
-		offset /= 2;
+		uint value = lid >= offset ? scratch[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		scratch[lid] += value;
 		barrier(CLK_LOCAL_MEM_FENCE);
-		if (lid < d)
-		{
-			int ai = offset * (2 * lid + 1) - 1;
-			int bi = offset * (2 * lid + 2) - 1;
-			uint t = data[ai];
-			data[ai] = data[bi];
-			data[bi] += t;
-		}
 	}
 
+	if (lid == groupSize - 1)
+		scratch[WORKGROUP_COUNTER_MAX_SIZE] = atomic_add(counter, scratch[lid]);
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	uint localOffset = data[lid];
-
-	__local uint globalOffset;
-	if (lid == 63)
-	{
-		uint localCount = localOffset + active;
-		globalOffset = atomic_add(counter, localCount);
-	}
-
-	barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
-
-	return globalOffset + localOffset;
-}*/
-
-
-// Write to local buffer and naive prefix sum using forloop
-/*uint workgroup_counter_inc(__global volatile uint* counter, bool active)
-{
-	size_t lid = get_local_id(0);
-	__local uint data[64];
-	
-	data[lid] = active;
-
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	uint localOffset = 0;
-	for (int i = 0; i < lid; i++)
-		localOffset += data[i];
-
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	__local uint globalOffset;
-	if (lid == 63)
-		globalOffset = atomic_add(counter, localOffset + active);
-
- 	barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
-
-	return globalOffset + localOffset;
-}*/
-
-
-// Use a local atomic
-/*uint workgroup_counter_inc(__global volatile uint* counter, bool active)
+	return scratch[WORKGROUP_COUNTER_MAX_SIZE] + scratch[lid] - (active ? 1 : 0);
+}
+#else
+// Just a global counter (one atomic per active thread)
+uint workgroup_counter_inc(__global volatile uint* counter, bool active, __local uint* scratch)
 {
-	size_t lid = get_local_id(0);
-	__local volatile uint localCounter;
-	__local uint globalOffset;
-	
-	if (lid == 0)
-		localCounter = 0;
-
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	uint localOffset = 0;
 	if (active)
-		localOffset = atomic_inc(&localCounter);
-
-	barrier(CLK_LOCAL_MEM_FENCE);
-
-	if (lid == 0)
-		globalOffset = atomic_add(counter, localCounter);
-
- 	barrier(CLK_GLOBAL_MEM_FENCE);
-
-	return globalOffset + localOffset;
-}*/
+	{
+		return atomic_inc(counter);
+	} else {
+		return 0;
+	}
+}
+#endif
 
-#endif // __ATOMIC_CL
\ No newline at end of file
+#endif // __ATOMIC_CL
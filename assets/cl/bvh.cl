@@ -2,6 +2,24 @@
 #define __BVH_CL
 #include "ray.cl"
 
+#ifdef USE_QUANTIZED_BVH
+// Bounds are quantized relative to the parent, see bvh_nodes.h
+typedef struct
+{
+	float origin[3];
+	char exponents[3];
+	uchar quantizedMin[3];
+	uchar quantizedMax[3];
+	uchar __padding[3];
+
+	union
+	{
+		unsigned int leftChildIndex;
+		unsigned int firstTriangleIndex;
+	};
+	unsigned int triangleCount;
+} SubBvhNode;
+#else
 typedef struct
 {
 	float3 min;
@@ -14,13 +32,13 @@ typedef struct
 	};
 	unsigned int triangleCount;
 } SubBvhNode;
+#endif// USE_QUANTIZED_BVH
 
 typedef struct
 {
 	float3 min;
 	float3 max;
 
-	float invTransform[16];
 	union
 	{
 		struct
@@ -28,43 +46,65 @@ typedef struct
 			unsigned int leftChildIndex;
 			unsigned int rightChildIndex;
 		};
-		unsigned int subBvh;
+		struct
+		{
+			unsigned int subBvh;
+			unsigned int instanceIndex;
+		};
 	};
 	unsigned int isLeaf;
 } TopBvhNode;
 
-bool intersectRayTopBvh(const Ray* ray, const __global TopBvhNode* node, float nearestT)
+// First three rows of the (affine) inverse transform of a top level BVH leaf
+typedef struct
 {
-	float tmin = -INFINITY, tmax = INFINITY;
-	float3 aabbMin = node->min;
-	float3 aabbMax = node->max;
+	float4 invTransform[3];
+} TopBvhInstance;
 
-	if (ray->direction.x != 0.0f)
-	{
-		float tx1 = (aabbMin.x - ray->origin.x) / ray->direction.x;
-		float tx2 = (aabbMax.x - ray->origin.x) / ray->direction.x;
+// See bvh_nodes.h
+typedef struct
+{
+	TopBvhNode node;
+	TopBvhInstance instance;
+	unsigned int nodeIndex;
+} TopBvhNodeUpdate;
 
-		tmin = max(tmin, min(tx1, tx2));
-		tmax = min(tmax, max(tx1, tx2));
-	}
+// Smallest magnitude of a ray direction component used for the box tests. Keeps 1 / direction finite for rays that are
+// parallel to an axis, which would otherwise result in 0 * inf = NaN when the origin lies on a slab plane.
+#define MIN_RAY_DIRECTION 1e-20f
 
-	if (ray->direction.y != 0.0f)
-	{
-		float ty1 = (aabbMin.y - ray->origin.y) / ray->direction.y;
-		float ty2 = (aabbMax.y - ray->origin.y) / ray->direction.y;
+// Box test terms that only depend on the ray. Computed once per ray (and once per instance after transforming the ray)
+// so that every box test is two multiply-adds per axis: t = bound * invDirection - origin * invDirection.
+typedef struct
+{
+	float3 invDirection;
+	float3 negOriginTimesInvDirection;
+} RayBoxData;
 
-		tmin = max(tmin, min(ty1, ty2));
-		tmax = min(tmax, max(ty1, ty2));
-	}
+RayBoxData createRayBoxData(const Ray* ray)
+{
+	float3 direction = select(
+		ray->direction,
+		copysign((float3)(MIN_RAY_DIRECTION), ray->direction),
+		isless(fabs(ray->direction), (float3)(MIN_RAY_DIRECTION)));
+
+	RayBoxData result;
+	result.invDirection = 1.0f / direction;
+	result.negOriginTimesInvDirection = -ray->origin * result.invDirection;
+	return result;
+}
 
-	if (ray->direction.z != 0.0f)
-	{
-		float tz1 = (aabbMin.z - ray->origin.z) / ray->direction.z;
-		float tz2 = (aabbMax.z - ray->origin.z) / ray->direction.z;
+// https://tavianator.com/fast-branchless-raybounding-box-intersections/
+bool intersectRayBox(const RayBoxData* ray, float3 aabbMin, float3 aabbMax, float nearestT, float* outT)
+{
+	float3 t1 = fma(aabbMin, ray->invDirection, ray->negOriginTimesInvDirection);
+	float3 t2 = fma(aabbMax, ray->invDirection, ray->negOriginTimesInvDirection);
+	float3 tNear = fmin(t1, t2);
+	float3 tFar = fmax(t1, t2);
+	float tmin = fmax(fmax(tNear.x, tNear.y), tNear.z);
+	float tmax = fmin(fmin(tFar.x, tFar.y), tFar.z);
 
-		tmin = max(tmin, min(tz1, tz2));
-		tmax = min(tmax, max(tz1, tz2));
-	}
+	*outT = tmin;
 
 	// tmax >= 0: prevent boxes before the starting position from being hit
 	// See the comment section at:
@@ -72,46 +112,52 @@ bool intersectRayTopBvh(const Ray* ray, const __global TopBvhNode* node, float n
 	return tmax >= tmin && tmax >= 0 && tmin < nearestT;
 }
 
-// https://tavianator.com/fast-branchless-raybounding-box-intersections/
-bool intersectRaySubBvh(const Ray* ray, const SubBvhNode* node, float nearestT, float* outT)
+bool intersectRayTopBvh(const RayBoxData* ray, const __global TopBvhNode* node, float nearestT)
 {
-	float tmin = -INFINITY, tmax = INFINITY;
+	float t;
+	return intersectRayBox(ray, node->min, node->max, nearestT, &t);
+}
+
+bool intersectRaySubBvh(const RayBoxData* ray, const SubBvhNode* parent, const SubBvhNode* node, float nearestT, float* outT)
+{
+#ifdef USE_QUANTIZED_BVH
+	// bounds = origin + quantized * 2^exponent (the scale is constructed from the exponent bits directly)
+	float3 origin = (float3)(parent->origin[0], parent->origin[1], parent->origin[2]);
+	float3 scale = (float3)(
+		as_float((parent->exponents[0] + 127) << 23),
+		as_float((parent->exponents[1] + 127) << 23),
+		as_float((parent->exponents[2] + 127) << 23));
+	float3 aabbMin = origin + convert_float3((uchar3)(node->quantizedMin[0], node->quantizedMin[1], node->quantizedMin[2])) * scale;
+	float3 aabbMax = origin + convert_float3((uchar3)(node->quantizedMax[0], node->quantizedMax[1], node->quantizedMax[2])) * scale;
+#else
 	float3 aabbMin = node->min;
 	float3 aabbMax = node->max;
+#endif
+	return intersectRayBox(ray, aabbMin, aabbMax, nearestT, outT);
+}
 
-	if (ray->direction.x != 0.0f)
-	{
-		float tx1 = (aabbMin.x - ray->origin.x) / ray->direction.x;
-		float tx2 = (aabbMax.x - ray->origin.x) / ray->direction.x;
-
-		tmin = max(tmin, min(tx1, tx2));
-		tmax = min(tmax, max(tx1, tx2));
-	}
-
-	if (ray->direction.y != 0.0f)
-	{
-		float ty1 = (aabbMin.y - ray->origin.y) / ray->direction.y;
-		float ty2 = (aabbMax.y - ray->origin.y) / ray->direction.y;
-
-		tmin = max(tmin, min(ty1, ty2));
-		tmax = min(tmax, max(ty1, ty2));
-	}
-
-	if (ray->direction.z != 0.0f)
-	{
-		float tz1 = (aabbMin.z - ray->origin.z) / ray->direction.z;
-		float tz2 = (aabbMax.z - ray->origin.z) / ray->direction.z;
-
-		tmin = max(tmin, min(tz1, tz2));
-		tmax = min(tmax, max(tz1, tz2));
-	}
-
-	*outT = tmin;
-
-	// tmax >= 0: prevent boxes before the starting position from being hit
-	// See the comment section at:
-	//  https://tavianator.com/fast-branchless-raybounding-box-intersections/
-	return tmax >= tmin && tmax >= 0 && tmin < nearestT;
+#ifdef USE_WIDE_BVH
+// Bounds of the children are stored in the node (structure of arrays), see bvh_nodes.h
+typedef struct
+{
+	float minX[WIDE_BVH_WIDTH];
+	float maxX[WIDE_BVH_WIDTH];
+	float minY[WIDE_BVH_WIDTH];
+	float maxY[WIDE_BVH_WIDTH];
+	float minZ[WIDE_BVH_WIDTH];
+	float maxZ[WIDE_BVH_WIDTH];
+	unsigned int children[WIDE_BVH_WIDTH];// Wide node index or first triangle index
+	unsigned int triangleCounts[WIDE_BVH_WIDTH];// 0 for inner children
+	unsigned int childCount;
+	unsigned int __padding[3];
+} WideSubBvhNode;
+
+bool intersectRayWideSubBvhChild(const RayBoxData* ray, const __global WideSubBvhNode* node, uint child, float nearestT, float* outT)
+{
+	float3 aabbMin = (float3)(node->minX[child], node->minY[child], node->minZ[child]);
+	float3 aabbMax = (float3)(node->maxX[child], node->maxY[child], node->maxZ[child]);
+	return intersectRayBox(ray, aabbMin, aabbMax, nearestT, outT);
 }
+#endif// USE_WIDE_BVH
 
 #endif// __BVH_CL 
\ No newline at end of file
@@ -0,0 +1,25 @@
+#include "atomic.cl"
+
+// Appends the ids of a pseudo random subset of the threads to a queue, like the shading kernel does with the rays that
+// survive. Used to measure the throughput of workgroup_counter_inc.
+__kernel void appendToQueue(
+	__global volatile uint* counter,
+	__global uint* outQueue,
+	uint activeThreshold)// Out of 256
+{
+	size_t gid = get_global_id(0);
+
+	// Integer hash (Wang) so that the active threads are spread over the work groups
+	uint hash = (uint)gid;
+	hash = (hash ^ 61) ^ (hash >> 16);
+	hash *= 9;
+	hash = hash ^ (hash >> 4);
+	hash *= 0x27d4eb2d;
+	hash = hash ^ (hash >> 15);
+	bool active = (hash & 0xFF) < activeThreshold;
+
+	__local uint compactionScratch[WORKGROUP_COUNTER_SCRATCH_SIZE];
+	uint index = workgroup_counter_inc(counter, active, compactionScratch);
+	if (active)
+		outQueue[index] = gid;
+}
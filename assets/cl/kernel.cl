@@ -1,6 +1,4 @@
-#define NO_PARALLEL_RAYS// When a ray is parallel to axis, the intersection tests are really slow
 #define USE_BVH
-//#define COUNT_TRAVERSAL// Define here so it can be accessed by include files
 #define MAX_ITERATIONS 4
 
 //#define COMPARE_SHADING
@@ -19,10 +17,11 @@
 #include "kernel_data.cl"
 //#include "cubemap.cl"
 #include "skydome.cl"
+#include "ray_queue.cl"
 
 
 __kernel void generatePrimaryRays(
-	__global RayData* outRays,
+	__global uchar* outRays,
 	volatile __global KernelData* inputData,
 	__global randHostStream* randomStreams)
 {
@@ -50,9 +49,10 @@ __kernel void generatePrimaryRays(
 		x -= inputData->scrWidth / 2; 
 #endif
 	size_t outIndex = inputData->numInRays + gid;
+	Ray ray;
 	if (inputData->camera.thinLenseEnabled)
 	{
-		outRays[outIndex].ray = generateRayThinLens(
+		ray = generateRayThinLens(
 			&inputData->camera,
 			x,
 			y,
@@ -60,7 +60,7 @@ __kernel void generatePrimaryRays(
 			(float)inputData->scrHeight,
 			&randomStream);
 	} else {
-		outRays[outIndex].ray = generateRayPinhole(
+		ray = generateRayPinhole(
 			&inputData->camera,
 			x,
 			y,
@@ -68,10 +68,14 @@ __kernel void generatePrimaryRays(
 			(float)inputData->scrHeight,
 			&randomStream);
 	}
-	outRays[outIndex].multiplier = (float3)(1, 1, 1);
-	outRays[outIndex].flags = SHADINGFLAGS_LASTSPECULAR;
-	outRays[outIndex].outputPixel = rayIndex;
-	outRays[outIndex].numBounces = 0;
+	RayQueue outQueue = createRayQueue(outRays, inputData->maxRays);
+	outQueue.origins[outIndex] = ray.origin;
+	outQueue.directions[outIndex] = ray.direction;
+	outQueue.multipliers[outIndex] = (float3)(1, 1, 1);
+	outQueue.flags[outIndex] = SHADINGFLAGS_LASTSPECULAR;
+	outQueue.outputPixels[outIndex] = rayIndex;
+	outQueue.numBounces[outIndex] = 0;
+	outQueue.pdfs[outIndex] = 0;
 
 	// Store random streams
 	randCopyOverStreamsToGlobal(1, &randomStreams[gid], &randomStream);
@@ -86,13 +90,13 @@ __kernel void generatePrimaryRays(
 __kernel void intersectShadows(
 	__global float3* outputPixels,
 
-	__global RayData* inShadowRays,
+	__global uchar* inShadowRays,
 	__global uint* inTraversalStack,
 	volatile __global KernelData* inputData,
-	__global VertexData* vertices,
-	__global TriangleData* triangles,
+	__global IntersectTriangle* intersectTriangles,
 	__global SubBvhNode* subBvh,
-	__global TopBvhNode* topLevelBvh)
+	__global TopBvhNode* topLevelBvh,
+	__global TopBvhInstance* topLevelInstances)
 {
 	size_t gid = get_global_id(0);
 
@@ -100,51 +104,47 @@ __kernel void intersectShadows(
 	if (get_local_id(0) == 0)
 	{
 		loadScene(
-			vertices,
-			triangles,
+			NULL,
+			NULL,
+			intersectTriangles,
 			NULL,
 			0,
 			NULL,
 			subBvh,
 			inputData->topLevelBvhRoot,
 			topLevelBvh,
+			topLevelInstances,
 			&scene);
+		scene.traversalStackOverflow = &inputData->traversalStackOverflow;
 	}
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	RayData shadowData = inShadowRays[gid];
-	if (gid >= inputData->numOutRays)
-		return;
-	inShadowRays[gid].flags = SHADINGFLAGS_HASFINISHED;
-	if (shadowData.flags & SHADINGFLAGS_HASFINISHED)
+	if (gid >= inputData->numShadowRays)
 		return;
+	RayQueue shadowQueue = createRayQueue(inShadowRays, inputData->maxRays);
+	Ray ray = loadRayGeometry(&shadowQueue, gid);
 
-	bool hit = traceRay(
+	bool hit = traceShadowRay(
 		inTraversalStack,
 		&scene,
-		&shadowData.ray,
-		true,
-		shadowData.rayLength,//-0.01f,
-		NULL,
-		NULL,
-		NULL,
-		NULL);
+		&ray,
+		as_float(shadowQueue.numBounces[gid]));// Ray length
 	if (!hit)
 	{
-		outputPixels[shadowData.outputPixel] += shadowData.multiplier;
+		outputPixels[shadowQueue.outputPixels[gid]] += shadowQueue.multipliers[gid];
 	}
 }
 
 __kernel void intersectWalk(
 	__global ShadingData* outShadingData,
 
-	__global RayData* inRays,
+	__global uchar* inRays,
 	__global uint* inTraversalStack,
 	volatile __global KernelData* inputData,
-	__global VertexData* vertices,
-	__global TriangleData* triangles,
+	__global IntersectTriangle* intersectTriangles,
 	__global SubBvhNode* subBvh,
 	__global TopBvhNode* topLevelBvh,
+	__global TopBvhInstance* topLevelInstances,
 	__global float3* outputPixels)
 {
 	size_t gid = get_global_id(0);
@@ -153,46 +153,183 @@ __kernel void intersectWalk(
 	if (get_local_id(0) == 0)
 	{
 		loadScene(
-			vertices,
-			triangles,
+			NULL,// Only the intersection triangles are needed for intersection
+			NULL,
+			intersectTriangles,
 			NULL,// Dont need materials for intersection
 			0,
 			NULL,// Dont need emissive triangles for intersection
 			subBvh,
 			inputData->topLevelBvhRoot,
 			topLevelBvh,
+			topLevelInstances,
 			&scene);
+		scene.traversalStackOverflow = &inputData->traversalStackOverflow;
 	}
 	barrier(CLK_LOCAL_MEM_FENCE);
 
-	RayData rayData = inRays[gid];
+	RayQueue inQueue = createRayQueue(inRays, inputData->maxRays);
 	ShadingData shadingData;
 	shadingData.hit = false;
 
-	if (gid < (inputData->numInRays + inputData->newRays) && !(rayData.flags & SHADINGFLAGS_HASFINISHED))
+	if (gid < (inputData->numInRays + inputData->newRays) && !(inQueue.flags[gid] & SHADINGFLAGS_HASFINISHED))
 	{
+		Ray ray = loadRayGeometry(&inQueue, gid);
 		// Trace rays
+#ifdef COUNT_TRAVERSAL
+		TraversalCount count;
+#endif
 		shadingData.hit = traceRay(
 			inTraversalStack,
 			&scene,
-			&rayData.ray,
+			&ray,
 			false,
 			INFINITY,
 			&shadingData.triangleIndex,
 			&shadingData.t,
 			&shadingData.uv,
-			&shadingData.invTransform);
+			&shadingData.instanceIndex
+#ifdef COUNT_TRAVERSAL
+			, &count
+#endif
+			);
+#ifdef COUNT_TRAVERSAL
+		atomic_inc(&inputData->numTraversedRays);
+		atomic_add(&inputData->numNodeVisits, count.nodeVisits);
+		atomic_add(&inputData->numTriangleVisits, count.triangleVisits);
+#endif
 	}
 
 	outShadingData[gid] = shadingData;
 }
 
+// Persistent threads variant of intersectWalk (Aila & Laine 2009). Only enough work groups to fill the device are
+// launched; whenever all threads of a work group have finished their ray it fetches the next batch of rays (one per
+// thread) from the global counter. Work groups that get long rays no longer hold back the rest of the pass.
+__kernel void intersectWalkPersistent(
+	__global ShadingData* outShadingData,
+
+	__global uchar* inRays,
+	__global uint* inTraversalStack,
+	volatile __global KernelData* inputData,
+	__global IntersectTriangle* intersectTriangles,
+	__global SubBvhNode* subBvh,
+	__global TopBvhNode* topLevelBvh,
+	__global TopBvhInstance* topLevelInstances,
+	__global float3* outputPixels)
+{
+	size_t lid = get_local_id(0);
+
+	__local Scene scene;
+	if (lid == 0)
+	{
+		loadScene(
+			NULL,// Only the intersection triangles are needed for intersection
+			NULL,
+			intersectTriangles,
+			NULL,// Dont need materials for intersection
+			0,
+			NULL,// Dont need emissive triangles for intersection
+			subBvh,
+			inputData->topLevelBvhRoot,
+			topLevelBvh,
+			topLevelInstances,
+			&scene);
+		scene.traversalStackOverflow = &inputData->traversalStackOverflow;
+	}
+
+	RayQueue inQueue = createRayQueue(inRays, inputData->maxRays);
+	uint numRays = inputData->numInRays + inputData->newRays;
+	__local uint batchStart;
+	while (true)
+	{
+		// Also makes sure that every thread has read batchStart before it is overwritten
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (lid == 0)
+			batchStart = atomic_add(&inputData->rayFetchCounter, get_local_size(0));
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (batchStart >= numRays)// Same value for the whole work group
+			break;
+
+		uint rayIndex = batchStart + lid;
+		if (rayIndex >= numRays)
+			continue;
+
+		if (inQueue.flags[rayIndex] & SHADINGFLAGS_HASFINISHED)
+			continue;// The shading kernel skips finished rays so it does not need the shading data
+
+		Ray ray = loadRayGeometry(&inQueue, rayIndex);
+		ShadingData shadingData;
+#ifdef COUNT_TRAVERSAL
+		TraversalCount count;
+#endif
+		shadingData.hit = traceRay(
+			inTraversalStack,
+			&scene,
+			&ray,
+			false,
+			INFINITY,
+			&shadingData.triangleIndex,
+			&shadingData.t,
+			&shadingData.uv,
+			&shadingData.instanceIndex
+#ifdef COUNT_TRAVERSAL
+			, &count
+#endif
+			);
+#ifdef COUNT_TRAVERSAL
+		atomic_inc(&inputData->numTraversedRays);
+		atomic_add(&inputData->numNodeVisits, count.nodeVisits);
+		atomic_add(&inputData->numTriangleVisits, count.triangleVisits);
+#endif
+		outShadingData[rayIndex] = shadingData;
+	}
+}
+
+// Appends the extension ray and the shadow ray (if there is one) of a shaded ray to the output queues. Must be reached
+// by all threads of the work group.
+void appendOutputRays(
+	bool active,
+	RayData* outRayData,
+	const RayData* outShadowRayData,
+	__global uchar* outRays,
+	__global uchar* outShadowRays,
+	volatile __global KernelData* inputData,
+	__local uint* compactionScratch,
+	__local uint* shadowCompactionScratch)
+{
+	int index = workgroup_counter_inc(&inputData->numOutRays, active, compactionScratch);
+	if (active)
+	{
+		if (outRayData->numBounces >= MAX_ITERATIONS)
+			outRayData->flags = SHADINGFLAGS_HASFINISHED;
+
+		RayQueue outQueue = createRayQueue(outRays, inputData->maxRays);
+		storeRay(&outQueue, index, outRayData);
+	}
+
+	// Shadow rays have their own queue so that intersectShadows does not have to skip the ones that were not created
+	bool hasShadowRay = active && !(outShadowRayData->flags & SHADINGFLAGS_HASFINISHED);
+	int shadowIndex = workgroup_counter_inc(&inputData->numShadowRays, hasShadowRay, shadowCompactionScratch);
+	if (hasShadowRay)
+	{
+		// Only the fields that intersectShadows uses
+		RayQueue shadowQueue = createRayQueue(outShadowRays, inputData->maxRays);
+		shadowQueue.origins[shadowIndex] = outShadowRayData->ray.origin;
+		shadowQueue.directions[shadowIndex] = outShadowRayData->ray.direction;
+		shadowQueue.multipliers[shadowIndex] = outShadowRayData->multiplier;
+		shadowQueue.outputPixels[shadowIndex] = outShadowRayData->outputPixel;
+		shadowQueue.numBounces[shadowIndex] = as_int(outShadowRayData->rayLength);
+	}
+}
+
 __kernel void shade(
 	__global float3* outputPixels,
-	__global RayData* outRays,
-	__global RayData* outShadowRays,
+	__global uchar* outRays,
+	__global uchar* outShadowRays,
 
-	__global RayData* inRays,
+	__global uchar* inRays,
 	__global ShadingData* inShadingData,
 	volatile __global KernelData* inputData,
 
@@ -200,6 +337,7 @@ __kernel void shade(
 	__global TriangleData* triangles,
 	__global EmissiveTriangle* emissiveTriangles,
 	__global Material* materials,
+	__global TopBvhInstance* topLevelInstances,
 	__read_only image2d_array_t materialTextures,
 	__read_only image2d_array_t skydomeTextures,
 	__global randHostStream* randomStreams)
@@ -207,7 +345,7 @@ __kernel void shade(
 	size_t gid = get_global_id(0);
 	RayData outRayData;
 	RayData outShadowRayData;
-	const __global RayData* rayData = &inRays[gid];// TODO: use pointer to safe registers
+	RayQueue inQueue = createRayQueue(inRays, inputData->maxRays);
 	const __global ShadingData* shadingData = &inShadingData[gid];// TODO: use pointer to safe registers
 	bool active = false;
 
@@ -217,64 +355,68 @@ __kernel void shade(
 		loadScene(
 			vertices,
 			triangles,
+			NULL,// Intersection data is not used for shading
 			materials,// Dont need materials for intersection
 			inputData->numEmissiveTriangles,
 			emissiveTriangles,// Dont need emissive triangles for intersection
 			NULL,
 			0,
 			NULL,
+			NULL,
 			&scene);
 	}
 	barrier(CLK_LOCAL_MEM_FENCE);
 
 	if (gid < (inputData->numInRays + inputData->newRays) &&
-		!(rayData->flags & SHADINGFLAGS_HASFINISHED))
+		!(inQueue.flags[gid] & SHADINGFLAGS_HASFINISHED))
 	{
+		RayData rayData = loadRay(&inQueue, gid);
 		if (shadingData->hit)
 		{
-			outRayData.outputPixel = rayData->outputPixel;
-			outShadowRayData.outputPixel = rayData->outputPixel;
+			outRayData.outputPixel = rayData.outputPixel;
+			outShadowRayData.outputPixel = rayData.outputPixel;
 			outRayData.flags = 0;
 			outShadowRayData.flags = 0;
-			outRayData.numBounces = rayData->numBounces + 1;
+			outRayData.numBounces = rayData.numBounces + 1;
 			outRayData.pdf = 0;
 
-			float3 intersection = rayData->ray.origin + shadingData->t * rayData->ray.direction;
+			float3 intersection = rayData.ray.origin + shadingData->t * rayData.ray.direction;
 
 			// Load random streams
 			randStream randomStream;
 			randCopyOverStreamsFromGlobal(1, &randomStream, &randomStreams[gid]);
 
 #ifdef COMPARE_SHADING
-			if ((rayData->outputPixel % inputData->scrWidth) < inputData->scrWidth / 2)
+			if ((rayData.outputPixel % inputData->scrWidth) < inputData->scrWidth / 2)
 			{
-				outputPixels[rayData->outputPixel] += neeMisShading(
+				outputPixels[rayData.outputPixel] += neeMisShading(
 					&scene,
 					shadingData->triangleIndex,
 					intersection,
-					normalize(rayData->ray.direction),
+					normalize(rayData.ray.direction),
 					shadingData->t,
-					shadingData->invTransform,
+					topLevelInstances[shadingData->instanceIndex].invTransform,
 					shadingData->uv,
                     materialTextures,
 					&randomStream,
-					rayData,
+					&rayData,
 					&outRayData,
 					&outShadowRayData);
 			} else
 #endif
 			{
-				outputPixels[rayData->outputPixel] += neeIsShading(
+				outputPixels[rayData.outputPixel] += neeIsShading(
 					&scene,
 					shadingData->triangleIndex,
+					scene.meshMaterials[scene.triangles[shadingData->triangleIndex].mat_index].type,
 					intersection,
-					normalize(rayData->ray.direction),
+					normalize(rayData.ray.direction),
 					shadingData->t,
-					shadingData->invTransform,
+					topLevelInstances[shadingData->instanceIndex].invTransform,
 					shadingData->uv,
                     materialTextures,
 					&randomStream,
-					rayData,
+					&rayData,
 					&outRayData,
 					&outShadowRayData);
 			}
@@ -284,20 +426,255 @@ __kernel void shade(
 			randCopyOverStreamsToGlobal(1, &randomStreams[gid], &randomStream);
 		} else {
 			// We missed the scene but have a skydome to fall back to
-			float3 c = readSkydome(normalize(rayData->ray.direction), skydomeTextures);
-			outputPixels[rayData->outputPixel] += rayData->multiplier * c;
+			float3 c = readSkydome(normalize(rayData.ray.direction), skydomeTextures);
+			outputPixels[rayData.outputPixel] += rayData.multiplier * c;
+		}
+	}
+
+	__local uint compactionScratch[WORKGROUP_COUNTER_SCRATCH_SIZE];
+	__local uint shadowCompactionScratch[WORKGROUP_COUNTER_SCRATCH_SIZE];
+	appendOutputRays(
+		active,
+		&outRayData,
+		&outShadowRayData,
+		outRays,
+		outShadowRays,
+		inputData,
+		compactionScratch,
+		shadowCompactionScratch);
+}
+
+// Material sorted shading (Laine et al. 2013). Instead of shading all hits in one kernel (in which the threads of a
+// work group run the code paths of different material types), classifyHits bins the hits into one queue per material
+// type and shades the misses. Every queue is then shaded by a kernel that only contains the code of its material type.
+__kernel void classifyHits(
+	__global float3* outputPixels,
+	__global uint* outMaterialQueues,
+
+	__global uchar* inRays,
+	__global ShadingData* inShadingData,
+	volatile __global KernelData* inputData,
+
+	__global TriangleData* triangles,
+	__global Material* materials,
+	__read_only image2d_array_t skydomeTextures)
+{
+	size_t gid = get_global_id(0);
+	RayQueue inQueue = createRayQueue(inRays, inputData->maxRays);
+
+	bool hit = false;
+	MaterialType materialType;
+	if (gid < (inputData->numInRays + inputData->newRays) &&
+		!(inQueue.flags[gid] & SHADINGFLAGS_HASFINISHED))
+	{
+		hit = inShadingData[gid].hit;
+		if (hit)
+		{
+			materialType = materials[triangles[inShadingData[gid].triangleIndex].mat_index].type;
+		} else {
+			// We missed the scene but have a skydome to fall back to
+			float3 c = readSkydome(normalize(inQueue.directions[gid]), skydomeTextures);
+			outputPixels[inQueue.outputPixels[gid]] += inQueue.multipliers[gid] * c;
 		}
 	}
 
-	int index = workgroup_counter_inc(&inputData->numOutRays, active);
+	__local uint compactionScratch[WORKGROUP_COUNTER_SCRATCH_SIZE];
+	for (int type = DIFFUSE; type <= EMISSIVE; type++)
+	{
+		bool append = hit && materialType == type;
+		uint index = workgroup_counter_inc(&inputData->numMaterialRays[type], append, compactionScratch);
+		if (append)
+			outMaterialQueues[type * inputData->maxRays + index] = gid;
+	}
+}
+
+void shadeMaterialQueue(
+	MaterialType materialType,
+	__global float3* outputPixels,
+	__global uchar* outRays,
+	__global uchar* outShadowRays,
+
+	__global const uint* inMaterialQueues,
+	__global uchar* inRays,
+	__global ShadingData* inShadingData,
+	volatile __global KernelData* inputData,
+
+	__global VertexData* vertices,
+	__global TriangleData* triangles,
+	__global EmissiveTriangle* emissiveTriangles,
+	__global Material* materials,
+	__global TopBvhInstance* topLevelInstances,
+	__read_only image2d_array_t materialTextures,
+	__global randHostStream* randomStreams,
+
+	__local Scene* scene,
+	__local uint* compactionScratch,
+	__local uint* shadowCompactionScratch)
+{
+	size_t gid = get_global_id(0);
+	if (get_local_id(0) == 0)
+	{
+		loadScene(
+			vertices,
+			triangles,
+			NULL,// Intersection data is not used for shading
+			materials,
+			inputData->numEmissiveTriangles,
+			emissiveTriangles,
+			NULL,
+			0,
+			NULL,
+			NULL,
+			scene);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	RayData outRayData;
+	RayData outShadowRayData;
+	bool active = gid < inputData->numMaterialRays[materialType];
 	if (active)
 	{
-		if (outRayData.numBounces >= MAX_ITERATIONS)
-			outRayData.flags = SHADINGFLAGS_HASFINISHED;
+		uint rayIndex = inMaterialQueues[materialType * inputData->maxRays + gid];
+		RayQueue inQueue = createRayQueue(inRays, inputData->maxRays);
+		RayData rayData = loadRay(&inQueue, rayIndex);
+		const __global ShadingData* shadingData = &inShadingData[rayIndex];
+
+		outRayData.outputPixel = rayData.outputPixel;
+		outShadowRayData.outputPixel = rayData.outputPixel;
+		outRayData.flags = 0;
+		outShadowRayData.flags = 0;
+		outRayData.numBounces = rayData.numBounces + 1;
+		outRayData.pdf = 0;
+
+		float3 intersection = rayData.ray.origin + shadingData->t * rayData.ray.direction;
+
+		// Load random streams (of the ray, like in shade)
+		randStream randomStream;
+		randCopyOverStreamsFromGlobal(1, &randomStream, &randomStreams[rayIndex]);
+
+		outputPixels[rayData.outputPixel] += neeIsShading(
+			scene,
+			shadingData->triangleIndex,
+			materialType,
+			intersection,
+			normalize(rayData.ray.direction),
+			shadingData->t,
+			topLevelInstances[shadingData->instanceIndex].invTransform,
+			shadingData->uv,
+			materialTextures,
+			&randomStream,
+			&rayData,
+			&outRayData,
+			&outShadowRayData);
+
+		randCopyOverStreamsToGlobal(1, &randomStreams[rayIndex], &randomStream);
+	}
+
+	appendOutputRays(
+		active,
+		&outRayData,
+		&outShadowRayData,
+		outRays,
+		outShadowRays,
+		inputData,
+		compactionScratch,
+		shadowCompactionScratch);
+}
+
+#define SHADE_MATERIAL_KERNEL(KERNEL_NAME, MATERIAL_TYPE) \
+	__kernel void KERNEL_NAME( \
+		__global float3* outputPixels, \
+		__global uchar* outRays, \
+		__global uchar* outShadowRays, \
+		__global const uint* inMaterialQueues, \
+		__global uchar* inRays, \
+		__global ShadingData* inShadingData, \
+		volatile __global KernelData* inputData, \
+		__global VertexData* vertices, \
+		__global TriangleData* triangles, \
+		__global EmissiveTriangle* emissiveTriangles, \
+		__global Material* materials, \
+		__global TopBvhInstance* topLevelInstances, \
+		__read_only image2d_array_t materialTextures, \
+		__global randHostStream* randomStreams) \
+	{ \
+		__local Scene scene; \
+		__local uint compactionScratch[WORKGROUP_COUNTER_SCRATCH_SIZE]; \
+		__local uint shadowCompactionScratch[WORKGROUP_COUNTER_SCRATCH_SIZE]; \
+		shadeMaterialQueue(MATERIAL_TYPE, outputPixels, outRays, outShadowRays, inMaterialQueues, inRays, \
+			inShadingData, inputData, vertices, triangles, emissiveTriangles, materials, topLevelInstances, \
+			materialTextures, randomStreams, &scene, compactionScratch, shadowCompactionScratch); \
+	}
 
-		outRays[index] = outRayData;
-		outShadowRays[index] = outShadowRayData;
+SHADE_MATERIAL_KERNEL(shadeDiffuse, DIFFUSE)
+SHADE_MATERIAL_KERNEL(shadePbr, PBR)
+SHADE_MATERIAL_KERNEL(shadeRefractive, REFRACTIVE)
+SHADE_MATERIAL_KERNEL(shadeBasicRefractive, BASIC_REFRACTIVE)
+SHADE_MATERIAL_KERNEL(shadeEmissive, EMISSIVE)
+
+// Sort key of a ray for the optional ray reordering: the quantized direction (3 bits per axis) in the high bits so
+// that rays in the same batch point the same way, then the Morton code of the quantized origin (5 bits per axis).
+// Launched over the whole ray buffer; the unused entries get the largest key so they stay at the end.
+__kernel void computeRaySortKeys(
+	__global uchar* rays,
+	volatile __global KernelData* inputData,
+	float3 sceneMin,
+	float3 sceneInvExtent,
+	__global uint* outKeys,
+	__global uint* outValues)
+{
+	size_t gid = get_global_id(0);
+	outValues[gid] = gid;
+	if (gid >= inputData->numInRays)
+	{
+		outKeys[gid] = 0xFFFFFFFF;
+		return;
 	}
+
+	RayQueue queue = createRayQueue(rays, inputData->maxRays);
+	const Ray ray = loadRayGeometry(&queue, gid);
+	uint3 direction = convert_uint3(clamp((ray.direction * 0.5f + 0.5f) * 8.0f, 0.0f, 7.0f));
+	uint3 origin = convert_uint3(clamp((ray.origin - sceneMin) * sceneInvExtent * 32.0f, 0.0f, 31.0f));
+
+	uint morton = 0;
+	for (int i = 0; i < 5; i++)
+		morton |= (((origin.x >> i) & 1) << (3 * i + 2)) | (((origin.y >> i) & 1) << (3 * i + 1)) | (((origin.z >> i) & 1) << (3 * i));
+
+	outKeys[gid] = (((direction.x << 6) | (direction.y << 3) | direction.z) << 15) | morton;
+}
+
+__kernel void reorderRays(
+	__global uchar* inRays,
+	__global const uint* sortedIndices,
+	volatile __global KernelData* inputData,
+	__global uchar* outRays)
+{
+	size_t gid = get_global_id(0);
+	if (gid >= inputData->numInRays)
+		return;
+
+	RayQueue inQueue = createRayQueue(inRays, inputData->maxRays);
+	RayQueue outQueue = createRayQueue(outRays, inputData->maxRays);
+	RayData rayData = loadRay(&inQueue, sortedIndices[gid]);
+	storeRay(&outQueue, gid, &rayData);
+}
+
+__kernel void scatterTopBvhUpdates(
+	__global const TopBvhNodeUpdate* updates,
+	uint numUpdates,
+	uint numInstances,
+	__global TopBvhNode* topLevelBvh,
+	__global TopBvhInstance* topLevelInstances)
+{
+	size_t gid = get_global_id(0);
+	if (gid >= numUpdates)
+		return;
+
+	// Instance i belongs to leaf node i
+	uint nodeIndex = updates[gid].nodeIndex;
+	topLevelBvh[nodeIndex] = updates[gid].node;
+	if (nodeIndex < numInstances)
+		topLevelInstances[nodeIndex] = updates[gid].instance;
 }
 
 __kernel void updateKernelData(
@@ -314,4 +691,7 @@ __kernel void updateKernelData(
 	data->numShadowRays = 0;
 	data->rayOffset += data->newRays;
 	data->newRays = 0;
+	data->rayFetchCounter = 0;
+	for (int i = 0; i < 5; i++)
+		data->numMaterialRays[i] = 0;
 }
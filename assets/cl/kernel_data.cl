@@ -19,14 +19,26 @@ typedef struct
 	uint numInRays;
 	uint numOutRays;
 	uint numShadowRays;
+	uint numMaterialRays[5];// Per MaterialType, for material sorted shading
 	uint maxRays;
 	uint newRays;
+
+	// Used by the persistent threads traversal
+	uint rayFetchCounter;
+
+	// Totals of the frame with COUNT_TRAVERSAL
+	uint numTraversedRays;
+	uint numNodeVisits;
+	uint numTriangleVisits;
+
+	// Set when a traversal stack was too small for the BVHs
+	uint traversalStackOverflow;
 } KernelData;
 
 typedef struct
 {
 	float2 uv;
-	const __global float* invTransform;
+	uint instanceIndex;
 	int triangleIndex;
 	float t;
 	bool hit;
@@ -0,0 +1,126 @@
+// Least significant digit radix sort of (key, value) pairs, RADIX_BITS bits per pass. A pass consists of four kernels:
+//  radixSortHistogram: count the digits per work group (stored digit major so that a single scan gives the offsets)
+//  radixSortScanBlocks: exclusive scan of every block of RADIX_SCAN_BLOCK_SIZE counts, storing the total of each block
+//  radixSortScanBlockSums: exclusive scan over the block totals (one work group)
+//  radixSortScatter: move every pair to its offset (scanned count + scanned block total), stable within a work group
+// The histogram and scatter kernels must be launched with the same global size and a work group size of 64. The scan
+// kernels use work groups of RADIX_SCAN_WORK_GROUP_SIZE.
+#define RADIX_BITS 4
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_WORK_GROUP_SIZE 64
+#define RADIX_SCAN_WORK_GROUP_SIZE 256
+#define RADIX_SCAN_ENTRIES_PER_THREAD 4
+#define RADIX_SCAN_BLOCK_SIZE (RADIX_SCAN_WORK_GROUP_SIZE * RADIX_SCAN_ENTRIES_PER_THREAD)
+
+__kernel void radixSortHistogram(
+	__global const uint* keys,
+	uint numKeys,
+	uint shift,
+	__global uint* outHistograms)
+{
+	size_t gid = get_global_id(0);
+	size_t lid = get_local_id(0);
+
+	__local uint counts[RADIX_SIZE];
+	if (lid < RADIX_SIZE)
+		counts[lid] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (gid < numKeys)
+		atomic_inc(&counts[(keys[gid] >> shift) & (RADIX_SIZE - 1)]);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (lid < RADIX_SIZE)
+		outHistograms[lid * get_num_groups(0) + get_group_id(0)] = counts[lid];
+}
+
+// Exclusive scan of (up to) RADIX_SCAN_BLOCK_SIZE entries by the whole work group, returns the total of the entries
+uint scanBlock(
+	__global uint* entries,
+	uint numEntries,
+	__local uint* sums)
+{
+	size_t lid = get_local_id(0);
+
+	// Every thread scans a consecutive range of the block
+	uint begin = min((uint)lid * RADIX_SCAN_ENTRIES_PER_THREAD, numEntries);
+	uint end = min(begin + RADIX_SCAN_ENTRIES_PER_THREAD, numEntries);
+
+	uint sum = 0;
+	for (uint i = begin; i < end; i++)
+		sum += entries[i];
+
+	// Inclusive scan (Hillis & Steele) of the per thread sums
+	sums[lid] = sum;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint offset = 1; offset < RADIX_SCAN_WORK_GROUP_SIZE; offset *= 2)
+	{
+		uint value = lid >= offset ? sums[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		sums[lid] += value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	uint prefix = sums[lid] - sum;
+	for (uint i = begin; i < end; i++)
+	{
+		uint count = entries[i];
+		entries[i] = prefix;
+		prefix += count;
+	}
+	return sums[RADIX_SCAN_WORK_GROUP_SIZE - 1];
+}
+
+__kernel void radixSortScanBlocks(
+	__global uint* histograms,
+	uint numEntries,
+	__global uint* outBlockSums)
+{
+	__local uint sums[RADIX_SCAN_WORK_GROUP_SIZE];
+	uint blockStart = get_group_id(0) * RADIX_SCAN_BLOCK_SIZE;
+	uint total = scanBlock(histograms + blockStart, min(numEntries - blockStart, (uint)RADIX_SCAN_BLOCK_SIZE), sums);
+	if (get_local_id(0) == 0)
+		outBlockSums[get_group_id(0)] = total;
+}
+
+__kernel void radixSortScanBlockSums(
+	__global uint* blockSums,
+	uint numBlocks)
+{
+	// The host makes sure that all block totals fit in a single block
+	__local uint sums[RADIX_SCAN_WORK_GROUP_SIZE];
+	scanBlock(blockSums, numBlocks, sums);
+}
+
+__kernel void radixSortScatter(
+	__global const uint* keys,
+	__global const uint* values,
+	uint numKeys,
+	uint shift,
+	__global const uint* histogramOffsets,
+	__global const uint* blockOffsets,
+	__global uint* outKeys,
+	__global uint* outValues)
+{
+	size_t gid = get_global_id(0);
+	size_t lid = get_local_id(0);
+
+	__local uint digits[RADIX_WORK_GROUP_SIZE];
+	uint key = gid < numKeys ? keys[gid] : 0;
+	uint digit = gid < numKeys ? (key >> shift) & (RADIX_SIZE - 1) : RADIX_SIZE;// Out of range threads match no digit
+	digits[lid] = digit;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (gid >= numKeys)
+		return;
+
+	// Keys of this work group with the same digit that come before this one
+	uint rank = 0;
+	for (uint i = 0; i < lid; i++)
+		rank += (digits[i] == digit);
+
+	uint entry = digit * get_num_groups(0) + get_group_id(0);
+	uint outIndex = blockOffsets[entry / RADIX_SCAN_BLOCK_SIZE] + histogramOffsets[entry] + rank;
+	outKeys[outIndex] = key;
+	outValues[outIndex] = values[gid];
+}
@@ -0,0 +1,66 @@
+#ifndef __RAY_QUEUE_CL
+#define __RAY_QUEUE_CL
+#include "ray.cl"
+#include "shading.cl"
+
+// Ray queue stored as a structure of arrays: every RayData field is a separate stream in the same buffer so that a
+// kernel only reads the fields that it uses (with coalesced accesses). A buffer holds capacity rays:
+//  origins, directions, multipliers: float3 (16 bytes)
+//  outputPixels, flags, numBounces / rayLength, pdfs: 4 bytes
+// The total of 64 bytes per ray must match RAY_QUEUE_BYTES_PER_RAY in raytracer.cpp.
+typedef struct
+{
+	__global float3* origins;
+	__global float3* directions;
+	__global float3* multipliers;
+	__global uint* outputPixels;
+	__global int* flags;
+	__global int* numBounces;// Shadow rays store the ray length (as_float)
+	__global float* pdfs;
+} RayQueue;
+
+RayQueue createRayQueue(__global uchar* buffer, uint capacity)
+{
+	RayQueue queue;
+	queue.origins = (__global float3*)buffer;
+	queue.directions = queue.origins + capacity;
+	queue.multipliers = queue.directions + capacity;
+	queue.outputPixels = (__global uint*)(queue.multipliers + capacity);
+	queue.flags = (__global int*)(queue.outputPixels + capacity);
+	queue.numBounces = queue.flags + capacity;
+	queue.pdfs = (__global float*)(queue.numBounces + capacity);
+	return queue;
+}
+
+Ray loadRayGeometry(const RayQueue* queue, uint index)
+{
+	Ray ray;
+	ray.origin = queue->origins[index];
+	ray.direction = queue->directions[index];
+	return ray;
+}
+
+RayData loadRay(const RayQueue* queue, uint index)
+{
+	RayData rayData;
+	rayData.ray = loadRayGeometry(queue, index);
+	rayData.multiplier = queue->multipliers[index];
+	rayData.outputPixel = queue->outputPixels[index];
+	rayData.flags = queue->flags[index];
+	rayData.numBounces = queue->numBounces[index];
+	rayData.pdf = queue->pdfs[index];
+	return rayData;
+}
+
+void storeRay(const RayQueue* queue, uint index, const RayData* rayData)
+{
+	queue->origins[index] = rayData->ray.origin;
+	queue->directions[index] = rayData->ray.direction;
+	queue->multipliers[index] = rayData->multiplier;
+	queue->outputPixels[index] = rayData->outputPixel;
+	queue->flags[index] = rayData->flags;
+	queue->numBounces[index] = rayData->numBounces;
+	queue->pdfs[index] = rayData->pdf;
+}
+
+#endif // __RAY_QUEUE_CL
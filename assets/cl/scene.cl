@@ -14,13 +14,16 @@ typedef struct
 	uint numVertices, numTriangles, numEmissiveTriangles, numLights;
 	const __global VertexData* vertices;
 	const __global TriangleData* triangles;
+	const __global IntersectTriangle* intersectTriangles;// Same order as the triangles
 	const __global Material* meshMaterials;
 
 	const __global EmissiveTriangle* emissiveTriangles;
 
 	const __global SubBvhNode* subBvh;
 	const __global TopBvhNode* topLevelBvh;
+	const __global TopBvhInstance* topLevelInstances;
 	uint topLevelBvhRoot;
+	volatile __global uint* traversalStackOverflow;// Set to 1 when a traversal stack push is dropped (NULL: not reported)
 
 	float refractiveIndex;
 
@@ -36,12 +39,14 @@ void getVertices(VertexData* out_vertices, uint* indices, const __local Scene* s
 void loadScene(
 	const __global VertexData* vertices,
 	const __global TriangleData* triangles,
+	const __global IntersectTriangle* intersectTriangles,
 	const __global Material* materials,
 	uint numEmissiveTriangles,
 	const __global EmissiveTriangle* emissiveTriangles,
 	const __global SubBvhNode* subBvh,
 	uint topLevelBvhRoot,
 	const __global TopBvhNode* topLevelBvh,
+	const __global TopBvhInstance* topLevelInstances,
 	__local Scene* scene) {
 	scene->refractiveIndex =  1.000277f;
 	
@@ -49,15 +54,70 @@ void loadScene(
 
 	scene->vertices = vertices;
 	scene->triangles = triangles;
+	scene->intersectTriangles = intersectTriangles;
 	scene->meshMaterials = materials;
 	
 	scene->emissiveTriangles = emissiveTriangles;
  
 	scene->subBvh = subBvh;
 	scene->topLevelBvh = topLevelBvh;
+	scene->topLevelInstances = topLevelInstances;
 	scene->topLevelBvhRoot = topLevelBvhRoot;
+	scene->traversalStackOverflow = NULL;
 }
 
+// Traversal stack of which the top TRAVERSAL_SHORT_STACK_SIZE entries are kept in local memory (as a ring buffer). When
+// the short stack is full, pushing spills its bottom entry to global memory. Most rays never get that deep. The top-level
+// and sub BVH traversals share the stack: the sub BVH entries are pushed on top of the remaining top-level entries.
+typedef struct
+{
+	__local uint* shortStack;
+	__global uint* spillStack;
+	uint size;
+	uint numSpilled;
+	volatile __global uint* overflow;
+} TraversalStack;
+
+void stackPush(TraversalStack* stack, uint value)
+{
+	// The host sizes the stack for the deepest top-level and sub BVH (see calcTraversalStackSize in raytracer.cpp). Should
+	// a BVH still get deeper the entry is dropped instead of overwriting the spill memory of the next ray, and the host
+	// is told about it.
+	if (stack->size == TRAVERSAL_STACK_SIZE)
+	{
+		if (stack->overflow)
+			*stack->overflow = 1;
+		return;
+	}
+
+	if (stack->size - stack->numSpilled == TRAVERSAL_SHORT_STACK_SIZE)
+	{
+		// The oldest entry uses the same ring buffer slot as the new one
+		stack->spillStack[stack->numSpilled] = stack->shortStack[stack->numSpilled % TRAVERSAL_SHORT_STACK_SIZE];
+		stack->numSpilled++;
+	}
+	stack->shortStack[stack->size++ % TRAVERSAL_SHORT_STACK_SIZE] = value;
+}
+
+uint stackPop(TraversalStack* stack)
+{
+	stack->size--;
+	if (stack->size < stack->numSpilled)
+	{
+		stack->numSpilled = stack->size;
+		return stack->spillStack[stack->size];
+	}
+	return stack->shortStack[stack->size % TRAVERSAL_SHORT_STACK_SIZE];
+}
+
+#ifdef COUNT_TRAVERSAL
+typedef struct
+{
+	uint nodeVisits;// Bounding box tests
+	uint triangleVisits;// Triangle intersection tests
+} TraversalCount;
+#endif
+
 bool traceRay(
 	__global uint* inTraversalStack,
 	const __local Scene* scene,
@@ -68,74 +128,64 @@ bool traceRay(
 	float* outT,
 	float2* outUV,
 #ifdef COUNT_TRAVERSAL
-	const __global float** outInvTransform,
-	int* count)
+	uint* outInstanceIndex,
+	TraversalCount* count)
 #else
-	const __global float** outInvTransform)
+	uint* outInstanceIndex)
 #endif
 {
 	int triangleIndex;
 	float closestT = maxT;
 	float2 closestUV;
-	const __global float* closestMatrix;
+	uint closestInstance;
 #ifdef USE_BVH
 
 #ifdef COUNT_TRAVERSAL
-	if (count) *count = 0;
+	if (count)
+	{
+		count->nodeVisits = 0;
+		count->triangleVisits = 0;
+	}
 #endif
 	// Check mesh intersection using BVH traversal
-	//unsigned int subBvhStack[32];
-	__global uint* subBvhStack = &inTraversalStack[get_global_id(0) * 32];
-	int subBvhStackPtr = 0;
-
-	// Traverse top level BVH and add relevant sub-BVH's to the "sub BVH" stacks
-	__local unsigned int topLevelBvhStackLocal[10 * 64];
-	__local unsigned int* topLevelBvhStack = &topLevelBvhStackLocal[
-		get_local_id(0) * 10];
-	//unsigned int topLevelBvhStack[16];
-	unsigned int topLevelBvhStackPtr = 0;
-	topLevelBvhStack[topLevelBvhStackPtr++] = scene->topLevelBvhRoot;
+	__local uint shortStackLocal[TRAVERSAL_SHORT_STACK_SIZE * 64];
+	TraversalStack stack;
+	stack.shortStack = &shortStackLocal[get_local_id(0) * TRAVERSAL_SHORT_STACK_SIZE];
+	stack.spillStack = &inTraversalStack[get_global_id(0) * (TRAVERSAL_STACK_SIZE - TRAVERSAL_SHORT_STACK_SIZE)];
+	stack.size = 0;
+	stack.numSpilled = 0;
+	stack.overflow = scene->traversalStackOverflow;
+
+	// Traverse top level BVH and add relevant sub-BVH's to the stack
+	stackPush(&stack, scene->topLevelBvhRoot);
+	RayBoxData rayBoxData = createRayBoxData(ray);
 
 	while (true)
 	{
 		unsigned int subBvhNodeId = -1;
-		const __global float* invTransform;
+		uint instanceIndex;
 		Ray transformedRay;
+		RayBoxData transformedRayBoxData;
 		
-		while (topLevelBvhStackPtr > 0)
+		while (stack.size > 0)
 		{
 
 #ifdef COUNT_TRAVERSAL
-	if (count) *count += 1;
+	if (count) count->nodeVisits += 1;
 #endif
-			const __global TopBvhNode* node = &scene->topLevelBvh[topLevelBvhStack[--topLevelBvhStackPtr]];
-			if (!intersectRayTopBvh(ray, node, closestT))
+			const __global TopBvhNode* node = &scene->topLevelBvh[stackPop(&stack)];
+			if (!intersectRayTopBvh(&rayBoxData, node, closestT))
 				continue;
 
 			if (node->isLeaf)
 			{
 				//Ray transformedRay;
-				transformedRay.origin = matrixMultiply(node->invTransform, (float4)(ray->origin, 1.0f)).xyz;
-				transformedRay.direction = matrixMultiply(node->invTransform, (float4)(ray->direction, 0.0f)).xyz;
-				invTransform = node->invTransform;
+				const __global float4* invTransform = scene->topLevelInstances[node->instanceIndex].invTransform;
+				transformedRay.origin = matrixMultiplyAffine(invTransform, (float4)(ray->origin, 1.0f));
+				transformedRay.direction = matrixMultiplyAffine(invTransform, (float4)(ray->direction, 0.0f));
+				instanceIndex = node->instanceIndex;
 				subBvhNodeId = node->subBvh;
-
-#ifdef NO_PARALLEL_RAYS
-				if (transformedRay.direction.x == 0.0f)
-					transformedRay.direction.x = FLT_MIN;
-				if (transformedRay.direction.y == 0.0f)
-					transformedRay.direction.y = FLT_MIN;
-				if (transformedRay.direction.z == 0.0f)
-					transformedRay.direction.z = FLT_MIN;
-
-				if (transformedRay.origin.x == 0.0f)
-					transformedRay.origin.x = -FLT_MIN;
-				if (transformedRay.origin.y == 0.0f)
-					transformedRay.origin.y = -FLT_MIN;
-				if (transformedRay.origin.z == 0.0f)
-					transformedRay.origin.z = -FLT_MIN;
-#endif
-
+				transformedRayBoxData = createRayBoxData(&transformedRay);
 				break;
 			} else {
 				// Calculate which childs' AABB centre is closer to the ray's origin
@@ -149,11 +199,11 @@ bool traceRay(
 
 				if (dot(leftVec, leftVec) < dot(rightVec, rightVec))
 				{
-					topLevelBvhStack[topLevelBvhStackPtr++] = node->rightChildIndex;
-					topLevelBvhStack[topLevelBvhStackPtr++] = node->leftChildIndex;
+					stackPush(&stack, node->rightChildIndex);
+					stackPush(&stack, node->leftChildIndex);
 				} else {
-					topLevelBvhStack[topLevelBvhStackPtr++] = node->leftChildIndex;
-					topLevelBvhStack[topLevelBvhStackPtr++] = node->rightChildIndex;
+					stackPush(&stack, node->leftChildIndex);
+					stackPush(&stack, node->rightChildIndex);
 				}
 			}
 		}
@@ -161,6 +211,150 @@ bool traceRay(
 		if (subBvhNodeId == -1)
 			break;
 
+		// Top-level entries below this are not touched by the sub BVH traversal
+		uint topLevelStackSize = stack.size;
+
+#ifdef USE_WIDE_BVH
+		// The sub BVH buffer contains wide nodes. All children of a node are tested in one pass: leaf children are
+		// intersected right away and the inner children that were hit are pushed far to near.
+		const __global WideSubBvhNode* wideSubBvh = (const __global WideSubBvhNode*)scene->subBvh;
+		stackPush(&stack, subBvhNodeId);
+		while (stack.size > topLevelStackSize)
+		{
+			const __global WideSubBvhNode* node = &wideSubBvh[stackPop(&stack)];
+
+			uint hitChildren[WIDE_BVH_WIDTH];
+			float hitDistances[WIDE_BVH_WIDTH];
+			int numHitChildren = 0;
+			for (uint child = 0; child < node->childCount; child++)
+			{
+#ifdef COUNT_TRAVERSAL
+	if (count) count->nodeVisits += 1;
+#endif
+				float dist;
+				if (!intersectRayWideSubBvhChild(&transformedRayBoxData, node, child, closestT, &dist))
+					continue;
+
+				if (node->triangleCounts[child] != 0)// isLeaf()
+				{
+					uint firstTriangleIndex = node->children[child];
+					for (int i = 0; i < node->triangleCounts[child]; i++)
+					{
+						float t;
+						float2 uv;
+
+#ifdef COUNT_TRAVERSAL
+						if (count) count->triangleVisits += 1;
+#endif
+						if (intersectRayTriangle(&transformedRay, &scene->intersectTriangles[firstTriangleIndex + i], &t, &uv) && t < closestT)
+						{
+							if (hitAny)
+								return true;
+
+							triangleIndex = firstTriangleIndex + i;
+							closestT = t;
+							closestUV = uv;
+							closestInstance = instanceIndex;
+						}
+					}
+				} else {
+					// Insertion sort (descending distance) so that the closest child ends up on top of the stack
+					int i = numHitChildren++;
+					while (i > 0 && hitDistances[i - 1] < dist)
+					{
+						hitDistances[i] = hitDistances[i - 1];
+						hitChildren[i] = hitChildren[i - 1];
+						i--;
+					}
+					hitDistances[i] = dist;
+					hitChildren[i] = node->children[child];
+				}
+			}
+
+			for (int i = 0; i < numHitChildren; i++)
+				stackPush(&stack, hitChildren[i]);
+		}// Sub bvh traversal
+#elif defined(USE_WHILE_WHILE_TRAVERSAL)
+		// While-while traversal (Aila & Laine 2009): inner nodes and leafs are processed in separate loops so that the
+		// threads of a wavefront are more likely to execute the same loop. The first leaf that is found is postponed
+		// and the traversal speculatively continues until a second leaf is found, then both are intersected together.
+		uint nodeId = subBvhNodeId;
+		while (true)
+		{
+			uint leafIds[2];
+			int numLeafs = 0;
+			while (nodeId != -1)
+			{
+				SubBvhNode node = scene->subBvh[nodeId];
+				if (node.triangleCount != 0)// isLeaf()
+				{
+					leafIds[numLeafs++] = nodeId;
+					nodeId = stack.size > topLevelStackSize ? stackPop(&stack) : -1;
+					if (numLeafs == 2)
+						break;
+					continue;
+				}
+
+				// Ordered traversal
+				SubBvhNode left = scene->subBvh[node.leftChildIndex + 0];
+				SubBvhNode right = scene->subBvh[node.leftChildIndex + 1];
+
+#ifdef COUNT_TRAVERSAL
+	if (count) count->nodeVisits += 2;
+#endif
+				float leftDist, rightDist;
+				bool leftVis = intersectRaySubBvh(&transformedRayBoxData, &node, &left, closestT, &leftDist);
+				bool rightVis = intersectRaySubBvh(&transformedRayBoxData, &node, &right, closestT, &rightDist);
+
+				if (leftVis && rightVis)
+				{
+					if (leftDist < rightDist)
+					{
+						stackPush(&stack, node.leftChildIndex + 1);
+						nodeId = node.leftChildIndex + 0;
+					} else {
+						stackPush(&stack, node.leftChildIndex + 0);
+						nodeId = node.leftChildIndex + 1;
+					}
+				} else if (leftVis)
+				{
+					nodeId = node.leftChildIndex;
+				} else if (rightVis)
+				{
+					nodeId = node.leftChildIndex + 1;
+				} else {
+					nodeId = stack.size > topLevelStackSize ? stackPop(&stack) : -1;
+				}
+			}
+
+			if (numLeafs == 0)
+				break;
+
+			for (int leaf = 0; leaf < numLeafs; leaf++)
+			{
+				SubBvhNode node = scene->subBvh[leafIds[leaf]];
+				for (int i = 0; i < node.triangleCount; i++)
+				{
+					float t;
+					float2 uv;
+
+#ifdef COUNT_TRAVERSAL
+					if (count) count->triangleVisits += 1;
+#endif
+					if (intersectRayTriangle(&transformedRay, &scene->intersectTriangles[node.firstTriangleIndex + i], &t, &uv) && t < closestT)
+					{
+						if (hitAny)
+							return true;
+
+						triangleIndex = node.firstTriangleIndex + i;
+						closestT = t;
+						closestUV = uv;
+						closestInstance = instanceIndex;
+					}
+				}
+			}
+		}// Sub bvh traversal
+#else
 		while (true)
 		{
 			SubBvhNode node = scene->subBvh[subBvhNodeId];
@@ -172,13 +366,10 @@ bool traceRay(
 					float t;
 					float2 uv;
 
-					VertexData vertices[3];
-					TriangleData triangle = scene->triangles[node.firstTriangleIndex + i];
-					getVertices(vertices, triangle.indices, scene);
 #ifdef COUNT_TRAVERSAL
-					if (count) *count += 1;
+					if (count) count->triangleVisits += 1;
 #endif
-					if (intersectRayTriangle(&transformedRay, vertices, &t, &uv) && t < closestT)
+					if (intersectRayTriangle(&transformedRay, &scene->intersectTriangles[node.firstTriangleIndex + i], &t, &uv) && t < closestT)
 					{
 						if (hitAny)
 							return true;
@@ -186,12 +377,12 @@ bool traceRay(
 						triangleIndex = node.firstTriangleIndex + i;
 						closestT = t;
 						closestUV = uv;
-						closestMatrix = invTransform;
+						closestInstance = instanceIndex;
 					}
 				}
 
-				if (subBvhStackPtr > 0)
-					subBvhNodeId = subBvhStack[--subBvhStackPtr];// Pop
+				if (stack.size > topLevelStackSize)
+					subBvhNodeId = stackPop(&stack);
 				else
 					break;
 			} else {
@@ -200,20 +391,20 @@ bool traceRay(
 				SubBvhNode right = scene->subBvh[node.leftChildIndex + 1];
 
 #ifdef COUNT_TRAVERSAL
-	if (count) *count += 2;
+	if (count) count->nodeVisits += 2;
 #endif
 				float leftDist, rightDist;
-				bool leftVis = intersectRaySubBvh(&transformedRay, &left, closestT, &leftDist);
-				bool rightVis = intersectRaySubBvh(&transformedRay, &right, closestT, &rightDist);
+				bool leftVis = intersectRaySubBvh(&transformedRayBoxData, &node, &left, closestT, &leftDist);
+				bool rightVis = intersectRaySubBvh(&transformedRayBoxData, &node, &right, closestT, &rightDist);
 
 				if (leftVis && rightVis)
 				{
 					if (leftDist < rightDist)
 					{
-						subBvhStack[subBvhStackPtr++] = node.leftChildIndex + 1;
+						stackPush(&stack, node.leftChildIndex + 1);
 						subBvhNodeId = node.leftChildIndex + 0;
 					} else {
-						subBvhStack[subBvhStackPtr++] = node.leftChildIndex + 0;
+						stackPush(&stack, node.leftChildIndex + 0);
 						subBvhNodeId = node.leftChildIndex + 1;
 					}// Ordered of traversal
 				} else if (leftVis)
@@ -223,13 +414,14 @@ bool traceRay(
 				{
 					subBvhNodeId = node.leftChildIndex + 1;
 				} else {
-					if (subBvhStackPtr > 0)
-						subBvhNodeId = subBvhStack[--subBvhStackPtr];// Pop
+					if (stack.size > topLevelStackSize)
+						subBvhNodeId = stackPop(&stack);
 					else
 						break;
 				}
 			}// If/else node contains triangles
 		}// Sub bvh traversal
+#endif// USE_WIDE_BVH
 	}// Traversal
 
 #else// USE_BVH
@@ -238,10 +430,7 @@ bool traceRay(
 		float t;
 		float2 uv;
 
-		VertexData vertices[3];
-		TriangleData triangle = scene->triangles[i];
-		getVertices(vertices, triangle.indices, scene);
-		if (intersectRayTriangle(ray, vertices, &t, &uv) && t < closestT)
+		if (intersectRayTriangle(ray, &scene->intersectTriangles[i], &t, &uv) && t < closestT)
 		{
 			if (hitAny)
 				return true;
@@ -249,7 +438,7 @@ bool traceRay(
 			triangleIndex = i;
 			closestT = t;
 			closestUV = uv;
-			closestMatrix = &scene->topLevelBvh[scene->topLevelBvhRoot].invTransform;
+			closestInstance = 0;// Instance transforms are ignored without BVH
 		}
 	}
 #endif// USE_BVH
@@ -262,12 +451,125 @@ bool traceRay(
 			*outT = closestT;
 		if (outUV)
 			*outUV = closestUV;
-		if (outInvTransform)
-			*outInvTransform = closestMatrix;
+		if (outInstanceIndex)
+			*outInstanceIndex = closestInstance;
 		return true;
 	} else {// We did not intersect with any triangle
 		return false;
 	}
 }
 
+// Any-hit traversal for shadow rays: returns true as soon as a triangle is hit before maxT. Children are visited in
+// node order (no sorting by distance) and emissive triangles are ignored (they do not occlude the light they belong to).
+bool traceShadowRay(
+	__global uint* inTraversalStack,
+	const __local Scene* scene,
+	const Ray* ray,
+	float maxT)
+{
+#ifdef USE_BVH
+	__local uint shortStackLocal[TRAVERSAL_SHORT_STACK_SIZE * 64];
+	TraversalStack stack;
+	stack.shortStack = &shortStackLocal[get_local_id(0) * TRAVERSAL_SHORT_STACK_SIZE];
+	stack.spillStack = &inTraversalStack[get_global_id(0) * (TRAVERSAL_STACK_SIZE - TRAVERSAL_SHORT_STACK_SIZE)];
+	stack.size = 0;
+	stack.numSpilled = 0;
+	stack.overflow = scene->traversalStackOverflow;
+
+	stackPush(&stack, scene->topLevelBvhRoot);
+	RayBoxData rayBoxData = createRayBoxData(ray);
+
+	while (stack.size > 0)
+	{
+		const __global TopBvhNode* topNode = &scene->topLevelBvh[stackPop(&stack)];
+		if (!intersectRayTopBvh(&rayBoxData, topNode, maxT))
+			continue;
+
+		if (!topNode->isLeaf)
+		{
+			stackPush(&stack, topNode->rightChildIndex);
+			stackPush(&stack, topNode->leftChildIndex);
+			continue;
+		}
+
+		const __global float4* invTransform = scene->topLevelInstances[topNode->instanceIndex].invTransform;
+		Ray transformedRay;
+		transformedRay.origin = matrixMultiplyAffine(invTransform, (float4)(ray->origin, 1.0f));
+		transformedRay.direction = matrixMultiplyAffine(invTransform, (float4)(ray->direction, 0.0f));
+		RayBoxData transformedRayBoxData = createRayBoxData(&transformedRay);
+
+		// Top-level entries below this are not touched by the sub BVH traversal
+		uint topLevelStackSize = stack.size;
+
+#ifdef USE_WIDE_BVH
+		const __global WideSubBvhNode* wideSubBvh = (const __global WideSubBvhNode*)scene->subBvh;
+		stackPush(&stack, topNode->subBvh);
+		while (stack.size > topLevelStackSize)
+		{
+			const __global WideSubBvhNode* node = &wideSubBvh[stackPop(&stack)];
+			for (uint child = 0; child < node->childCount; child++)
+			{
+				float dist;
+				if (!intersectRayWideSubBvhChild(&transformedRayBoxData, node, child, maxT, &dist))
+					continue;
+
+				if (node->triangleCounts[child] == 0)
+				{
+					stackPush(&stack, node->children[child]);
+					continue;
+				}
+
+				for (uint i = 0; i < node->triangleCounts[child]; i++)
+				{
+					const __global IntersectTriangle* triangle = &scene->intersectTriangles[node->children[child] + i];
+					float t;
+					float2 uv;
+					if (triangle->vertex0.w == 0.0f && intersectRayTriangle(&transformedRay, triangle, &t, &uv) && t < maxT)
+						return true;
+				}
+			}
+		}
+#else
+		stackPush(&stack, topNode->subBvh);
+		while (stack.size > topLevelStackSize)
+		{
+			SubBvhNode node = scene->subBvh[stackPop(&stack)];
+			if (node.triangleCount != 0)// isLeaf()
+			{
+				for (uint i = 0; i < node.triangleCount; i++)
+				{
+					const __global IntersectTriangle* triangle = &scene->intersectTriangles[node.firstTriangleIndex + i];
+					float t;
+					float2 uv;
+					if (triangle->vertex0.w == 0.0f && intersectRayTriangle(&transformedRay, triangle, &t, &uv) && t < maxT)
+						return true;
+				}
+				continue;
+			}
+
+			SubBvhNode left = scene->subBvh[node.leftChildIndex + 0];
+			SubBvhNode right = scene->subBvh[node.leftChildIndex + 1];
+			float dist;
+			if (intersectRaySubBvh(&transformedRayBoxData, &node, &right, maxT, &dist))
+				stackPush(&stack, node.leftChildIndex + 1);
+			if (intersectRaySubBvh(&transformedRayBoxData, &node, &left, maxT, &dist))
+				stackPush(&stack, node.leftChildIndex + 0);
+		}
+#endif// USE_WIDE_BVH
+	}
+	return false;
+
+#else// USE_BVH
+	for (unsigned int i = 0; i < scene->numTriangles; i++)
+	{
+		const __global IntersectTriangle* triangle = &scene->intersectTriangles[i];
+		float t;
+		float2 uv;
+		if (triangle->vertex0.w == 0.0f && intersectRayTriangle(ray, triangle, &t, &uv) && t < maxT)
+			return true;
+	}
+	return false;
+#endif// USE_BVH
+}
+
 #endif// __SCENE_CL
\ No newline at end of file
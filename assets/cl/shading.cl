@@ -14,19 +14,17 @@ enum {
 };
 
 typedef struct {
-	Ray ray;// 2 * float3 = 32 bytes
-	float3 multiplier;// 16 bytes
-	size_t outputPixel;// 4 bytes?
-	int flags;// 4 bytes
-	union// 4 bytes
+	Ray ray;
+	float3 multiplier;
+	uint outputPixel;
+	int flags;
+	union
 	{
 		float rayLength;// Only shadows use this
 		int numBounces;// And shadows dont bounce
 	};
-	float pdf; // 4 bytes
-	float t;// 4 bytes
-	// Aligned to 16 bytes so struct has size of 80 bytes
-} RayData;
+	float pdf;
+} RayData;// Stored in global memory as a RayQueue (see ray_queue.cl)
 
 
 
@@ -38,11 +36,11 @@ float3 neeMisShading(// Next Event Estimation + Multiple Importance Sampling
 	float3 intersection,
 	float3 rayDirection,
 	float t,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float2 uv,
 	image2d_array_t textures,
 	randStream* randomStream,
-	const __global RayData* inData,
+	const RayData* inData,
 	RayData* outData,
 	RayData* outShadowData)
 {
@@ -356,14 +354,15 @@ float3 neeMisShading(// Next Event Estimation + Multiple Importance Sampling
 float3 neeIsShading(// Next Event Estimation + Importance Sampling
 	const __local Scene* scene,
 	int triangleIndex,
+	MaterialType materialType,// Type of the material of the triangle, a constant lets the compiler remove the other paths
 	float3 intersection,
 	float3 rayDirection,
 	float t,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float2 uv,
 	image2d_array_t textures,
 	randStream* randomStream,
-	const __global RayData* inData,
+	const RayData* inData,
 	RayData* outData,
 	RayData* outShadowData)
 {
@@ -384,7 +383,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 	const __global Material* material = &scene->meshMaterials[scene->triangles[triangleIndex].mat_index];
 
 	// Terminate if we hit a light source
-	if (material->type == EMISSIVE)
+	if (materialType == EMISSIVE)
 	{
 		outData->flags = SHADINGFLAGS_HASFINISHED;
 		outShadowData->flags = SHADINGFLAGS_HASFINISHED;
@@ -397,7 +396,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 	}
 	
 	float3 BRDF = 0.0f;
-	if (material->type == REFRACTIVE || material->type == BASIC_REFRACTIVE)
+	if (materialType == REFRACTIVE || materialType == BASIC_REFRACTIVE)
 	{
 		outShadowData->flags = SHADINGFLAGS_HASFINISHED;
 	}
@@ -418,9 +417,9 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 		L /= dist;
 		if (dot(shadingNormal, L) > EPSILON && dot(realNormal, L) > EPSILON && dot(lightNormal, -L) > EPSILON)// dot(realNormal, L) may be <0.0f for transparent materials?
 		{
-			if (material->type == PBR) {
+			if (materialType == PBR) {
 				BRDF = pbrBrdfWithDiffuse(-rayDirection, L, shadingNormal, material, material->pbr.smoothness > MAXSMOOTHNESS);
-			} else if (material->type == DIFFUSE)
+			} else if (materialType == DIFFUSE)
 			{
 
 				float3 c = diffuseColour(material, vertices, uv, textures);
@@ -453,7 +452,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 	float PDF;
 	float cosineTerm;
 	float3 reflection;
-	if (material->type == PBR) {
+	if (materialType == PBR) {
 		float3 f0;
 		if (material->pbr.metallic) {
 			f0 = material->pbr.reflectance;
@@ -494,7 +493,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 			}
 			if (material->pbr.smoothness > MAXSMOOTHNESS) dospecular = true;
 		}		
-	} else if (material->type == BASIC_REFRACTIVE)
+	} else if (materialType == BASIC_REFRACTIVE)
 	{
 		// Slide 34
 		// http://www.cs.uu.nl/docs/vakken/magr/2016-2017/slides/lecture%2001%20-%20intro%20&%20whitted.pdf
@@ -536,7 +535,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 		BRDF = absorptionFactor;
 		cosineTerm = 1.0f;
 		PDF = 1.0f;
-	} else if (material->type == REFRACTIVE)
+	} else if (materialType == REFRACTIVE)
 	{
 		float3 halfway = beckmannWeightedHalfway(raySideNormal, rayDirection, invTransform, 1 - material->refractive.smoothness, randomStream);
 		//if (dot(halfway, raySideNormal) < 0.9f) {
@@ -584,7 +583,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 		// Remove the cos from the integral, because its integrated in the BRDF
 		cosineTerm = 1.0f;
 		PDF = 1.0f;
-	} else if (material->type == DIFFUSE) {
+	} else if (materialType == DIFFUSE) {
 		cosineTerm = 1.0f;
 
 		float3 c = diffuseColour(material, vertices, uv, textures);
@@ -604,7 +603,7 @@ float3 neeIsShading(// Next Event Estimation + Importance Sampling
 	// Continue random walk
 	//BRDF = 0.1f;
 	outData->flags = 0;
-	if (material->type == REFRACTIVE || material->type == BASIC_REFRACTIVE || dospecular)
+	if (materialType == REFRACTIVE || materialType == BASIC_REFRACTIVE || dospecular)
 		outData->flags = SHADINGFLAGS_LASTSPECULAR;
 	float3 integral = BRDF * cosineTerm / PDF;
 
@@ -631,11 +630,11 @@ float3 neeShading(
 	int triangleIndex,
 	float3 intersection,
 	float3 rayDirection,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float2 uv,
 	image2d_array_t textures,
 	randStream* randomStream,
-	const __global RayData* inData,
+	const RayData* inData,
 	RayData* outData,
 	RayData* outShadowData)
 {
@@ -731,11 +730,11 @@ float3 naiveShading(
 	int triangleIndex,
 	float3 intersection,
 	float3 rayDirection,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float2 uv,
 	image2d_array_t textures,
 	randStream* randomStream,
-	const __global RayData* inData,
+	const RayData* inData,
 	RayData* outData,
 	RayData* outShadowData)
 {
@@ -35,7 +35,7 @@ int randInt(randStream* randomStream, int start, int stop)
 float3 diffuseReflection(
 	float3 edge1,
 	float3 edge2,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	randStream* randomStream)
 {
 	float u1 = randRandomU01(randomStream);
@@ -62,7 +62,7 @@ float3 diffuseReflection(
 float3 cosineWeightedDiffuseReflection(
 	float3 normal,
 	float3 edge1,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	randStream* randomStream)
 {
 
@@ -92,7 +92,7 @@ float3 cosineWeightedDiffuseReflection(
 float3 ggxWeightedHalfway(
 	float3 normal,
 	float3 incidenceVector,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float alpha,
 	randStream* randomStream)
 {
@@ -127,7 +127,7 @@ float3 ggxWeightedHalfway(
 float3 beckmannWeightedHalfway(
 	float3 normal,
 	float3 incidenceVector,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float alpha,
 	randStream* randomStream)
 {
@@ -160,7 +160,7 @@ float3 beckmannWeightedHalfway(
 }
 
 float3 ggxWeightedImportanceDirection(float3 normal, float3 incidenceVector,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float alpha,
 	randStream* randomStream,
 	float* outPDF,
@@ -175,7 +175,7 @@ float3 ggxWeightedImportanceDirection(float3 normal, float3 incidenceVector,
 }
 
 float3 beckmannWeightedImportanceDirection(float3 normal, float3 incidenceVector,
-	const __global float* invTransform,
+	const __global float4* invTransform,
 	float alpha,
 	randStream* randomStream,
 	float* outPDF,
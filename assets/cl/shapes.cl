@@ -17,24 +17,28 @@ typedef struct
 	float2 texCoord;
 } VertexData;
 
+// Triangle data that is only used for intersection, see vertices.h
+typedef struct
+{
+	float4 vertex0;// w: 1 if the triangle is emissive
+	float3 edge1;
+	float3 edge2;
+} IntersectTriangle;
+
 bool intersectRayTriangle(
 	const Ray* ray,
-	const VertexData* vertices,
+	const __global IntersectTriangle* triangle,
 	float* outT,
 	float2* outUV) {
 	float3 O = ray->origin;
 	float3 D = ray->direction;
-	float3 V1 = vertices[0].vertex;
-	float3 V2 = vertices[1].vertex;
-	float3 V3 = vertices[2].vertex;
-	float3 e1, e2;  //Edge1, Edge2
+	float3 V1 = triangle->vertex0.xyz;
+	float3 e1 = triangle->edge1;//Edge1, Edge2 (sharing V1)
+	float3 e2 = triangle->edge2;
 	float3 P, Q, T;
 	float det, inv_det, u, v;
 	float t;
 
-	//Find vectors for two edges sharing V1
-	e1 = V2 - V1;
-	e2 = V3 - V1;
 	//Begin calculating determinant - also used to calculate u parameter
 	P = cross(D,e2);
 	//if determinant is near zero, ray lies in plane of triangle or ray is parallel to plane of triangle
@@ -1,12 +1,25 @@
 #include "bvh_build.h"
 #include "aabb.h"
 #include "bvh_allocator.h"
+#include "bvh_morton.h"
 #include "bvh_object_split.h"
+#include "bvh_primitive_arena.h"
 #include "bvh_spatial_split.h"
 #include <algorithm>
 #include <array>
+#include <bit>
+#include <cmath>
+#include <deque>
 #include <functional>
+#include <limits>
+#include <numeric>
 #include <stack>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_scan.h>
 #include <tuple>
 #include <vector>
 
@@ -14,8 +27,7 @@ namespace raytracer {
 
 static constexpr int MIN_PRIMS_PER_LEAF = 3;
 static constexpr float SPATIAL_SPLIT_ALPHA = 1e-05f;
-static constexpr float SAH_TRAVERSAL_COST = 1.5f;
-static constexpr float SAH_INTERSECTION_COST = 1.0f;
+static constexpr size_t PARALLEL_BUILD_TASK_THRESHOLD = 4096; // Subtrees with fewer primitives are built within a single task
 
 static int maxIndex(glm::vec3 vec)
 {
@@ -38,30 +50,90 @@ static float getSAH(float partialSAH, const AABB& parentBounds)
     return SAH_TRAVERSAL_COST + partialSAH * SAH_INTERSECTION_COST / parentBounds.surfaceArea();
 }
 
-static std::vector<PrimitiveData> generatePrimitives(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles)
+template <typename F>
+static void forEachIndex(size_t count, BvhBuildMode mode, F&& f)
+{
+    if (mode == BvhBuildMode::Parallel) {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, count), [&](const tbb::blocked_range<size_t>& range) {
+            for (size_t i = range.begin(); i != range.end(); i++)
+                f(i);
+        });
+    } else {
+        for (size_t i = 0; i < count; i++)
+            f(i);
+    }
+}
+
+static std::vector<PrimitiveData> generatePrimitives(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Serial)
 {
     std::vector<PrimitiveData> primitives(triangles.size());
 
-    uint32_t i = 0;
-    std::transform(triangles.begin(), triangles.end(), primitives.begin(), [&](const TriangleSceneData& triangle) -> PrimitiveData {
+    forEachIndex(triangles.size(), mode, [&](size_t i) {
+        const auto& triangle = triangles[i];
         AABB bounds;
         bounds.fit(vertices[(triangle.indices[0])].vertex);
         bounds.fit(vertices[(triangle.indices[1])].vertex);
         bounds.fit(vertices[(triangle.indices[2])].vertex);
-        return { i++, bounds };
+        primitives[i] = { static_cast<uint32_t>(i), bounds };
     });
 
     return primitives;
 }
 
-static AABB computeBounds(std::span<const PrimitiveData> primitives)
+static std::vector<TriangleSceneData> reorderTriangles(std::span<const PrimitiveData> reorderedPrimitives, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Serial)
+{
+    // Convert primitive references to triangles
+    std::vector<TriangleSceneData> outTriangles(reorderedPrimitives.size());
+    forEachIndex(reorderedPrimitives.size(), mode, [&](size_t i) {
+        outTriangles[i] = triangles[reorderedPrimitives[i].globalIndex];
+    });
+    return outTriangles;
+}
+
+static AABB computeBounds(std::span<const PrimitiveData> primitives, BvhBuildMode mode = BvhBuildMode::Serial)
 {
+    if (mode == BvhBuildMode::Parallel) {
+        return tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, primitives.size()), AABB(), [&](const tbb::blocked_range<size_t>& range, AABB bounds) {
+                for (size_t i = range.begin(); i != range.end(); i++)
+                    bounds.fit(primitives[i].bounds);
+                return bounds;
+            },
+            std::plus<AABB>());
+    }
+
     AABB bounds;
     for (const auto& primitive : primitives)
         bounds.fit(primitive.bounds);
     return bounds;
 }
 
+// Writes the number of indices before i for which the predicate holds to outOffsets[i] and returns the total count
+template <typename F>
+static uint32_t exclusiveScanIndices(size_t count, BvhBuildMode mode, std::vector<uint32_t>& outOffsets, F&& predicate)
+{
+    outOffsets.resize(count);
+    if (mode == BvhBuildMode::Parallel) {
+        return tbb::parallel_scan(
+            tbb::blocked_range<size_t>(0, count), 0u, [&](const tbb::blocked_range<size_t>& range, uint32_t sum, bool isFinalScan) {
+                for (size_t i = range.begin(); i != range.end(); i++) {
+                    if (isFinalScan)
+                        outOffsets[i] = sum;
+                    sum += predicate(i) ? 1 : 0;
+                }
+                return sum;
+            },
+            std::plus<uint32_t>());
+    }
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        outOffsets[i] = sum;
+        sum += predicate(i) ? 1 : 0;
+    }
+    return sum;
+}
+
 using SplitFunc = std::function<std::optional<std::pair<AABB, AABB>>(const SubBVHNode& node, std::span<const PrimitiveData>, PrimInsertIter left, PrimInsertIter right)>;
 static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>> buildBVH(std::vector<PrimitiveData>&& startPrimitives, SplitFunc&& splitFunc)
 {
@@ -111,9 +183,215 @@ static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>>
     return { rootNodeID, std::move(outPrimitives), std::move(nodeAllocator.getNodesMove()) };
 }
 
+using ArenaSplitFunc = std::function<std::optional<std::pair<AABB, AABB>>(const SubBVHNode& node, std::span<const PrimitiveData>, PrimitiveData*& left, PrimitiveData*& right)>;
+static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>> buildBVHParallel(std::vector<PrimitiveData>&& startPrimitives, const ArenaSplitFunc& splitFunc)
+{
+    // Parallel version of buildBVH. Splits may duplicate references, so the children are not written in place but
+    // into a per-thread PrimitiveArena. Within a thread the references are freed in LIFO order once both subtrees
+    // have been built; the references of leaf nodes are copied into a separate (append only) per-thread arena.
+    struct BuildNode {
+        SubBVHNode node;
+        BuildNode* children = nullptr; // Points to a pair of nodes
+        std::span<const PrimitiveData> leafPrimitives;
+    };
+    tbb::enumerable_thread_specific<std::deque<std::array<BuildNode, 2>>> nodeArenas;
+
+    // Arenas start out empty: a thread that only builds small subtrees should not hold a chunk the size of the mesh
+    tbb::enumerable_thread_specific<PrimitiveArena> referenceArenas;
+    tbb::enumerable_thread_specific<PrimitiveArena> leafArenas;
+
+    BuildNode rootBuildNode;
+    rootBuildNode.node.bounds = computeBounds(startPrimitives, BvhBuildMode::Parallel);
+    rootBuildNode.node.firstTriangleIndex = 0;
+    rootBuildNode.node.triangleCount = static_cast<uint32_t>(startPrimitives.size());
+
+    struct StackItem {
+        BuildNode* buildNode; // Nullptr: release the reference arena up to the marker
+        std::span<const PrimitiveData> primitives;
+        PrimitiveArena::Marker marker;
+    };
+    std::function<void(BuildNode&, std::span<const PrimitiveData>)> buildSubtree = [&](BuildNode& subtreeRoot, std::span<const PrimitiveData> subtreePrimitives) {
+        auto& referenceArena = referenceArenas.local(); // Tasks never migrate between threads
+
+        std::stack<StackItem> stack;
+        stack.push(StackItem { &subtreeRoot, subtreePrimitives, {} });
+
+        while (!stack.empty()) {
+            auto [buildNode, primitives, releaseMarker] = stack.top();
+            stack.pop();
+
+            if (!buildNode) {
+                referenceArena.release(releaseMarker);
+                continue;
+            }
+
+            // A child never contains more references than its parent, so write the left references to the first half
+            // and the right references to the second half. Afterwards the right references are moved next to the left
+            // references and the unused memory is given back to the arena.
+            auto marker = referenceArena.getMarker();
+            auto childPrimitives = referenceArena.allocate(2 * primitives.size());
+            PrimitiveData* leftEnd = childPrimitives.data();
+            PrimitiveData* rightEnd = childPrimitives.data() + primitives.size();
+
+            auto optResult = splitFunc(buildNode->node, primitives, leftEnd, rightEnd);
+
+            if (optResult) {
+                size_t leftCount = leftEnd - childPrimitives.data();
+                size_t rightCount = rightEnd - (childPrimitives.data() + primitives.size());
+                std::copy(childPrimitives.data() + primitives.size(), rightEnd, childPrimitives.data() + leftCount);
+                childPrimitives = referenceArena.shrink(childPrimitives, leftCount + rightCount);
+                auto leftPrimitives = childPrimitives.subspan(0, leftCount);
+                auto rightPrimitives = childPrimitives.subspan(leftCount, rightCount);
+
+                auto& children = nodeArenas.local().emplace_back();
+                std::tie(children[0].node.bounds, children[1].node.bounds) = *optResult;
+
+                buildNode->children = children.data();
+                buildNode->node.triangleCount = 0; // Triangle count = 0 -> inner node
+
+                if (primitives.size() >= PARALLEL_BUILD_TASK_THRESHOLD) {
+                    tbb::parallel_invoke(
+                        [&]() { buildSubtree(children[0], leftPrimitives); },
+                        [&]() { buildSubtree(children[1], rightPrimitives); });
+                    referenceArena.release(marker);
+                } else {
+                    stack.push({ nullptr, {}, marker });
+                    stack.push({ &children[0], leftPrimitives, {} });
+                    stack.push({ &children[1], rightPrimitives, {} });
+                }
+            } else {
+                referenceArena.release(marker);
+
+                auto outPrimitives = leafArenas.local().allocate(primitives.size());
+                std::copy(primitives.begin(), primitives.end(), outPrimitives.begin());
+                buildNode->leafPrimitives = outPrimitives;
+                buildNode->node.triangleCount = static_cast<uint32_t>(primitives.size());
+            }
+        }
+    };
+    buildSubtree(rootBuildNode, startPrimitives);
+
+    // Flatten the tree in the order in which the serial builder allocates nodes and outputs primitives
+    std::vector<SubBVHNode> outNodes(2); // Root node is allocated as a pair
+    std::vector<PrimitiveData> outPrimitives;
+    uint32_t rootNodeID = 0;
+    outNodes[rootNodeID] = rootBuildNode.node;
+
+    std::stack<std::pair<uint32_t, const BuildNode*>> stack;
+    stack.push({ rootNodeID, &rootBuildNode });
+    while (!stack.empty()) {
+        auto [nodeID, buildNode] = stack.top();
+        stack.pop();
+
+        if (buildNode->children) {
+            uint32_t leftNodeID = (uint32_t)outNodes.size();
+            uint32_t rightNodeID = leftNodeID + 1;
+            outNodes.push_back(buildNode->children[0].node);
+            outNodes.push_back(buildNode->children[1].node);
+            outNodes[nodeID].leftChildIndex = leftNodeID;
+
+            stack.push({ leftNodeID, &buildNode->children[0] });
+            stack.push({ rightNodeID, &buildNode->children[1] });
+        } else {
+            outNodes[nodeID].firstTriangleIndex = static_cast<uint32_t>(outPrimitives.size());
+            outPrimitives.insert(outPrimitives.end(), buildNode->leafPrimitives.begin(), buildNode->leafPrimitives.end());
+        }
+    }
+
+    return { rootNodeID, std::move(outPrimitives), std::move(outNodes) };
+}
+
 using InPlaceSplitFunc = std::function<std::optional<std::tuple<std::span<PrimitiveData>, AABB, std::span<PrimitiveData>, AABB>>(const SubBVHNode& node, std::span<PrimitiveData>)>;
-static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>> buildBVHInPlace(std::vector<PrimitiveData>&& startPrimitives, InPlaceSplitFunc&& splitFunc)
+static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>> buildBVHInPlaceParallel(std::vector<PrimitiveData>&& startPrimitives, const InPlaceSplitFunc& splitFunc)
+{
+    // Child pairs are allocated from an arena owned by the thread that splits the parent so the build itself needs no
+    // synchronization. std::deque never moves its elements so pointers to nodes stay valid while the arenas grow.
+    struct BuildNode {
+        SubBVHNode node;
+        BuildNode* children = nullptr; // Points to a pair of nodes
+    };
+    tbb::enumerable_thread_specific<std::deque<std::array<BuildNode, 2>>> nodeArenas;
+
+    BuildNode rootBuildNode;
+    rootBuildNode.node.bounds = computeBounds(startPrimitives, BvhBuildMode::Parallel);
+    rootBuildNode.node.firstTriangleIndex = 0;
+    rootBuildNode.node.triangleCount = static_cast<uint32_t>(startPrimitives.size());
+
+    struct StackItem {
+        BuildNode* buildNode;
+        uint32_t primOffset;
+        std::span<PrimitiveData> primitives;
+    };
+    std::function<void(BuildNode&, uint32_t, std::span<PrimitiveData>)> buildSubtree = [&](BuildNode& subtreeRoot, uint32_t subtreePrimOffset, std::span<PrimitiveData> subtreePrimitives) {
+        // Large nodes fork into two tasks (which may be stolen by idle threads), small subtrees are built sequentially
+        std::stack<StackItem> stack;
+        stack.push(StackItem { &subtreeRoot, subtreePrimOffset, subtreePrimitives });
+
+        while (!stack.empty()) {
+            auto [buildNode, primOffset, primitives] = stack.top();
+            stack.pop();
+
+            auto optResult = splitFunc(buildNode->node, primitives);
+
+            if (optResult) {
+                auto& children = nodeArenas.local().emplace_back();
+
+                std::span<PrimitiveData> leftPrimitives;
+                std::span<PrimitiveData> rightPrimitives;
+                std::tie(leftPrimitives, children[0].node.bounds, rightPrimitives, children[1].node.bounds) = *optResult;
+
+                buildNode->children = children.data();
+                buildNode->node.triangleCount = 0; // Triangle count = 0 -> inner node
+
+                uint32_t rightPrimOffset = primOffset + (uint32_t)leftPrimitives.size();
+                if (primitives.size() >= PARALLEL_BUILD_TASK_THRESHOLD) {
+                    tbb::parallel_invoke(
+                        [&]() { buildSubtree(children[0], primOffset, leftPrimitives); },
+                        [&]() { buildSubtree(children[1], rightPrimOffset, rightPrimitives); });
+                } else {
+                    stack.push({ &children[0], primOffset, leftPrimitives });
+                    stack.push({ &children[1], rightPrimOffset, rightPrimitives });
+                }
+            } else {
+                buildNode->node.firstTriangleIndex = primOffset;
+                buildNode->node.triangleCount = static_cast<uint32_t>(primitives.size());
+            }
+        }
+    };
+    buildSubtree(rootBuildNode, 0, startPrimitives);
+
+    // Flatten the tree, allocating node pairs in the same order as the serial builder (which allocates the children of
+    // a node when it is popped from its stack). This makes the output independent of how the tasks were scheduled.
+    std::vector<SubBVHNode> outNodes(2); // Root node is allocated as a pair
+    uint32_t rootNodeID = 0;
+    outNodes[rootNodeID] = rootBuildNode.node;
+
+    std::stack<std::pair<uint32_t, const BuildNode*>> stack;
+    stack.push({ rootNodeID, &rootBuildNode });
+    while (!stack.empty()) {
+        auto [nodeID, buildNode] = stack.top();
+        stack.pop();
+
+        if (buildNode->children) {
+            uint32_t leftNodeID = (uint32_t)outNodes.size();
+            uint32_t rightNodeID = leftNodeID + 1;
+            outNodes.push_back(buildNode->children[0].node);
+            outNodes.push_back(buildNode->children[1].node);
+            outNodes[nodeID].leftChildIndex = leftNodeID;
+
+            stack.push({ leftNodeID, &buildNode->children[0] });
+            stack.push({ rightNodeID, &buildNode->children[1] });
+        }
+    }
+
+    return { rootNodeID, std::move(startPrimitives), std::move(outNodes) };
+}
+
+static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>> buildBVHInPlace(std::vector<PrimitiveData>&& startPrimitives, InPlaceSplitFunc&& splitFunc, BvhBuildMode mode)
 {
+    if (mode == BvhBuildMode::Parallel)
+        return buildBVHInPlaceParallel(std::move(startPrimitives), splitFunc);
+
     BVHAllocator nodeAllocator;
 
     uint32_t rootNodeID = nodeAllocator.allocatePair();
@@ -163,9 +441,33 @@ static std::tuple<uint32_t, std::vector<PrimitiveData>, std::vector<SubBVHNode>>
     return { rootNodeID, std::move(startPrimitives), std::move(nodeAllocator.getNodesMove()) };
 }
 
-BvhBuildReturnType buildBinnedBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles)
+float computeSAHCost(std::span<const SubBVHNode> nodes, uint32_t rootNodeID)
+{
+    // Expected cost of tracing a random ray that hits the root node
+    float rootSurfaceArea = nodes[rootNodeID].bounds.surfaceArea();
+    float cost = 0.0f;
+
+    std::stack<uint32_t> stack;
+    stack.push(rootNodeID);
+    while (!stack.empty()) {
+        const auto& node = nodes[stack.top()];
+        stack.pop();
+
+        float hitProbability = node.bounds.surfaceArea() / rootSurfaceArea;
+        if (node.triangleCount == 0) {
+            cost += hitProbability * SAH_TRAVERSAL_COST;
+            stack.push(node.leftChildIndex);
+            stack.push(node.leftChildIndex + 1);
+        } else {
+            cost += hitProbability * node.triangleCount * SAH_INTERSECTION_COST;
+        }
+    }
+    return cost;
+}
+
+BvhBuildReturnType buildBinnedBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode)
 {
-    auto primitives = generatePrimitives(vertices, triangles); // Create primitive refences
+    auto primitives = generatePrimitives(vertices, triangles, mode); // Create primitive refences
     OriginalPrimitives originalPrimitives { vertices, triangles };
 
     auto [rootNodeID, reorderedPrimitives, bvhNodes] = buildBVHInPlace(std::move(primitives), [&](const SubBVHNode& node, std::span<PrimitiveData> primitives) -> std::optional<std::tuple<std::span<PrimitiveData>, AABB, std::span<PrimitiveData>, AABB>> {
@@ -173,7 +475,7 @@ BvhBuildReturnType buildBinnedBVH(std::span<const VertexSceneData> vertices, std
             return {};
 
         float thresholdSAH = primitives.size() * SAH_INTERSECTION_COST;
-        if (auto split = findObjectSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 1, 2, 3 }); split && getSAH(split->partialSAH, node.bounds) < thresholdSAH) {
+        if (auto split = findObjectSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }, mode); split && getSAH(split->partialSAH, node.bounds) < thresholdSAH) {
             size_t splitIndex = performObjectSplitInPlace(primitives, *split);
             auto leftPrims = primitives.subspan(0, splitIndex);
             auto rightPrims = primitives.subspan(splitIndex, primitives.size() - splitIndex);
@@ -182,19 +484,14 @@ BvhBuildReturnType buildBinnedBVH(std::span<const VertexSceneData> vertices, std
         } else {
             return {};
         }
-    });
+    }, mode);
 
-    // Convert primitive references to triangles
-    std::vector<TriangleSceneData> outTriangles(reorderedPrimitives.size());
-    std::transform(reorderedPrimitives.begin(), reorderedPrimitives.end(), outTriangles.begin(), [&](const PrimitiveData& primitive) {
-        return triangles[primitive.globalIndex];
-    });
-    return { rootNodeID, outTriangles, bvhNodes };
+    return { rootNodeID, reorderTriangles(reorderedPrimitives, triangles, mode), bvhNodes };
 }
 
-BvhBuildReturnType buildBinnedFastBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles)
+BvhBuildReturnType buildBinnedFastBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode)
 {
-    auto primitives = generatePrimitives(vertices, triangles); // Create primitive refences
+    auto primitives = generatePrimitives(vertices, triangles, mode); // Create primitive refences
     OriginalPrimitives originalPrimitives { vertices, triangles };
 
     auto [rootNodeID, reorderedPrimitives, bvhNodes] = buildBVHInPlace(std::move(primitives), [&](const SubBVHNode& node, std::span<PrimitiveData> primitives) -> std::optional<std::tuple<std::span<PrimitiveData>, AABB, std::span<PrimitiveData>, AABB>> {
@@ -203,7 +500,7 @@ BvhBuildReturnType buildBinnedFastBVH(std::span<const VertexSceneData> vertices,
 
         float thresholdSAH = primitives.size() * SAH_INTERSECTION_COST;
         int axis = maxIndex(node.bounds.extent());
-        if (auto split = findObjectSplitBinned(node.bounds, primitives, originalPrimitives, std::array { axis }); split && getSAH(split->partialSAH, node.bounds) < thresholdSAH) {
+        if (auto split = findObjectSplitBinned(node.bounds, primitives, originalPrimitives, std::array { axis }, mode); split && getSAH(split->partialSAH, node.bounds) < thresholdSAH) {
             size_t splitIndex = performObjectSplitInPlace(primitives, *split);
             auto leftPrims = primitives.subspan(0, splitIndex);
             auto rightPrims = primitives.subspan(splitIndex, primitives.size() - splitIndex);
@@ -211,48 +508,310 @@ BvhBuildReturnType buildBinnedFastBVH(std::span<const VertexSceneData> vertices,
         } else {
             return {};
         }
+    }, mode);
+
+    return { rootNodeID, reorderTriangles(reorderedPrimitives, triangles, mode), bvhNodes };
+}
+
+// Find the first primitive of the right child by splitting at the highest bit in which the Morton codes of the range differ
+// https://research.nvidia.com/sites/default/files/publications/karras2012hpg_paper.pdf
+static uint32_t findMortonSplit(std::span<const MortonPrimitive> mortonPrimitives, uint32_t first, uint32_t last)
+{
+    uint64_t firstCode = mortonPrimitives[first].mortonCode;
+    uint64_t lastCode = mortonPrimitives[last - 1].mortonCode;
+    if (firstCode == lastCode)
+        return (first + last) / 2; // Identical Morton codes, split the range in the middle
+
+    // Binary search for the last primitive that shares more leading bits with the first primitive than the last primitive does
+    int commonPrefix = std::countl_zero(firstCode ^ lastCode);
+    uint32_t split = first;
+    uint32_t step = last - 1 - first;
+    do {
+        step = (step + 1) >> 1;
+        uint32_t newSplit = split + step;
+        if (newSplit < last - 1 && std::countl_zero(firstCode ^ mortonPrimitives[newSplit].mortonCode) > commonPrefix)
+            split = newSplit;
+    } while (step > 1);
+    return split + 1;
+}
+
+static std::vector<SubBVHNode> removeUnusedNodes(std::span<const SubBVHNode> nodes, BvhBuildMode mode)
+{
+    // The first pair is the root node (+ unused sibling); all other unused nodes have never been written to
+    auto isUsed = [&](size_t i) { return i < 2 || nodes[i].triangleCount > 0 || nodes[i].leftChildIndex != 0; };
+
+    std::vector<uint32_t> newNodeIDs;
+    uint32_t usedCount = exclusiveScanIndices(nodes.size(), mode, newNodeIDs, isUsed);
+
+    std::vector<SubBVHNode> outNodes(usedCount);
+    forEachIndex(nodes.size(), mode, [&](size_t i) {
+        if (!isUsed(i))
+            return;
+
+        auto& node = outNodes[newNodeIDs[i]];
+        node = nodes[i];
+        if (node.triangleCount == 0 && i != 1)
+            node.leftChildIndex = newNodeIDs[node.leftChildIndex];
     });
+    return outNodes;
+}
 
-    // Convert primitive references to triangles
-    std::vector<TriangleSceneData> outTriangles(reorderedPrimitives.size());
-    std::transform(reorderedPrimitives.begin(), reorderedPrimitives.end(), outTriangles.begin(), [&](const PrimitiveData& primitive) {
-        return triangles[primitive.globalIndex];
+BvhBuildReturnType buildLinearBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode)
+{
+    auto primitives = generatePrimitives(vertices, triangles, mode); // Create primitive refences
+    auto mortonPrimitives = sortPrimitivesByMortonCode(primitives, mode);
+
+    std::vector<PrimitiveData> sortedPrimitives(primitives.size());
+    forEachIndex(primitives.size(), mode, [&](size_t i) {
+        sortedPrimitives[i] = primitives[mortonPrimitives[i].primitiveIndex];
     });
-    return { rootNodeID, outTriangles, bvhNodes };
+
+    // Every subtree over a range of N primitives has at most 2N-2 descendants. Reserving that many node slots per subtree
+    // allows subtrees to be built independently while keeping the node layout deterministic. Leaves with multiple
+    // primitives leave some of their slots unused; these are removed afterwards.
+    uint32_t rootNodeID = 0;
+    std::vector<SubBVHNode> nodes(std::max(size_t(2), 2 * sortedPrimitives.size()));
+
+    std::function<AABB(uint32_t, uint32_t, uint32_t, uint32_t)> buildSubtree = [&](uint32_t nodeID, uint32_t first, uint32_t last, uint32_t firstDescendantID) -> AABB {
+        auto& node = nodes[nodeID];
+        if (last - first <= MIN_PRIMS_PER_LEAF) {
+            node.bounds = computeBounds(std::span(sortedPrimitives).subspan(first, last - first));
+            node.firstTriangleIndex = first;
+            node.triangleCount = last - first;
+            return node.bounds;
+        }
+
+        uint32_t split = findMortonSplit(mortonPrimitives, first, last);
+        uint32_t leftNodeID = firstDescendantID;
+        uint32_t rightNodeID = leftNodeID + 1;
+        uint32_t leftFirstDescendantID = firstDescendantID + 2;
+        uint32_t rightFirstDescendantID = leftFirstDescendantID + 2 * (split - first) - 2;
+
+        AABB leftBounds, rightBounds;
+        if (mode == BvhBuildMode::Parallel && last - first >= PARALLEL_BUILD_TASK_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&]() { leftBounds = buildSubtree(leftNodeID, first, split, leftFirstDescendantID); },
+                [&]() { rightBounds = buildSubtree(rightNodeID, split, last, rightFirstDescendantID); });
+        } else {
+            leftBounds = buildSubtree(leftNodeID, first, split, leftFirstDescendantID);
+            rightBounds = buildSubtree(rightNodeID, split, last, rightFirstDescendantID);
+        }
+
+        node.bounds = leftBounds + rightBounds;
+        node.leftChildIndex = leftNodeID;
+        node.triangleCount = 0; // Triangle count = 0 -> inner node
+        return node.bounds;
+    };
+    buildSubtree(rootNodeID, 0, static_cast<uint32_t>(sortedPrimitives.size()), 2);
+
+    return { rootNodeID, reorderTriangles(sortedPrimitives, triangles, mode), removeUnusedNodes(nodes, mode) };
 }
 
-BvhBuildReturnType buildSpatialSplitBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles)
+static float mergedSurfaceArea(const AABB& lhs, const AABB& rhs)
 {
-    auto startPrimitives = generatePrimitives(vertices, triangles); // Create primitive refences
+    glm::vec3 extent = glm::max(lhs.max, rhs.max) - glm::min(lhs.min, rhs.min);
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+BvhBuildReturnType buildPlocBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode, uint32_t searchRadius)
+{
+    // Parallel Locally-Ordered Clustering
+    // https://meistdan.github.io/publications/ploc/paper.pdf
+    searchRadius = std::max(searchRadius, 1u); // Every cluster needs at least one candidate
+    auto primitives = generatePrimitives(vertices, triangles, mode); // Create primitive refences
+    auto mortonPrimitives = sortPrimitivesByMortonCode(primitives, mode);
+
+    std::vector<PrimitiveData> sortedPrimitives(primitives.size());
+    forEachIndex(primitives.size(), mode, [&](size_t i) {
+        sortedPrimitives[i] = primitives[mortonPrimitives[i].primitiveIndex];
+    });
+
+    // Intermediate binary tree: node i < N is a leaf containing sorted primitive i, merged clusters are appended after that
+    struct ClusterNode {
+        AABB bounds;
+        uint32_t leftChild, rightChild;
+        uint32_t primitiveCount;
+    };
+    const uint32_t numPrimitives = static_cast<uint32_t>(sortedPrimitives.size());
+    std::vector<ClusterNode> clusterNodes(numPrimitives > 0 ? 2 * numPrimitives - 1 : 0);
+    forEachIndex(numPrimitives, mode, [&](size_t i) {
+        clusterNodes[i] = { sortedPrimitives[i].bounds, 0, 0, 1 };
+    });
+
+    std::vector<uint32_t> clusters(numPrimitives);
+    std::iota(clusters.begin(), clusters.end(), 0);
+    uint32_t numClusterNodes = numPrimitives;
+
+    std::vector<AABB> clusterBounds;
+    std::vector<float> mergedAreas;
+    std::vector<uint32_t> nearestNeighbours, mergeOffsets, outputOffsets, nextClusters;
+    while (clusters.size() > 1) {
+        const uint32_t numClusters = static_cast<uint32_t>(clusters.size());
+
+        // Surface area of the union of every cluster with each of the (up to searchRadius) clusters that follow it.
+        // Computed once per pair and shared by both clusters of the pair.
+        clusterBounds.resize(numClusters);
+        forEachIndex(numClusters, mode, [&](size_t i) {
+            clusterBounds[i] = clusterNodes[clusters[i]].bounds;
+        });
+        mergedAreas.resize(size_t(numClusters) * searchRadius);
+        forEachIndex(numClusters, mode, [&](size_t i) {
+            for (uint32_t k = 0; k < searchRadius; k++) {
+                size_t j = i + 1 + k;
+                float area = j < numClusters ? mergedSurfaceArea(clusterBounds[i], clusterBounds[j]) : std::numeric_limits<float>::max();
+                // Empty or overflowing bounds compare as the largest area, keeping the order of the costs strict
+                mergedAreas[i * searchRadius + k] = std::isfinite(area) ? area : std::numeric_limits<float>::max();
+            }
+        });
+
+        // Find the nearest neighbour of every cluster within the search radius (along the Morton curve). Ties are
+        // broken by index such that the globally closest pair is always mutual, guaranteeing progress. The search starts
+        // from the first candidate so that a cluster never ends up as its own neighbour.
+        nearestNeighbours.resize(numClusters);
+        forEachIndex(numClusters, mode, [&](size_t i) {
+            uint32_t firstK = std::min(static_cast<uint32_t>(i), searchRadius);
+            size_t bestNeighbour = firstK > 0 ? i - firstK : i + 1;
+            float bestCost = firstK > 0 ? mergedAreas[bestNeighbour * searchRadius + firstK - 1] : mergedAreas[i * searchRadius];
+            for (uint32_t k = firstK; k > 0; k--) {
+                size_t j = i - k;
+                float cost = mergedAreas[j * searchRadius + k - 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestNeighbour = j;
+                }
+            }
+            for (uint32_t k = 0; k < searchRadius && i + 1 + k < numClusters; k++) {
+                float cost = mergedAreas[i * searchRadius + k];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestNeighbour = i + 1 + k;
+                }
+            }
+            nearestNeighbours[i] = static_cast<uint32_t>(bestNeighbour);
+        });
+
+        // Merge mutual nearest neighbours; the cluster with the lowest index takes the place of the pair
+        auto isMergeTarget = [&](size_t i) { return nearestNeighbours[nearestNeighbours[i]] == i && i < nearestNeighbours[i]; };
+        auto isMergeSource = [&](size_t i) { return nearestNeighbours[nearestNeighbours[i]] == i && i > nearestNeighbours[i]; };
+        uint32_t numMerges = exclusiveScanIndices(numClusters, mode, mergeOffsets, isMergeTarget);
+        if (numMerges == 0) {
+            // Not possible while the costs are strictly ordered, but a build that stops making progress would never
+            // terminate. Force a merge of the cheapest adjacent pair instead.
+            size_t cheapest = 0;
+            for (size_t i = 1; i + 1 < numClusters; i++) {
+                if (mergedAreas[i * searchRadius] < mergedAreas[cheapest * searchRadius])
+                    cheapest = i;
+            }
+            nearestNeighbours[cheapest] = static_cast<uint32_t>(cheapest + 1);
+            nearestNeighbours[cheapest + 1] = static_cast<uint32_t>(cheapest);
+            numMerges = exclusiveScanIndices(numClusters, mode, mergeOffsets, isMergeTarget);
+        }
+        uint32_t numNextClusters = exclusiveScanIndices(numClusters, mode, outputOffsets, [&](size_t i) { return !isMergeSource(i); });
+
+        nextClusters.resize(numNextClusters);
+        forEachIndex(numClusters, mode, [&](size_t i) {
+            if (isMergeSource(i))
+                return;
+
+            uint32_t clusterNodeID = clusters[i];
+            if (isMergeTarget(i)) {
+                const auto& left = clusterNodes[clusters[i]];
+                const auto& right = clusterNodes[clusters[nearestNeighbours[i]]];
+                clusterNodeID = numClusterNodes + mergeOffsets[i];
+                clusterNodes[clusterNodeID] = { left.bounds + right.bounds, clusters[i], clusters[nearestNeighbours[i]], left.primitiveCount + right.primitiveCount };
+            }
+            nextClusters[outputOffsets[i]] = clusterNodeID;
+        });
+        numClusterNodes += numMerges;
+        std::swap(clusters, nextClusters);
+    }
+
+    // Convert to the output format, collapsing small subtrees into leaf nodes
+    BVHAllocator nodeAllocator;
+    std::vector<PrimitiveData> outPrimitives;
+    outPrimitives.reserve(numPrimitives);
+
+    uint32_t rootNodeID = nodeAllocator.allocatePair();
+    std::stack<std::pair<uint32_t, uint32_t>> stack;
+    if (numPrimitives > 0)
+        stack.push({ rootNodeID, clusters[0] });
+    while (!stack.empty()) {
+        auto [nodeID, clusterNodeID] = stack.top();
+        stack.pop();
+
+        const auto& clusterNode = clusterNodes[clusterNodeID];
+        if (clusterNode.primitiveCount <= MIN_PRIMS_PER_LEAF) {
+            auto& node = nodeAllocator[nodeID];
+            node.bounds = clusterNode.bounds;
+            node.firstTriangleIndex = static_cast<uint32_t>(outPrimitives.size());
+            node.triangleCount = clusterNode.primitiveCount;
+
+            std::stack<uint32_t> subtreeStack;
+            subtreeStack.push(clusterNodeID);
+            while (!subtreeStack.empty()) {
+                uint32_t subtreeNodeID = subtreeStack.top();
+                subtreeStack.pop();
+
+                if (subtreeNodeID < numPrimitives) {
+                    outPrimitives.push_back(sortedPrimitives[subtreeNodeID]);
+                } else {
+                    subtreeStack.push(clusterNodes[subtreeNodeID].rightChild);
+                    subtreeStack.push(clusterNodes[subtreeNodeID].leftChild);
+                }
+            }
+        } else {
+            uint32_t leftNodeID = nodeAllocator.allocatePair();
+            uint32_t rightNodeID = leftNodeID + 1;
+
+            auto& node = nodeAllocator[nodeID]; // After allocation of child nodes because the allocator may move nodes in memory on allocation
+            node.bounds = clusterNode.bounds;
+            node.leftChildIndex = leftNodeID;
+            node.triangleCount = 0; // Triangle count = 0 -> inner node
+
+            stack.push({ leftNodeID, clusterNode.leftChild });
+            stack.push({ rightNodeID, clusterNode.rightChild });
+        }
+    }
+
+    return { rootNodeID, reorderTriangles(outPrimitives, triangles, mode), std::move(nodeAllocator.getNodesMove()) };
+}
+
+BvhBuildReturnType buildSpatialSplitBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode)
+{
+    auto startPrimitives = generatePrimitives(vertices, triangles, mode); // Create primitive refences
     OriginalPrimitives originalPrimitives { vertices, triangles };
 
-    auto rootNodeSurfaceArea = computeBounds(startPrimitives).surfaceArea();
+    auto rootNodeSurfaceArea = computeBounds(startPrimitives, mode).surfaceArea();
 
-    auto [rootNodeID, reorderedPrimitives, bvhNodes] = buildBVH(std::move(startPrimitives), [&](const SubBVHNode& node, std::span<const PrimitiveData> primitives, PrimInsertIter left, PrimInsertIter right) -> std::optional<std::pair<AABB, AABB>> {
+    // Called with insert iterators by the serial builder and with raw pointers by the parallel builder
+    auto splitFunc = [&](const SubBVHNode& node, std::span<const PrimitiveData> primitives, auto& left, auto& right) -> std::optional<std::pair<AABB, AABB>> {
         if (primitives.size() <= MIN_PRIMS_PER_LEAF)
             return {};
 
         float thresholdSAH = primitives.size() * SAH_INTERSECTION_COST;
-        if (auto objectSplitOpt = findObjectSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }); objectSplitOpt && getSAH(objectSplitOpt->partialSAH, node.bounds) < thresholdSAH) {
+        if (auto objectSplitOpt = findObjectSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }, mode); objectSplitOpt && getSAH(objectSplitOpt->partialSAH, node.bounds) < thresholdSAH) {
             float alpha = objectSplitOpt->leftBounds.intersection(objectSplitOpt->rightBounds).surfaceArea() / rootNodeSurfaceArea;
             if (alpha > SPATIAL_SPLIT_ALPHA) {
-                if (auto spatialSplitOpt = findSpatialSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }); spatialSplitOpt && getSAH(spatialSplitOpt->partialSAH, node.bounds) < thresholdSAH) {
+                if (auto spatialSplitOpt = findSpatialSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }, mode); spatialSplitOpt && getSAH(spatialSplitOpt->partialSAH, node.bounds) < thresholdSAH) {
                     return performSpatialSplit(primitives, originalPrimitives, *spatialSplitOpt, left, right);
                 }
             }
             return performObjectSplit(primitives, originalPrimitives, *objectSplitOpt, left, right);
-        } else if (auto spatialSplitOpt = findSpatialSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }); spatialSplitOpt && getSAH(spatialSplitOpt->partialSAH, node.bounds) < thresholdSAH) {
+        } else if (auto spatialSplitOpt = findSpatialSplitBinned(node.bounds, primitives, originalPrimitives, std::array { 0, 1, 2 }, mode); spatialSplitOpt && getSAH(spatialSplitOpt->partialSAH, node.bounds) < thresholdSAH) {
             return performSpatialSplit(primitives, originalPrimitives, *spatialSplitOpt, left, right);
         } else {
             return {};
         }
-    });
+    };
 
-    // Convert primitive references to triangles
-    std::vector<TriangleSceneData> outTriangles(reorderedPrimitives.size());
-    std::transform(reorderedPrimitives.begin(), reorderedPrimitives.end(), outTriangles.begin(), [&](const PrimitiveData& primitive) {
-        return triangles[primitive.globalIndex];
-    });
-    return { rootNodeID, outTriangles, bvhNodes };
+    auto [rootNodeID, reorderedPrimitives, bvhNodes] = mode == BvhBuildMode::Parallel
+        ? buildBVHParallel(std::move(startPrimitives), [&](const SubBVHNode& node, std::span<const PrimitiveData> primitives, PrimitiveData*& left, PrimitiveData*& right) {
+              return splitFunc(node, primitives, left, right);
+          })
+        : buildBVH(std::move(startPrimitives), [&](const SubBVHNode& node, std::span<const PrimitiveData> primitives, PrimInsertIter left, PrimInsertIter right) {
+              return splitFunc(node, primitives, left, right);
+          });
+
+    return { rootNodeID, reorderTriangles(reorderedPrimitives, triangles, mode), bvhNodes };
 }
 }
@@ -7,11 +7,25 @@
 
 namespace raytracer {
 
+static constexpr float SAH_TRAVERSAL_COST = 1.5f;
+static constexpr float SAH_INTERSECTION_COST = 1.0f;
+
 using BvhBuildReturnType = std::tuple<uint32_t, std::vector<TriangleSceneData>, std::vector<SubBVHNode>>;
-BvhBuildReturnType buildBinnedBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles);
+BvhBuildReturnType buildBinnedBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Parallel);
 // Only considers splitting along the longest axis
-BvhBuildReturnType buildBinnedFastBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles);
+BvhBuildReturnType buildBinnedFastBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Parallel);
+
+// Parallel Locally-Ordered Clustering: bottom-up build that merges clusters with their nearest neighbour (within searchRadius
+// clusters along the Morton curve). Higher quality than the linear BVH and faster to build than the binned SAH builders.
+BvhBuildReturnType buildPlocBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Parallel, uint32_t searchRadius = 8);
+
+// Linear BVH: splits at the highest differing bit of the Morton codes of the primitives. Much faster to build than the
+// SAH builders at the cost of a lower quality BVH, meant for meshes that have to be rebuilt every frame.
+BvhBuildReturnType buildLinearBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Parallel);
+
+BvhBuildReturnType buildSpatialSplitBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles, BvhBuildMode mode = BvhBuildMode::Parallel);
 
-BvhBuildReturnType buildSpatialSplitBVH(std::span<const VertexSceneData> vertices, std::span<const TriangleSceneData> triangles);
+// Surface area heuristic cost of the BVH (relative to the surface area of the root node)
+float computeSAHCost(std::span<const SubBVHNode> nodes, uint32_t rootNodeID);
 
 }
@@ -0,0 +1,102 @@
+#include "bvh_layout.h"
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+namespace raytracer {
+
+static constexpr uint32_t INVALID_NODE = std::numeric_limits<uint32_t>::max();
+
+// Places the children of the given node (a child pair is the unit of the layout)
+using EmitPairFunc = std::function<void(uint32_t)>;
+
+static void layoutDepthFirst(std::span<const SubBVHNode> nodes, uint32_t nodeID, const EmitPairFunc& emitPair)
+{
+    const auto& node = nodes[nodeID];
+    if (node.triangleCount != 0)
+        return;
+
+    emitPair(nodeID);
+
+    uint32_t firstChild = node.leftChildIndex;
+    uint32_t secondChild = node.leftChildIndex + 1;
+    if (nodes[secondChild].bounds.surfaceArea() > nodes[firstChild].bounds.surfaceArea())
+        std::swap(firstChild, secondChild);
+    layoutDepthFirst(nodes, firstChild, emitPair);
+    layoutDepthFirst(nodes, secondChild, emitPair);
+}
+
+static void collectDescendants(std::span<const SubBVHNode> nodes, uint32_t nodeID, uint32_t depth, std::vector<uint32_t>& outDescendants)
+{
+    const auto& node = nodes[nodeID];
+    if (node.triangleCount != 0)
+        return;
+
+    if (depth == 0) {
+        outDescendants.push_back(nodeID);
+    } else {
+        collectDescendants(nodes, node.leftChildIndex, depth - 1, outDescendants);
+        collectDescendants(nodes, node.leftChildIndex + 1, depth - 1, outDescendants);
+    }
+}
+
+// Lays out the top height levels (in child pairs) of the subtree
+static void layoutVanEmdeBoas(std::span<const SubBVHNode> nodes, uint32_t nodeID, uint32_t height, const EmitPairFunc& emitPair)
+{
+    if (nodes[nodeID].triangleCount != 0 || height == 0)
+        return;
+
+    if (height == 1) {
+        emitPair(nodeID);
+        return;
+    }
+
+    // Top half first, followed by the bottom trees from left to right
+    uint32_t topHeight = height / 2;
+    layoutVanEmdeBoas(nodes, nodeID, topHeight, emitPair);
+
+    std::vector<uint32_t> bottomRoots;
+    collectDescendants(nodes, nodeID, topHeight, bottomRoots);
+    for (uint32_t bottomRoot : bottomRoots)
+        layoutVanEmdeBoas(nodes, bottomRoot, height - topHeight, emitPair);
+}
+
+static uint32_t computeHeight(std::span<const SubBVHNode> nodes, uint32_t nodeID)
+{
+    const auto& node = nodes[nodeID];
+    if (node.triangleCount != 0)
+        return 0;
+
+    return 1 + std::max(computeHeight(nodes, node.leftChildIndex), computeHeight(nodes, node.leftChildIndex + 1));
+}
+
+uint32_t reorderBVHNodes(std::vector<SubBVHNode>& nodes, uint32_t rootNodeID, BvhNodeLayout layout)
+{
+    // Like the builders, the root is the first node and the second node is unused
+    std::vector<uint32_t> newNodeIDs(nodes.size(), INVALID_NODE);
+    newNodeIDs[rootNodeID] = 0;
+    uint32_t numNewNodes = 2;
+    auto emitPair = [&](uint32_t nodeID) {
+        newNodeIDs[nodes[nodeID].leftChildIndex] = numNewNodes++;
+        newNodeIDs[nodes[nodeID].leftChildIndex + 1] = numNewNodes++;
+    };
+
+    if (layout == BvhNodeLayout::DepthFirst)
+        layoutDepthFirst(nodes, rootNodeID, emitPair);
+    else
+        layoutVanEmdeBoas(nodes, rootNodeID, computeHeight(nodes, rootNodeID), emitPair);
+
+    std::vector<SubBVHNode> newNodes(numNewNodes);
+    for (uint32_t nodeID = 0; nodeID < nodes.size(); nodeID++) {
+        if (newNodeIDs[nodeID] == INVALID_NODE)
+            continue;
+
+        auto& newNode = newNodes[newNodeIDs[nodeID]];
+        newNode = nodes[nodeID];
+        if (newNode.triangleCount == 0)
+            newNode.leftChildIndex = newNodeIDs[newNode.leftChildIndex];
+    }
+    nodes = std::move(newNodes);
+    return 0;
+}
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include "bvh_nodes.h"
+#include <vector>
+
+namespace raytracer {
+
+enum class BvhNodeLayout {
+    DepthFirst, // Child pairs in depth first order, visiting the child with the largest surface area first
+    VanEmdeBoas // Cache oblivious: the tree is recursively split at half its height and every part is stored contiguously
+};
+
+// Reorders the nodes (children stay adjacent) to improve the memory locality of the traversal. Unreachable nodes are
+// removed. Returns the new root node ID.
+uint32_t reorderBVHNodes(std::vector<SubBVHNode>& nodes, uint32_t rootNodeID, BvhNodeLayout layout);
+
+}
@@ -0,0 +1,131 @@
+#include "bvh_morton.h"
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+
+namespace raytracer {
+
+static constexpr int MORTON_BITS_PER_AXIS = 21;
+static constexpr int RADIX_BITS = 8;
+static constexpr size_t RADIX_BUCKET_COUNT = 1 << RADIX_BITS;
+static constexpr size_t RADIX_SORT_BLOCK_SIZE = 1 << 14; // Primitives per parallel histogram / scatter task
+
+template <typename F>
+static void forEachBlock(size_t blockCount, BvhBuildMode mode, F&& f)
+{
+    if (mode == BvhBuildMode::Parallel) {
+        tbb::parallel_for(size_t(0), blockCount, f);
+    } else {
+        for (size_t i = 0; i < blockCount; i++)
+            f(i);
+    }
+}
+
+// Insert two zero bits in between every bit (of the lower 21 bits)
+static uint64_t expandBits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+uint64_t computeMortonCode(glm::vec3 point, const AABB& bounds)
+{
+    constexpr float gridSize = static_cast<float>(1 << MORTON_BITS_PER_AXIS);
+
+    glm::vec3 extent = bounds.extent();
+    uint64_t code = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float relative = extent[axis] > 0.0f ? (point[axis] - bounds.min[axis]) / extent[axis] : 0.0f;
+        float cell = std::clamp(relative * gridSize, 0.0f, gridSize - 1.0f);
+        code |= expandBits(static_cast<uint64_t>(cell)) << (2 - axis);
+    }
+    return code;
+}
+
+std::vector<MortonPrimitive> sortPrimitivesByMortonCode(std::span<const PrimitiveData> primitives, BvhBuildMode mode)
+{
+    // Quantize relative to the bounds of the primitive centers (instead of the primitive bounds) to make use of all the bits
+    AABB centerBounds;
+    if (mode == BvhBuildMode::Parallel) {
+        centerBounds = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, primitives.size()), AABB(), [&](const tbb::blocked_range<size_t>& range, AABB bounds) {
+                for (size_t i = range.begin(); i != range.end(); i++)
+                    bounds.fit(primitives[i].bounds.center());
+                return bounds;
+            },
+            std::plus<AABB>());
+    } else {
+        for (const auto& primitive : primitives)
+            centerBounds.fit(primitive.bounds.center());
+    }
+
+    std::vector<MortonPrimitive> mortonPrimitives(primitives.size());
+    size_t blockCount = (primitives.size() + RADIX_SORT_BLOCK_SIZE - 1) / RADIX_SORT_BLOCK_SIZE;
+    forEachBlock(blockCount, mode, [&](size_t block) {
+        size_t end = std::min((block + 1) * RADIX_SORT_BLOCK_SIZE, primitives.size());
+        for (size_t i = block * RADIX_SORT_BLOCK_SIZE; i < end; i++)
+            mortonPrimitives[i] = { computeMortonCode(primitives[i].bounds.center(), centerBounds), static_cast<uint32_t>(i) };
+    });
+
+    radixSort(mortonPrimitives, mode);
+    return mortonPrimitives;
+}
+
+void radixSort(std::vector<MortonPrimitive>& items, BvhBuildMode mode)
+{
+    // Every block computes a histogram of its digits, the histograms are then scanned in (digit, block) order to get the
+    // output offset of every (digit, block) pair. Blocks are processed in order so the sort is stable (and deterministic).
+    size_t blockCount = mode == BvhBuildMode::Parallel ? std::max(size_t(1), (items.size() + RADIX_SORT_BLOCK_SIZE - 1) / RADIX_SORT_BLOCK_SIZE) : 1;
+    size_t blockSize = (items.size() + blockCount - 1) / blockCount;
+
+    std::vector<MortonPrimitive> scratch(items.size());
+    std::vector<std::array<size_t, RADIX_BUCKET_COUNT>> histograms(blockCount);
+    for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        forEachBlock(blockCount, mode, [&](size_t block) {
+            auto& histogram = histograms[block];
+            std::fill(histogram.begin(), histogram.end(), 0);
+
+            size_t end = std::min((block + 1) * blockSize, items.size());
+            for (size_t i = block * blockSize; i < end; i++)
+                histogram[(items[i].mortonCode >> shift) & (RADIX_BUCKET_COUNT - 1)]++;
+        });
+
+        // Skip the pass if all keys have the same digit (the top bits are often unused)
+        bool singleDigit = false;
+        for (size_t digit = 0; digit < RADIX_BUCKET_COUNT; digit++) {
+            size_t digitCount = 0;
+            for (const auto& histogram : histograms)
+                digitCount += histogram[digit];
+            singleDigit |= digitCount == items.size();
+        }
+        if (singleDigit)
+            continue;
+
+        size_t offset = 0;
+        for (size_t digit = 0; digit < RADIX_BUCKET_COUNT; digit++) {
+            for (auto& histogram : histograms) {
+                size_t count = histogram[digit];
+                histogram[digit] = offset;
+                offset += count;
+            }
+        }
+
+        forEachBlock(blockCount, mode, [&](size_t block) {
+            auto& offsets = histograms[block];
+
+            size_t end = std::min((block + 1) * blockSize, items.size());
+            for (size_t i = block * blockSize; i < end; i++)
+                scratch[offsets[(items[i].mortonCode >> shift) & (RADIX_BUCKET_COUNT - 1)]++] = items[i];
+        });
+        std::swap(items, scratch);
+    }
+}
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include "aabb.h"
+#include "bvh_nodes.h"
+#include <span>
+#include <vector>
+
+namespace raytracer {
+
+struct MortonPrimitive {
+    uint64_t mortonCode;
+    uint32_t primitiveIndex;
+};
+
+// 63 bit Morton code (21 bits per axis) of a point, quantized relative to the given bounds
+uint64_t computeMortonCode(glm::vec3 point, const AABB& bounds);
+
+// Primitive indices sorted along the Morton curve through the centers of their bounds
+std::vector<MortonPrimitive> sortPrimitivesByMortonCode(std::span<const PrimitiveData> primitives, BvhBuildMode mode = BvhBuildMode::Serial);
+
+// Stable LSD radix sort on the Morton code (8 bits per pass)
+void radixSort(std::vector<MortonPrimitive>& items, BvhBuildMode mode = BvhBuildMode::Serial);
+
+}
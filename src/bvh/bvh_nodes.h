@@ -6,6 +6,13 @@
 
 namespace raytracer {
 
+// Parallel builds process independent subtrees as tasks on the TBB work-stealing scheduler.
+// The resulting node array is identical to that of the serial build.
+enum class BvhBuildMode {
+    Serial,
+    Parallel
+};
+
 struct OriginalPrimitives {
     std::span<const VertexSceneData> vertices;
     std::span<const TriangleSceneData> triangles;
@@ -19,19 +26,35 @@ using PrimInsertIter = std::insert_iterator<std::vector<PrimitiveData>>;
 
 struct TopBVHNode {
     AABB bounds;
-    glm::mat4 invTransform;
     union {
         struct
         {
             uint32_t leftChildIndex;
             uint32_t rightChildIndex;
         };
-        uint32_t subBvhNode;
+        struct
+        {
+            uint32_t subBvhNode;
+            uint32_t instanceIndex; // Into the instance array (only leafs have a transform)
+        };
     };
     uint32_t isLeaf;
     uint32_t __padding_cl; // Make the struct 16 byte aligned
 };
 
+// Transform of a top-level BVH leaf. Only the first three rows of the (affine) inverse transform are stored.
+struct TopBVHInstance {
+    glm::vec4 invTransformRows[3];
+};
+
+// Changed top-level node packed for the upload and scattered into place on the GPU, leafs also carry their instance
+struct TopBVHNodeUpdate {
+    TopBVHNode node;
+    TopBVHInstance instance; // Only valid if nodeIndex is below the number of instances
+    uint32_t nodeIndex;
+    uint32_t __padding_cl[3];
+};
+
 struct SubBVHNode {
     AABB bounds;
     union {
@@ -47,4 +70,36 @@ struct SubBVHNode {
         triangleCount = 0;
     }
 };
+
+// SubBVHNode with its bounds quantized to 8 bits relative to the parent (see quantizeBVH). A pair of siblings takes up
+// 64 bytes instead of 96 bytes.
+struct QuantizedSubBVHNode {
+    float origin[3]; // Quantization frame of the children: bounds = origin + quantized * 2^exponent
+    int8_t exponents[3];
+    uint8_t quantizedMin[3]; // Bounds of this node in the frame of its parent
+    uint8_t quantizedMax[3];
+    uint8_t __padding_cl[3];
+    union {
+        uint32_t leftChildIndex;
+        uint32_t firstTriangleIndex;
+    };
+    uint32_t triangleCount;
+};
+
+static constexpr uint32_t WIDE_BVH_WIDTH = 4; // 4 or 8
+
+// Node of a BVH with up to WIDE_BVH_WIDTH children (see collapseToWideBVH). The bounds of the children are stored in
+// the parent (structure of arrays) so that the traversal can test all children with a single node load.
+struct WideSubBVHNode {
+    float minX[WIDE_BVH_WIDTH];
+    float maxX[WIDE_BVH_WIDTH];
+    float minY[WIDE_BVH_WIDTH];
+    float maxY[WIDE_BVH_WIDTH];
+    float minZ[WIDE_BVH_WIDTH];
+    float maxZ[WIDE_BVH_WIDTH];
+    uint32_t children[WIDE_BVH_WIDTH]; // Wide node index for inner children, first triangle index for leaf children
+    uint32_t triangleCounts[WIDE_BVH_WIDTH]; // Triangle count = 0 -> inner child
+    uint32_t childCount;
+    uint32_t __padding_cl[3];
+};
 }
@@ -0,0 +1,174 @@
+#include "bvh_object_binning_simd.h"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BVH_BINNING_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// MSVC allows the use of any intrinsic without changing the target of the function (or translation unit)
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_AVX2
+#define TARGET_XSAVE
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+#endif
+
+namespace raytracer {
+
+static constexpr int MAX_SIMD_BIN_COUNT = 64;
+
+#ifdef BVH_BINNING_X64
+#ifdef _MSC_VER
+TARGET_XSAVE static bool cpuSupportsAVX2()
+{
+    std::array<int, 4> cpuInfo;
+    __cpuid(cpuInfo.data(), 0);
+    if (cpuInfo[0] < 7)
+        return false;
+
+    // The OS should save the YMM registers on a context switch
+    __cpuid(cpuInfo.data(), 1);
+    bool osxsave = cpuInfo[2] & (1 << 27);
+    bool avx = cpuInfo[2] & (1 << 28);
+    if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+
+    __cpuidex(cpuInfo.data(), 7, 0);
+    return cpuInfo[1] & (1 << 5);
+}
+#else
+static bool cpuSupportsAVX2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+TARGET_AVX2 static void performObjectBinningAVX2(
+    std::span<const PrimitiveData> primitives,
+    int axis,
+    float nodeMin,
+    float k1,
+    std::span<const float> leftPlanes,
+    std::span<const float> rightPlanes,
+    std::span<size_t> binPrimCounts,
+    std::span<AABB> binBounds)
+{
+    const int binCount = static_cast<int>(leftPlanes.size());
+    assert(binCount <= MAX_SIMD_BIN_COUNT);
+
+    // Keep the bin bounds in registers (4th component is unused)
+    __m128 binMin[MAX_SIMD_BIN_COUNT], binMax[MAX_SIMD_BIN_COUNT];
+    for (int binID = 0; binID < binCount; binID++) {
+        const auto& bounds = binBounds[binID];
+        binMin[binID] = _mm_setr_ps(bounds.min.x, bounds.min.y, bounds.min.z, 0.0f);
+        binMax[binID] = _mm_setr_ps(bounds.max.x, bounds.max.y, bounds.max.z, 0.0f);
+    }
+
+    // Offsets (in floats) of 8 consecutive primitives; gathering with them transposes the bounds along the axis to SoA form
+    static_assert(sizeof(PrimitiveData) % sizeof(float) == 0);
+    constexpr int stride = sizeof(PrimitiveData) / sizeof(float);
+    const __m256i gatherOffsets = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride, 4 * stride, 5 * stride, 6 * stride, 7 * stride);
+
+    const __m256 nodeMin8 = _mm256_set1_ps(nodeMin);
+    const __m256 k18 = _mm256_set1_ps(k1);
+    const __m256 half8 = _mm256_set1_ps(0.5f);
+    const __m256i lastBin8 = _mm256_set1_epi32(binCount - 1);
+
+    // Bin bounds are updated per primitive because multiple lanes may fall into the same bin
+    auto addToBin = [&](int binID, const PrimitiveData& primitive) {
+        // CL_VEC3 is padded to 4 floats so loading 16 bytes is safe
+        binMin[binID] = _mm_min_ps(binMin[binID], _mm_loadu_ps(&primitive.bounds.min.x));
+        binMax[binID] = _mm_max_ps(binMax[binID], _mm_loadu_ps(&primitive.bounds.max.x));
+        binPrimCounts[binID]++;
+    };
+
+    size_t i = 0;
+    for (; i + 8 <= primitives.size(); i += 8) {
+        __m256 primMin = _mm256_i32gather_ps(&primitives[i].bounds.min[axis], gatherOffsets, sizeof(float));
+        __m256 primMax = _mm256_i32gather_ps(&primitives[i].bounds.max[axis], gatherOffsets, sizeof(float));
+        __m256 primCenter = _mm256_mul_ps(_mm256_add_ps(primMin, primMax), half8); // Same as AABB::center (division by 2 is exact)
+
+        __m256 x = _mm256_mul_ps(k18, _mm256_sub_ps(primCenter, nodeMin8));
+        __m256i binIDs = _mm256_min_epi32(_mm256_cvttps_epi32(x), lastBin8);
+
+        // Compensate for floating point drift like the scalar loop (comparison results are -1 when true)
+        while (true) {
+            __m256 leftPlane = _mm256_i32gather_ps(leftPlanes.data(), binIDs, sizeof(float));
+            __m256 rightPlane = _mm256_i32gather_ps(rightPlanes.data(), binIDs, sizeof(float));
+            __m256i moveLeft = _mm256_castps_si256(_mm256_cmp_ps(primCenter, leftPlane, _CMP_LT_OQ));
+            __m256i moveRight = _mm256_and_si256(
+                _mm256_castps_si256(_mm256_cmp_ps(primCenter, rightPlane, _CMP_GE_OQ)),
+                _mm256_cmpgt_epi32(lastBin8, binIDs));
+            __m256i move = _mm256_or_si256(moveLeft, moveRight);
+            if (_mm256_testz_si256(move, move))
+                break;
+
+            binIDs = _mm256_sub_epi32(_mm256_add_epi32(binIDs, moveLeft), moveRight);
+        }
+
+        alignas(32) std::array<int, 8> laneBinIDs;
+        _mm256_store_si256(reinterpret_cast<__m256i*>(laneBinIDs.data()), binIDs);
+        for (int lane = 0; lane < 8; lane++)
+            addToBin(laneBinIDs[lane], primitives[i + lane]);
+    }
+
+    // Remaining primitives
+    for (; i < primitives.size(); i++) {
+        const auto& primitive = primitives[i];
+        float primCenter = primitive.bounds.center()[axis];
+        float x = k1 * (primCenter - nodeMin);
+        int binID = std::min(static_cast<int>(x), binCount - 1);
+        while (primCenter < leftPlanes[binID])
+            binID--;
+        while (primCenter >= rightPlanes[binID] && binID != binCount - 1)
+            binID++;
+
+        addToBin(binID, primitive);
+    }
+
+    for (int binID = 0; binID < binCount; binID++) {
+        alignas(16) std::array<float, 4> min, max;
+        _mm_store_ps(min.data(), binMin[binID]);
+        _mm_store_ps(max.data(), binMax[binID]);
+        binBounds[binID] = AABB(glm::vec3(min[0], min[1], min[2]), glm::vec3(max[0], max[1], max[2]));
+    }
+}
+#endif
+
+bool isObjectBinningSimdSupported()
+{
+#ifdef BVH_BINNING_X64
+    static const bool supported = cpuSupportsAVX2();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void performObjectBinningSimd(
+    std::span<const PrimitiveData> primitives,
+    int axis,
+    float nodeMin,
+    float k1,
+    std::span<const float> leftPlanes,
+    std::span<const float> rightPlanes,
+    std::span<size_t> binPrimCounts,
+    std::span<AABB> binBounds)
+{
+#ifdef BVH_BINNING_X64
+    if (isObjectBinningSimdSupported()) {
+        performObjectBinningAVX2(primitives, axis, nodeMin, k1, leftPlanes, rightPlanes, binPrimCounts, binBounds);
+        return;
+    }
+#endif
+    throw std::runtime_error("SIMD object binning is not supported on this CPU");
+}
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "aabb.h"
+#include "bvh_nodes.h"
+#include <span>
+
+namespace raytracer {
+
+// Checked once at runtime; when false the scalar binning loop should be used
+bool isObjectBinningSimdSupported();
+
+// Vectorized (AVX2) version of the centroid binning loop in performObjectBinning. Computes the bin IDs of 8 primitives
+// at a time and accumulates the primitive counts and bounds into the output arrays (one entry per bin). Bin i covers
+// the range [leftPlanes[i], rightPlanes[i]) along the axis; the results are identical to those of the scalar loop.
+void performObjectBinningSimd(
+    std::span<const PrimitiveData> primitives,
+    int axis,
+    float nodeMin,
+    float k1,
+    std::span<const float> leftPlanes,
+    std::span<const float> rightPlanes,
+    std::span<size_t> binPrimCounts,
+    std::span<AABB> binBounds);
+
+}
@@ -1,13 +1,21 @@
 #include "bvh_object_split.h"
 #include "bvh_build.h"
+#include "bvh_object_binning_simd.h"
 #include <algorithm>
 #include <array>
+#include <functional>
 #include <limits>
 #include <numeric>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 
 namespace raytracer {
 
 static constexpr int BVH_OBJECT_BIN_COUNT = 32;
+static constexpr size_t PARALLEL_BINNING_THRESHOLD = 1 << 15; // Smaller nodes are binned serially and rely on subtree parallelism
+static constexpr size_t PARALLEL_BINNING_GRAIN_SIZE = 4096;
+static constexpr size_t SIMD_BINNING_THRESHOLD = 64; // Converting the bins to and from the SIMD kernel is not worth it for small nodes
 
 struct ObjectBin {
     size_t primCount = 0;
@@ -21,20 +29,37 @@ struct ObjectBin {
     }
 };
 
-static std::array<ObjectBin, BVH_OBJECT_BIN_COUNT> performObjectBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives);
+using ObjectBins = std::array<ObjectBin, BVH_OBJECT_BIN_COUNT>;
+static ObjectBins performObjectBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives, bool parallel);
 
-std::optional<ObjectSplit> findObjectSplitBinned(const AABB& nodeBounds, std::span<const PrimitiveData> primitives, const OriginalPrimitives&, std::span<const int> axisToConsider)
+std::optional<ObjectSplit> findObjectSplitBinned(const AABB& nodeBounds, std::span<const PrimitiveData> primitives, const OriginalPrimitives&, std::span<const int> axisToConsider, BvhBuildMode mode)
 {
     glm::vec3 extent = nodeBounds.extent();
+    bool parallel = mode == BvhBuildMode::Parallel && primitives.size() >= PARALLEL_BINNING_THRESHOLD;
+
+    // Build a histogram based on the position of the bound centers along the given axis (all axis at once for large nodes)
+    assert(axisToConsider.size() <= 3);
+    std::array<std::optional<ObjectBins>, 3> axisBins;
+    auto binAxis = [&](size_t i) {
+        int axis = axisToConsider[i];
+        if (extent[axis] > std::numeric_limits<float>::min())
+            axisBins[i] = performObjectBinning(nodeBounds, axis, primitives, parallel);
+    };
+    if (parallel) {
+        tbb::parallel_for(size_t(0), axisToConsider.size(), binAxis);
+    } else {
+        for (size_t i = 0; i < axisToConsider.size(); i++)
+            binAxis(i);
+    }
 
     // For all three axis
     std::optional<ObjectSplit> bestSplit;
-    for (int axis : axisToConsider) {
-        if (extent[axis] <= std::numeric_limits<float>::min())
+    for (size_t i = 0; i < axisToConsider.size(); i++) {
+        if (!axisBins[i])
             continue;
 
-        // Build a histogram based on the position of the bound centers along the given axis
-        auto bins = performObjectBinning(nodeBounds, axis, primitives);
+        int axis = axisToConsider[i];
+        const auto& bins = *axisBins[i];
 
         // Combine bins from left-to-right (summedBins) and right-to-left (inverseSummedBins)
         std::array<ObjectBin, BVH_OBJECT_BIN_COUNT> summedBins;
@@ -81,6 +106,14 @@ std::pair<AABB, AABB> performObjectSplit(std::span<const PrimitiveData> primitiv
     return { split.leftBounds, split.rightBounds };
 }
 
+std::pair<AABB, AABB> performObjectSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives&, const ObjectSplit& split, PrimitiveData*& left, PrimitiveData*& right)
+{
+    std::tie(left, right) = std::partition_copy(primitives.begin(), primitives.end(), left, right, [&](const PrimitiveData& primitive) -> bool {
+        return primitive.bounds.center()[split.axis] < split.position;
+    });
+    return { split.leftBounds, split.rightBounds };
+}
+
 size_t performObjectSplitInPlace(std::span<PrimitiveData> primitives, const ObjectSplit& split)
 {
     auto iter = std::partition(primitives.begin(), primitives.end(), [&](const PrimitiveData& primitive) {
@@ -89,7 +122,7 @@ size_t performObjectSplitInPlace(std::span<PrimitiveData> primitives, const Obje
     return std::distance(primitives.begin(), iter);
 }
 
-static std::array<ObjectBin, BVH_OBJECT_BIN_COUNT> performObjectBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives)
+static ObjectBins performObjectBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives, bool parallel)
 {
     glm::vec3 extent = nodeBounds.max - nodeBounds.min;
 
@@ -97,31 +130,71 @@ static std::array<ObjectBin, BVH_OBJECT_BIN_COUNT> performObjectBinning(const AA
     float k1Inv = extent[axis] / BVH_OBJECT_BIN_COUNT;
 
     // Store side planes so we can compare with them without having to worry about floating point drift when recomputing them.
-    std::array<ObjectBin, BVH_OBJECT_BIN_COUNT> bins;
+    ObjectBins bins;
     for (size_t binID = 0; binID < BVH_OBJECT_BIN_COUNT; binID++) {
         bins[binID].leftPlane = binID == 0 ? nodeBounds.min[axis] : nodeBounds.min[axis] + binID * k1Inv;
         bins[binID].rightPlane = binID == BVH_OBJECT_BIN_COUNT - 1 ? nodeBounds.max[axis] : nodeBounds.min[axis] + (binID + 1) * k1Inv;
     }
 
-    // Loop through the triangles and calculate bin dimensions and primitive counts
-    for (const auto& primitive : primitives) {
-        // Calculate the bin ID as described in the paper
-        float primCenter = primitive.bounds.center()[axis];
-        float x = k1 * (primCenter - nodeBounds.min[axis]);
-        size_t binID = std::min(static_cast<int>(x), BVH_OBJECT_BIN_COUNT - 1); // Prevent out of bounds (if centroid on the right bound)
-
-        // Check against the bins left and right bounds to compensate for floating point drift
-        // Left (min) bound is inclusive, right (max) bound is exclusve
-        while (primCenter < bins[binID].leftPlane)
-            binID--;
-        while (primCenter >= bins[binID].rightPlane && binID != BVH_OBJECT_BIN_COUNT - 1)
-            binID++;
-
-        auto& bin = bins[binID];
-        bin.primCount++;
-        bin.bounds.fit(primitive.bounds);
+    std::array<float, BVH_OBJECT_BIN_COUNT> leftPlanes, rightPlanes;
+    for (size_t binID = 0; binID < BVH_OBJECT_BIN_COUNT; binID++) {
+        leftPlanes[binID] = bins[binID].leftPlane;
+        rightPlanes[binID] = bins[binID].rightPlane;
     }
 
-    return bins;
+    // Loop through the triangles and calculate bin dimensions and primitive counts
+    auto binPrimitives = [&](std::span<const PrimitiveData> rangePrimitives, ObjectBins rangeBins) {
+        if (rangePrimitives.size() >= SIMD_BINNING_THRESHOLD && isObjectBinningSimdSupported()) {
+            std::array<size_t, BVH_OBJECT_BIN_COUNT> primCounts;
+            std::array<AABB, BVH_OBJECT_BIN_COUNT> bounds;
+            for (size_t binID = 0; binID < BVH_OBJECT_BIN_COUNT; binID++) {
+                primCounts[binID] = rangeBins[binID].primCount;
+                bounds[binID] = rangeBins[binID].bounds;
+            }
+
+            performObjectBinningSimd(rangePrimitives, axis, nodeBounds.min[axis], k1, leftPlanes, rightPlanes, primCounts, bounds);
+
+            for (size_t binID = 0; binID < BVH_OBJECT_BIN_COUNT; binID++) {
+                rangeBins[binID].primCount = primCounts[binID];
+                rangeBins[binID].bounds = bounds[binID];
+            }
+            return rangeBins;
+        }
+
+        for (const auto& primitive : rangePrimitives) {
+            // Calculate the bin ID as described in the paper
+            float primCenter = primitive.bounds.center()[axis];
+            float x = k1 * (primCenter - nodeBounds.min[axis]);
+            size_t binID = std::min(static_cast<int>(x), BVH_OBJECT_BIN_COUNT - 1); // Prevent out of bounds (if centroid on the right bound)
+
+            // Check against the bins left and right bounds to compensate for floating point drift
+            // Left (min) bound is inclusive, right (max) bound is exclusve
+            while (primCenter < rangeBins[binID].leftPlane)
+                binID--;
+            while (primCenter >= rangeBins[binID].rightPlane && binID != BVH_OBJECT_BIN_COUNT - 1)
+                binID++;
+
+            auto& bin = rangeBins[binID];
+            bin.primCount++;
+            bin.bounds.fit(primitive.bounds);
+        }
+        return rangeBins;
+    };
+
+    if (parallel) {
+        // Every task bins a range of primitives into its own copy of the (empty) bins, which are merged afterwards.
+        // Merging only sums counts and unions bounds so the result does not depend on how the range was divided.
+        return tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, primitives.size(), PARALLEL_BINNING_GRAIN_SIZE), bins, [&](const tbb::blocked_range<size_t>& range, const ObjectBins& localBins) {
+                return binPrimitives(primitives.subspan(range.begin(), range.size()), localBins);
+            },
+            [](const ObjectBins& lhs, const ObjectBins& rhs) {
+                ObjectBins result;
+                std::transform(lhs.begin(), lhs.end(), rhs.begin(), result.begin(), std::plus<ObjectBin>());
+                return result;
+            });
+    } else {
+        return binPrimitives(primitives, bins);
+    }
 }
 }
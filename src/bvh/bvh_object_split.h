@@ -21,8 +21,11 @@ std::optional<ObjectSplit> findObjectSplitBinned(
     const AABB& nodeBounds,
     std::span<const PrimitiveData> primitives,
     const OriginalPrimitives& orignalPrimitives,
-    std::span<const int> axisToConsider);
+    std::span<const int> axisToConsider,
+    BvhBuildMode mode = BvhBuildMode::Serial);
 std::pair<AABB, AABB> performObjectSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives&, const ObjectSplit& split, PrimInsertIter left, PrimInsertIter right);
+// Writes to raw memory (each side needs room for primitives.size() references); left and right are advanced past the written references
+std::pair<AABB, AABB> performObjectSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives&, const ObjectSplit& split, PrimitiveData*& left, PrimitiveData*& right);
 size_t performObjectSplitInPlace(std::span<PrimitiveData> primitives, const ObjectSplit& split);
 
 }
@@ -0,0 +1,55 @@
+#include "bvh_primitive_arena.h"
+#include <algorithm>
+#include <cassert>
+
+namespace raytracer {
+
+PrimitiveArena::PrimitiveArena(size_t chunkSize)
+    : m_chunkSize(chunkSize)
+{
+}
+
+std::span<PrimitiveData> PrimitiveArena::allocate(size_t count)
+{
+    // Skip to the first (previously allocated) chunk that has enough space left
+    while (m_currentChunk < m_chunks.size()) {
+        auto& chunk = m_chunks[m_currentChunk];
+        if (m_currentOffset + count <= chunk.size()) {
+            std::span<PrimitiveData> result(chunk.data() + m_currentOffset, count);
+            m_currentOffset += count;
+            return result;
+        }
+
+        m_currentChunk++;
+        m_currentOffset = 0;
+    }
+
+    // Moving the chunk vector does not move the memory owned by the chunks. The allocations that follow (the children
+    // of the node being split) add up to about the same size again, so they will fit in the same chunk.
+    m_chunks.emplace_back(std::max(m_chunkSize, 2 * count));
+    m_currentChunk = m_chunks.size() - 1;
+    m_currentOffset = count;
+    return std::span<PrimitiveData>(m_chunks.back().data(), count);
+}
+
+std::span<PrimitiveData> PrimitiveArena::shrink(std::span<PrimitiveData> allocation, size_t count)
+{
+    assert(count <= allocation.size());
+    assert(allocation.data() + allocation.size() == m_chunks[m_currentChunk].data() + m_currentOffset);
+
+    m_currentOffset -= allocation.size() - count;
+    return allocation.subspan(0, count);
+}
+
+PrimitiveArena::Marker PrimitiveArena::getMarker() const
+{
+    return { m_currentChunk, m_currentOffset };
+}
+
+void PrimitiveArena::release(Marker marker)
+{
+    m_currentChunk = marker.chunk;
+    m_currentOffset = marker.offset;
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "bvh_nodes.h"
+#include <span>
+#include <vector>
+
+namespace raytracer {
+// Stack (LIFO) allocator for primitive references. Memory is handed out from chunks that are never moved or freed
+// before the arena is destroyed, so references stay valid while other threads read them. Chunks are allocated on
+// demand and sized from the allocation that did not fit, so an arena only grows with the work of its own thread.
+class PrimitiveArena {
+public:
+    struct Marker {
+        size_t chunk;
+        size_t offset;
+    };
+
+    PrimitiveArena(size_t chunkSize = 1 << 16);
+
+    std::span<PrimitiveData> allocate(size_t count);
+    // Give back the end of the most recent allocation
+    std::span<PrimitiveData> shrink(std::span<PrimitiveData> allocation, size_t count);
+
+    Marker getMarker() const;
+    void release(Marker marker); // Free everything that was allocated after the marker was taken
+
+private:
+    size_t m_chunkSize;
+    std::vector<std::vector<PrimitiveData>> m_chunks;
+    size_t m_currentChunk = 0;
+    size_t m_currentOffset = 0;
+};
+}
@@ -2,14 +2,20 @@
 #include <EASTL/fixed_vector.h>
 #include <algorithm>
 #include <array>
+#include <functional>
 #include <numeric>
 #include <stdexcept>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
 
 namespace raytracer {
 
 static constexpr int BVH_SPATIAL_BIN_COUNT = 8;
 static constexpr bool HIGH_QUALITY_CLIPS = true;
 static constexpr bool UNSPLITTING = true;
+static constexpr size_t PARALLEL_BINNING_THRESHOLD = 1 << 14; // Smaller nodes are binned serially and rely on subtree parallelism
+static constexpr size_t PARALLEL_BINNING_GRAIN_SIZE = 2048;
 
 struct SpatialBin {
     size_t enter = 0;
@@ -24,22 +30,39 @@ struct SpatialBin {
     }
 };
 
-static std::array<SpatialBin, BVH_SPATIAL_BIN_COUNT> performSpatialBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives);
+using SpatialBins = std::array<SpatialBin, BVH_SPATIAL_BIN_COUNT>;
+static SpatialBins performSpatialBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, bool parallel);
 static std::optional<AABB> clipTriangleBounds(AABB bounds, glm::vec3 v1, glm::vec3 v2, glm::vec3 v3);
 
-std::optional<SpatialSplit> findSpatialSplitBinned(const AABB& nodeBounds, std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, std::span<const int> axisToConsider)
+std::optional<SpatialSplit> findSpatialSplitBinned(const AABB& nodeBounds, std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, std::span<const int> axisToConsider, BvhBuildMode mode)
 {
     glm::vec3 extent = nodeBounds.extent();
+    bool parallel = mode == BvhBuildMode::Parallel && primitives.size() >= PARALLEL_BINNING_THRESHOLD;
+
+    // Build a histogram based on the position of the bound centers along the given axis (all axis at once for large nodes)
+    assert(axisToConsider.size() <= 3);
+    std::array<std::optional<SpatialBins>, 3> axisBins;
+    auto binAxis = [&](size_t i) {
+        // Going much further will only cause problems because of numerical inaccuracies
+        int axis = axisToConsider[i];
+        if (extent[axis] > std::numeric_limits<float>::min())
+            axisBins[i] = performSpatialBinning(nodeBounds, axis, primitives, originalPrimitives, parallel);
+    };
+    if (parallel) {
+        tbb::parallel_for(size_t(0), axisToConsider.size(), binAxis);
+    } else {
+        for (size_t i = 0; i < axisToConsider.size(); i++)
+            binAxis(i);
+    }
 
     // For all three axis
     std::optional<SpatialSplit> bestSplit;
-    for (int axis : axisToConsider) {
-        // Going much further will only cause problems because of numerical inaccuracies
-        if (extent[axis] <= std::numeric_limits<float>::min())
+    for (size_t i = 0; i < axisToConsider.size(); i++) {
+        if (!axisBins[i])
             continue;
 
-        // Build a histogram based on the position of the bound centers along the given axis
-        auto bins = performSpatialBinning(nodeBounds, axis, primitives, originalPrimitives);
+        int axis = axisToConsider[i];
+        const auto& bins = *axisBins[i];
 
         // Combine bins from left-to-right (summedBins) and right-to-left (inverseSummedBins)
         std::array<SpatialBin, BVH_SPATIAL_BIN_COUNT> summedBins;
@@ -83,7 +106,8 @@ std::optional<SpatialSplit> findSpatialSplitBinned(const AABB& nodeBounds, std::
     return bestSplit;
 }
 
-std::pair<AABB, AABB> performSpatialSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, const SpatialSplit& split, PrimInsertIter left, PrimInsertIter right)
+template <typename OutIter>
+static std::pair<AABB, AABB> performSpatialSplitImpl(std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, const SpatialSplit& split, OutIter& left, OutIter& right)
 {
     // http://www.nvidia.com/docs/IO/77714/sbvh.pdf
     // Reference unsplitting
@@ -161,7 +185,17 @@ std::pair<AABB, AABB> performSpatialSplit(std::span<const PrimitiveData> primiti
     return { leftBounds, rightBounds };
 }
 
-static std::array<SpatialBin, BVH_SPATIAL_BIN_COUNT> performSpatialBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives, const OriginalPrimitives& triangleData)
+std::pair<AABB, AABB> performSpatialSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, const SpatialSplit& split, PrimInsertIter left, PrimInsertIter right)
+{
+    return performSpatialSplitImpl(primitives, originalPrimitives, split, left, right);
+}
+
+std::pair<AABB, AABB> performSpatialSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, const SpatialSplit& split, PrimitiveData*& left, PrimitiveData*& right)
+{
+    return performSpatialSplitImpl(primitives, originalPrimitives, split, left, right);
+}
+
+static SpatialBins performSpatialBinning(const AABB& nodeBounds, int axis, std::span<const PrimitiveData> primitives, const OriginalPrimitives& triangleData, bool parallel)
 {
     glm::vec3 extent = nodeBounds.max - nodeBounds.min;
 
@@ -169,73 +203,90 @@ static std::array<SpatialBin, BVH_SPATIAL_BIN_COUNT> performSpatialBinning(const
     float k1Inv = extent[axis] / BVH_SPATIAL_BIN_COUNT;
 
     // Store side planes so we can compare with them without having to worry about floating point drift when recomputing them.
-    std::array<SpatialBin, BVH_SPATIAL_BIN_COUNT> bins;
+    SpatialBins bins;
     for (int binID = 0; binID < BVH_SPATIAL_BIN_COUNT; binID++) {
         bins[binID].leftPlane = binID == 0 ? nodeBounds.min[axis] : nodeBounds.min[axis] + binID * k1Inv;
         bins[binID].rightPlane = binID == BVH_SPATIAL_BIN_COUNT - 1 ? nodeBounds.max[axis] : nodeBounds.min[axis] + (binID + 1) * k1Inv;
     }
 
     // Loop through the triangles and calculate bin dimensions and primitive counts
-    for (const auto& primitive : primitives) {
-        // Calculate the index of the left-most and right-most bins that the primitives covers
-        float xMin = k1 * (primitive.bounds.min[axis] - nodeBounds.min[axis]);
-        float xMax = k1 * (primitive.bounds.max[axis] - nodeBounds.min[axis]);
-        int leftBinID = std::min(static_cast<int>(xMin), BVH_SPATIAL_BIN_COUNT - 1); // Prevent out of bounds (if centroid on the right bound)
-        int rightBinID = std::min(static_cast<int>(xMax), BVH_SPATIAL_BIN_COUNT - 1); // Prevent out of bounds (if centroid on the right bound)
-
-        // Check against the bins left and right bounds to compensate for floating point drift
-        // If the left (min) side of the primitive bounds lies precisely on the splitting plane than it is assigned to the bin left of the plane.
-        // If the right (max) side of the primitive bounds lies precisely on the splitting plane than it is assigned to the bin right of the plane.
-        // This makes sure that the results of binning matches the results of performing splitting of the node (if the split is selected).
-        while (primitive.bounds.min[axis] <= bins[leftBinID].leftPlane && leftBinID > 0)
-            leftBinID--;
-        while (primitive.bounds.min[axis] > bins[leftBinID].rightPlane && leftBinID != BVH_SPATIAL_BIN_COUNT - 1)
-            leftBinID++;
-        while (primitive.bounds.max[axis] < bins[rightBinID].leftPlane && rightBinID > 0)
-            rightBinID--;
-        while (primitive.bounds.max[axis] >= bins[rightBinID].rightPlane && rightBinID != BVH_SPATIAL_BIN_COUNT - 1)
-            rightBinID++;
-
-        assert(nodeBounds.fullyContains(primitive.bounds));
-        assert(leftBinID <= rightBinID);
-
-        if (leftBinID == rightBinID) {
-            // Triangle is completely contained in 1 bin
-            bins[leftBinID].enter++;
-            bins[rightBinID].exit++;
-
-            bins[leftBinID].bounds.fit(primitive.bounds);
-        } else {
-            // Keep track of the actual bins. This may defer from the values we just calculated if the bounds clipping fails (because of floating point errors).
-            int actualLeftBin = BVH_SPATIAL_BIN_COUNT;
-            int actualRightBin = -1;
-
-            // For each bin covered: clip triangle use it to expand bin bounds
-            TriangleSceneData triangle = triangleData.triangles[primitive.globalIndex];
-            glm::vec3 v1 = triangleData.vertices[triangle.indices[0]].vertex;
-            glm::vec3 v2 = triangleData.vertices[triangle.indices[1]].vertex;
-            glm::vec3 v3 = triangleData.vertices[triangle.indices[2]].vertex;
-            for (int binID = leftBinID; binID <= rightBinID; binID++) {
-                AABB binBounds = primitive.bounds;
-                binBounds.min[axis] = bins[binID].leftPlane;
-                binBounds.max[axis] = bins[binID].rightPlane;
-
-                auto clippedPrimBoundsOpt = clipTriangleBounds(binBounds, v1, v2, v3);
-                if (clippedPrimBoundsOpt) {
-                    actualLeftBin = std::min(actualLeftBin, binID);
-                    actualRightBin = std::max(actualRightBin, binID);
-                    bins[binID].bounds.fit(*clippedPrimBoundsOpt);
+    auto binPrimitives = [&](std::span<const PrimitiveData> rangePrimitives, SpatialBins rangeBins) {
+        for (const auto& primitive : rangePrimitives) {
+            // Calculate the index of the left-most and right-most bins that the primitives covers
+            float xMin = k1 * (primitive.bounds.min[axis] - nodeBounds.min[axis]);
+            float xMax = k1 * (primitive.bounds.max[axis] - nodeBounds.min[axis]);
+            int leftBinID = std::min(static_cast<int>(xMin), BVH_SPATIAL_BIN_COUNT - 1); // Prevent out of bounds (if centroid on the right bound)
+            int rightBinID = std::min(static_cast<int>(xMax), BVH_SPATIAL_BIN_COUNT - 1); // Prevent out of bounds (if centroid on the right bound)
+
+            // Check against the bins left and right bounds to compensate for floating point drift
+            // If the left (min) side of the primitive bounds lies precisely on the splitting plane than it is assigned to the bin left of the plane.
+            // If the right (max) side of the primitive bounds lies precisely on the splitting plane than it is assigned to the bin right of the plane.
+            // This makes sure that the results of binning matches the results of performing splitting of the node (if the split is selected).
+            while (primitive.bounds.min[axis] <= rangeBins[leftBinID].leftPlane && leftBinID > 0)
+                leftBinID--;
+            while (primitive.bounds.min[axis] > rangeBins[leftBinID].rightPlane && leftBinID != BVH_SPATIAL_BIN_COUNT - 1)
+                leftBinID++;
+            while (primitive.bounds.max[axis] < rangeBins[rightBinID].leftPlane && rightBinID > 0)
+                rightBinID--;
+            while (primitive.bounds.max[axis] >= rangeBins[rightBinID].rightPlane && rightBinID != BVH_SPATIAL_BIN_COUNT - 1)
+                rightBinID++;
+
+            assert(nodeBounds.fullyContains(primitive.bounds));
+            assert(leftBinID <= rightBinID);
+
+            if (leftBinID == rightBinID) {
+                // Triangle is completely contained in 1 bin
+                rangeBins[leftBinID].enter++;
+                rangeBins[rightBinID].exit++;
+
+                rangeBins[leftBinID].bounds.fit(primitive.bounds);
+            } else {
+                // Keep track of the actual bins. This may defer from the values we just calculated if the bounds clipping fails (because of floating point errors).
+                int actualLeftBin = BVH_SPATIAL_BIN_COUNT;
+                int actualRightBin = -1;
+
+                // For each bin covered: clip triangle use it to expand bin bounds
+                TriangleSceneData triangle = triangleData.triangles[primitive.globalIndex];
+                glm::vec3 v1 = triangleData.vertices[triangle.indices[0]].vertex;
+                glm::vec3 v2 = triangleData.vertices[triangle.indices[1]].vertex;
+                glm::vec3 v3 = triangleData.vertices[triangle.indices[2]].vertex;
+                for (int binID = leftBinID; binID <= rightBinID; binID++) {
+                    AABB binBounds = primitive.bounds;
+                    binBounds.min[axis] = rangeBins[binID].leftPlane;
+                    binBounds.max[axis] = rangeBins[binID].rightPlane;
+
+                    auto clippedPrimBoundsOpt = clipTriangleBounds(binBounds, v1, v2, v3);
+                    if (clippedPrimBoundsOpt) {
+                        actualLeftBin = std::min(actualLeftBin, binID);
+                        actualRightBin = std::max(actualRightBin, binID);
+                        rangeBins[binID].bounds.fit(*clippedPrimBoundsOpt);
+                    }
                 }
-            }
 
-            if (actualLeftBin <= actualRightBin) {
-                bins[actualLeftBin].enter++;
-                bins[actualRightBin].exit++;
+                if (actualLeftBin <= actualRightBin) {
+                    rangeBins[actualLeftBin].enter++;
+                    rangeBins[actualRightBin].exit++;
+                }
             }
         }
+        return rangeBins;
+    };
+
+    if (parallel) {
+        // Every task bins a range of primitives into its own copy of the (empty) bins, which are merged afterwards.
+        // Merging only sums counts and unions bounds so the result does not depend on how the range was divided.
+        return tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, primitives.size(), PARALLEL_BINNING_GRAIN_SIZE), bins, [&](const tbb::blocked_range<size_t>& range, const SpatialBins& localBins) {
+                return binPrimitives(primitives.subspan(range.begin(), range.size()), localBins);
+            },
+            [](const SpatialBins& lhs, const SpatialBins& rhs) {
+                SpatialBins result;
+                std::transform(lhs.begin(), lhs.end(), rhs.begin(), result.begin(), std::plus<SpatialBin>());
+                return result;
+            });
+    } else {
+        return binPrimitives(primitives, bins);
     }
-
-    return bins;
 }
 
 static std::optional<glm::vec3> lineAxisAlignedPlaneIntersection(glm::vec3 v1, glm::vec3 v2, int axis, float planePos)
@@ -23,7 +23,10 @@ std::optional<SpatialSplit> findSpatialSplitBinned(
     const AABB& nodeBounds,
     std::span<const PrimitiveData> primitives,
     const OriginalPrimitives& orignalPrimitives,
-    std::span<const int> axisToConsider);
+    std::span<const int> axisToConsider,
+    BvhBuildMode mode = BvhBuildMode::Serial);
 std::pair<AABB, AABB> performSpatialSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, const SpatialSplit& split, PrimInsertIter left, PrimInsertIter right);
+// Writes to raw memory (each side needs room for primitives.size() references); left and right are advanced past the written references
+std::pair<AABB, AABB> performSpatialSplit(std::span<const PrimitiveData> primitives, const OriginalPrimitives& originalPrimitives, const SpatialSplit& split, PrimitiveData*& left, PrimitiveData*& right);
 
 }
@@ -1,11 +1,122 @@
 #include "bvh_test.h"
+#include "bvh_build.h"
+#include "bvh_layout.h"
+#include "optimize_bvh.h"
+#include "ray.h"
+#include "scene.h"
+#include "timer.h"
+#include "top_bvh_build.h"
+#include <algorithm>
 #include <array>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <utility>
 
 namespace raytracer {
 
-void traverse(std::vector<SubBVHNode>& bvhNodes)
+static constexpr size_t CACHE_LINE_SIZE = 64;
+static constexpr int NUM_LAYOUT_TEST_RAYS = 100000;
+
+static bool intersectRayAABB(const Ray& ray, glm::vec3 invDirection, const AABB& bounds, float maxT, float& outT)
 {
+    glm::vec3 t1 = (glm::vec3(bounds.min) - ray.origin) * invDirection;
+    glm::vec3 t2 = (glm::vec3(bounds.max) - ray.origin) * invDirection;
+    glm::vec3 tNear = glm::min(t1, t2);
+    glm::vec3 tFar = glm::max(t1, t2);
+    float tmin = std::max(std::max(tNear.x, tNear.y), tNear.z);
+    float tmax = std::min(std::min(tFar.x, tFar.y), tFar.z);
+
+    outT = tmin;
+    return tmax >= tmin && tmax >= 0.0f && tmin < maxT;
+}
+
+// Moller-Trumbore
+static bool intersectRayTriangle(const Ray& ray, glm::vec3 v0, glm::vec3 v1, glm::vec3 v2, float& outT)
+{
+    glm::vec3 edge1 = v1 - v0;
+    glm::vec3 edge2 = v2 - v0;
+    glm::vec3 p = glm::cross(ray.direction, edge2);
+    float det = glm::dot(edge1, p);
+    if (std::abs(det) < 1e-12f)
+        return false;
+
+    float invDet = 1.0f / det;
+    glm::vec3 t = ray.origin - v0;
+    float u = glm::dot(t, p) * invDet;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+
+    glm::vec3 q = glm::cross(t, edge1);
+    float v = glm::dot(ray.direction, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+
+    outT = glm::dot(edge2, q) * invDet;
+    return outT > 0.0f;
+}
+
+// Closest hit traversal in the same order as traceRay (scene.cl). Returns the number of distinct cache lines of the
+// node array that were touched (assuming the array starts at a cache line boundary).
+static size_t traceRayCountingCacheLines(
+    const Ray& ray,
+    std::span<const SubBVHNode> nodes,
+    uint32_t rootNodeID,
+    std::span<const VertexSceneData> vertices,
+    std::span<const TriangleSceneData> triangles,
+    std::vector<size_t>& cacheLines)
+{
+    cacheLines.clear();
+    auto touchNode = [&](uint32_t nodeID) {
+        size_t begin = nodeID * sizeof(SubBVHNode);
+        for (size_t line = begin / CACHE_LINE_SIZE; line <= (begin + sizeof(SubBVHNode) - 1) / CACHE_LINE_SIZE; line++)
+            cacheLines.push_back(line);
+    };
+
+    glm::vec3 invDirection = 1.0f / ray.direction;
+    float closestT = std::numeric_limits<float>::max();
+    std::vector<uint32_t> stack = { rootNodeID };
+    while (!stack.empty()) {
+        uint32_t nodeID = stack.back();
+        stack.pop_back();
+
+        touchNode(nodeID);
+        const auto& node = nodes[nodeID];
+        if (node.triangleCount != 0) {
+            for (const auto& triangle : triangles.subspan(node.firstTriangleIndex, node.triangleCount)) {
+                float t;
+                if (intersectRayTriangle(ray, vertices[triangle.indices[0]].vertex, vertices[triangle.indices[1]].vertex, vertices[triangle.indices[2]].vertex, t))
+                    closestT = std::min(closestT, t);
+            }
+        } else {
+            touchNode(node.leftChildIndex);
+            touchNode(node.leftChildIndex + 1);
+
+            float leftT, rightT;
+            bool leftHit = intersectRayAABB(ray, invDirection, nodes[node.leftChildIndex].bounds, closestT, leftT);
+            bool rightHit = intersectRayAABB(ray, invDirection, nodes[node.leftChildIndex + 1].bounds, closestT, rightT);
+            if (leftHit && rightHit) {
+                // Push the closest child last so it is visited first
+                if (leftT < rightT) {
+                    stack.push_back(node.leftChildIndex + 1);
+                    stack.push_back(node.leftChildIndex);
+                } else {
+                    stack.push_back(node.leftChildIndex);
+                    stack.push_back(node.leftChildIndex + 1);
+                }
+            } else if (leftHit) {
+                stack.push_back(node.leftChildIndex);
+            } else if (rightHit) {
+                stack.push_back(node.leftChildIndex + 1);
+            }
+        }
+    }
+
+    std::sort(cacheLines.begin(), cacheLines.end());
+    return std::unique(cacheLines.begin(), cacheLines.end()) - cacheLines.begin();
 }
 
 BvhTester::BvhTester(std::shared_ptr<Mesh> meshPtr)
@@ -20,13 +131,63 @@ BvhTester::~BvhTester()
 {
 }
 
+void testTopBvhRefit(Scene& scene)
+{
+    std::cout << "\n\n-----   TOP-LEVEL BVH REFIT TEST   -----\n";
+    if (scene.getRootNode().children.empty())
+        return;
+
+    // The sub BVH roots do not influence the bounds
+    std::vector<uint32_t> meshBvhRoots(scene.getMeshes().size(), 0);
+    TopBVH refitted;
+    refitted.update(scene, meshBvhRoots);
+    scene.clearChanges();
+
+    // Small move so that the refit does not make the tree expensive enough to be rebuilt
+    SceneNode& node = *scene.getRootNode().children.back();
+    Transform originalTransform = node.transform;
+    Transform transform = originalTransform;
+    transform.location += glm::vec3(0.1f, 0.05f, 0.0f);
+    transform.orientation = glm::quat(glm::vec3(0.0f, 0.3f, 0.0f)) * transform.orientation;
+    scene.setTransform(node, transform);
+    refitted.update(scene, meshBvhRoots);
+
+    TopBVH rebuilt;
+    rebuilt.update(scene, meshBvhRoots);
+    scene.setTransform(node, originalTransform);
+    scene.clearChanges();
+
+    // Both collect the leafs in scene graph order, so leaf i belongs to the same instance
+    auto refittedNodes = refitted.getNodes();
+    auto rebuiltNodes = rebuilt.getNodes();
+    auto equalBounds = [](const AABB& a, const AABB& b) {
+        return glm::vec3(a.min) == glm::vec3(b.min) && glm::vec3(a.max) == glm::vec3(b.max);
+    };
+    bool success = refittedNodes.size() == rebuiltNodes.size();
+    for (uint32_t nodeID = 0; success && nodeID < refittedNodes.size(); nodeID++) {
+        const auto& refittedNode = refittedNodes[nodeID];
+        if (refittedNode.isLeaf) {
+            success = rebuiltNodes[nodeID].isLeaf && equalBounds(refittedNode.bounds, rebuiltNodes[nodeID].bounds);
+        } else {
+            // Inner nodes may differ in topology but must tightly fit their children
+            success = equalBounds(refittedNode.bounds, refittedNodes[refittedNode.leftChildIndex].bounds + refittedNodes[refittedNode.rightChildIndex].bounds);
+        }
+    }
+    success = success && equalBounds(refittedNodes[refitted.getRootNode()].bounds, rebuiltNodes[rebuilt.getRootNode()].bounds);
+
+    std::cout << "Number of instances: " << refitted.getInstances().size() << "\n";
+    std::cout << (success ? "Success" : "Failed") << "\n\n"
+              << std::flush;
+}
+
 void BvhTester::test()
 {
     std::cout << "\n\n-----   BVH TEST STARTING   -----\n";
     std::cout << "Number of triangles in model: " << m_triangles.size() << "\n";
     std::cout << "Number of bvh nodes in model: " << m_bvhNodes.size() << "\n";
     std::cout << "Number of bvh nodes visited: " << countNodes(m_rootNode) << " out of " << m_bvhNodes.size() << "\n";
-    std::cout << "Recursion depth: " << countDepth(m_rootNode) << "\n\n";
+    std::cout << "Recursion depth: " << countDepth(m_rootNode) << "\n";
+    std::cout << "SAH cost: " << computeSAHCost(m_bvhNodes, m_rootNode) << "\n\n";
 
     std::cout << "Number of triangles visited: " << countTriangles(m_rootNode) << " out of " << m_triangles.size() << "\n";
     std::cout << "Average triangle per leaf: " << (float)countTriangles(m_rootNode) / countLeafs(m_rootNode) << "\n";
@@ -51,6 +212,82 @@ void BvhTester::test()
               << std::flush;
 }
 
+void BvhTester::compareBuilders()
+{
+    using BuildFunc = std::function<BvhBuildReturnType(std::span<const VertexSceneData>, std::span<const TriangleSceneData>)>;
+    auto optimized = [](BvhBuildReturnType bvh) {
+        auto& [rootNode, triangles, bvhNodes] = bvh;
+        optimizeBVH(bvhNodes, rootNode);
+        return bvh;
+    };
+    const std::array<std::pair<std::string_view, BuildFunc>, 8> builders = { {
+        { "Linear", [](auto vertices, auto triangles) { return buildLinearBVH(vertices, triangles); } },
+        { "Linear + treelets", [&](auto vertices, auto triangles) { return optimized(buildLinearBVH(vertices, triangles)); } },
+        { "PLOC", [](auto vertices, auto triangles) { return buildPlocBVH(vertices, triangles); } },
+        { "PLOC + treelets", [&](auto vertices, auto triangles) { return optimized(buildPlocBVH(vertices, triangles)); } },
+        { "Binned fast", [](auto vertices, auto triangles) { return buildBinnedFastBVH(vertices, triangles); } },
+        { "Binned", [](auto vertices, auto triangles) { return buildBinnedBVH(vertices, triangles); } },
+        { "Binned (serial)", [](auto vertices, auto triangles) { return buildBinnedBVH(vertices, triangles, BvhBuildMode::Serial); } },
+        { "Spatial split", [](auto vertices, auto triangles) { return buildSpatialSplitBVH(vertices, triangles); } },
+    } };
+
+    std::cout << "\n\n-----   BVH BUILDER COMPARISON   -----\n";
+    std::cout << "Number of triangles in model: " << m_triangles.size() << "\n";
+    for (const auto& [name, buildFunc] : builders) {
+        Timer timer;
+        auto [rootNode, triangles, bvhNodes] = buildFunc(m_vertices, m_triangles);
+        double buildTime = timer.elapsed<double>() * 1000.0;
+
+        std::cout << name << ":\t" << buildTime << "ms\tSAH cost: " << computeSAHCost(bvhNodes, rootNode) << "\tnodes: " << bvhNodes.size() << "\n";
+    }
+    std::cout << "\n\n"
+              << std::flush;
+}
+
+void BvhTester::compareNodeLayouts()
+{
+    // Incoherent rays from a sphere around the mesh towards random points inside its bounds
+    const AABB& bounds = m_bvhNodes[m_rootNode].bounds;
+    glm::vec3 center = bounds.center();
+    float radius = glm::length(bounds.extent());
+    std::mt19937 randomEngine(1234);
+    std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
+    auto randomVec3 = [&]() { return glm::vec3(distribution(randomEngine), distribution(randomEngine), distribution(randomEngine)); };
+
+    std::vector<Ray> rays;
+    for (int i = 0; i < NUM_LAYOUT_TEST_RAYS; i++) {
+        glm::vec3 origin = center + radius * glm::normalize(randomVec3() - 0.5f);
+        glm::vec3 target = glm::vec3(bounds.min) + randomVec3() * bounds.extent();
+        rays.emplace_back(origin, glm::normalize(target - origin));
+    }
+
+    const std::array<std::pair<std::string_view, std::optional<BvhNodeLayout>>, 3> layouts = { {
+        { "Current", std::nullopt },
+        { "Depth first", BvhNodeLayout::DepthFirst },
+        { "Van Emde Boas", BvhNodeLayout::VanEmdeBoas },
+    } };
+
+    std::cout << "\n\n-----   BVH NODE LAYOUT COMPARISON   -----\n";
+    for (const auto& [name, layout] : layouts) {
+        std::vector<SubBVHNode> nodes(m_bvhNodes.begin(), m_bvhNodes.end());
+        uint32_t rootNode = m_rootNode;
+
+        Timer timer;
+        if (layout)
+            rootNode = reorderBVHNodes(nodes, rootNode, *layout);
+        double reorderTime = timer.elapsed<double>() * 1000.0;
+
+        size_t totalCacheLines = 0;
+        std::vector<size_t> cacheLines;
+        for (const auto& ray : rays)
+            totalCacheLines += traceRayCountingCacheLines(ray, nodes, rootNode, m_vertices, m_triangles, cacheLines);
+
+        std::cout << name << ":\t" << reorderTime << "ms\tcache lines per ray: " << (double)totalCacheLines / rays.size() << "\n";
+    }
+    std::cout << "\n\n"
+              << std::flush;
+}
+
 uint32_t BvhTester::countNodes(uint32_t nodeId)
 {
     auto& node = m_bvhNodes[nodeId];
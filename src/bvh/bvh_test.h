@@ -5,12 +5,19 @@
 #include <span>
 
 namespace raytracer {
+class Scene;
+
+// Moves an instance of the scene and checks that refitting the top-level BVH gives the same bounds as rebuilding it
+void testTopBvhRefit(Scene& scene);
+
 class BvhTester {
 public:
     BvhTester(std::shared_ptr<Mesh> meshPtr);
     ~BvhTester();
 
     void test();
+    void compareBuilders(); // SAH cost and build time of all BVH builders for this mesh
+    void compareNodeLayouts(); // Cache lines touched per ray with the different node layouts
 
 private:
     uint32_t countNodes(uint32_t nodeId);
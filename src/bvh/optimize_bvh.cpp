@@ -0,0 +1,178 @@
+#include "optimize_bvh.h"
+#include "aabb.h"
+#include "bvh_build.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <functional>
+#include <limits>
+#include <tbb/parallel_invoke.h>
+#include <vector>
+
+namespace raytracer {
+
+static constexpr int MAX_TREELET_LEAVES = 7;
+static constexpr uint32_t MIN_TREELET_ROOT_LEAVES = MAX_TREELET_LEAVES; // Doubled every iteration (gamma in the paper)
+static constexpr uint32_t PARALLEL_OPTIMIZE_TASK_THRESHOLD = 512; // Subtrees with more leaves process their children in parallel
+static constexpr float MIN_RELATIVE_IMPROVEMENT = 1e-5f; // Prevents restructuring because of floating point noise
+
+static float computeNodeCost(const SubBVHNode& node, float leftCost, float rightCost)
+{
+    // Unnormalized SAH cost of the subtree
+    if (node.triangleCount == 0)
+        return SAH_TRAVERSAL_COST * node.bounds.surfaceArea() + leftCost + rightCost;
+    else
+        return SAH_INTERSECTION_COST * node.triangleCount * node.bounds.surfaceArea();
+}
+
+static void optimizeTreelet(std::span<SubBVHNode> nodes, std::span<float> costs, uint32_t treeletRootID)
+{
+    // Grow the treelet by repeatedly turning the treelet leaf with the largest surface area into an inner node
+    std::array<uint32_t, MAX_TREELET_LEAVES> leaves;
+    std::array<uint32_t, MAX_TREELET_LEAVES - 1> childPairs; // Node slots that are reused for the new topology
+    int numLeaves = 2;
+    int numChildPairs = 1;
+    leaves[0] = nodes[treeletRootID].leftChildIndex;
+    leaves[1] = nodes[treeletRootID].leftChildIndex + 1;
+    childPairs[0] = nodes[treeletRootID].leftChildIndex;
+    while (numLeaves < MAX_TREELET_LEAVES) {
+        int bestLeaf = -1;
+        float bestSurfaceArea = 0.0f;
+        for (int i = 0; i < numLeaves; i++) {
+            const auto& node = nodes[leaves[i]];
+            if (node.triangleCount == 0 && (bestLeaf == -1 || node.bounds.surfaceArea() > bestSurfaceArea)) {
+                bestLeaf = i;
+                bestSurfaceArea = node.bounds.surfaceArea();
+            }
+        }
+        if (bestLeaf == -1)
+            break;
+
+        uint32_t leftChildIndex = nodes[leaves[bestLeaf]].leftChildIndex;
+        childPairs[numChildPairs++] = leftChildIndex;
+        leaves[bestLeaf] = leftChildIndex;
+        leaves[numLeaves++] = leftChildIndex + 1;
+    }
+    if (numLeaves < 3)
+        return; // Only one possible topology
+
+    // Dynamic programming over all subsets of the treelet leaves. Every subset is only split in partitions that are
+    // smaller (as integer) than the subset itself, so visiting them in increasing order is sufficient.
+    constexpr int maxSubsets = 1 << MAX_TREELET_LEAVES;
+    std::array<AABB, maxSubsets> subsetBounds;
+    std::array<float, maxSubsets> subsetCosts;
+    std::array<uint32_t, maxSubsets> subsetPartitions;
+    const uint32_t numSubsets = 1u << numLeaves;
+    for (uint32_t subset = 1; subset < numSubsets; subset++) {
+        if (std::has_single_bit(subset)) {
+            int leaf = std::countr_zero(subset);
+            subsetBounds[subset] = nodes[leaves[leaf]].bounds;
+            subsetCosts[subset] = costs[leaves[leaf]];
+            continue;
+        }
+
+        uint32_t lowestBit = subset & (~subset + 1);
+        subsetBounds[subset] = subsetBounds[lowestBit] + subsetBounds[subset ^ lowestBit];
+
+        // Only consider partitions that contain the lowest leaf (the other half is the same partition mirrored)
+        const uint32_t otherLeaves = subset ^ lowestBit;
+        float bestCost = std::numeric_limits<float>::max();
+        uint32_t bestPartition = 0;
+        for (uint32_t rest = (otherLeaves - 1) & otherLeaves;; rest = (rest - 1) & otherLeaves) {
+            uint32_t partition = rest | lowestBit;
+            float cost = subsetCosts[partition] + subsetCosts[subset ^ partition];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestPartition = partition;
+            }
+            if (rest == 0)
+                break;
+        }
+        subsetCosts[subset] = SAH_TRAVERSAL_COST * subsetBounds[subset].surfaceArea() + bestCost;
+        subsetPartitions[subset] = bestPartition;
+    }
+
+    const uint32_t allLeaves = numSubsets - 1;
+    if (subsetCosts[allLeaves] >= costs[treeletRootID] * (1.0f - MIN_RELATIVE_IMPROVEMENT))
+        return;
+
+    // Store the leaves before their slots get overwritten
+    std::array<SubBVHNode, MAX_TREELET_LEAVES> leafNodes;
+    std::array<float, MAX_TREELET_LEAVES> leafCosts;
+    for (int i = 0; i < numLeaves; i++) {
+        leafNodes[i] = nodes[leaves[i]];
+        leafCosts[i] = costs[leaves[i]];
+    }
+
+    int nextChildPair = 0;
+    std::function<void(uint32_t, uint32_t)> emitSubset = [&](uint32_t subset, uint32_t nodeID) {
+        if (std::has_single_bit(subset)) {
+            int leaf = std::countr_zero(subset);
+            nodes[nodeID] = leafNodes[leaf];
+            costs[nodeID] = leafCosts[leaf];
+            return;
+        }
+
+        uint32_t leftNodeID = childPairs[nextChildPair++];
+        auto& node = nodes[nodeID];
+        node.bounds = subsetBounds[subset];
+        node.leftChildIndex = leftNodeID;
+        node.triangleCount = 0; // Triangle count = 0 -> inner node
+        costs[nodeID] = subsetCosts[subset];
+
+        emitSubset(subsetPartitions[subset], leftNodeID);
+        emitSubset(subset ^ subsetPartitions[subset], leftNodeID + 1);
+    };
+    emitSubset(allLeaves, treeletRootID);
+}
+
+void optimizeBVH(std::span<SubBVHNode> nodes, uint32_t rootNodeID, int iterations, BvhBuildMode mode)
+{
+    std::vector<float> costs(nodes.size());
+    std::vector<uint32_t> subtreeLeafCounts(nodes.size());
+
+    // Compute the cost and the number of leaves of every subtree
+    std::function<void(uint32_t)> initSubtree = [&](uint32_t nodeID) {
+        const auto& node = nodes[nodeID];
+        if (node.triangleCount == 0) {
+            initSubtree(node.leftChildIndex);
+            initSubtree(node.leftChildIndex + 1);
+            costs[nodeID] = computeNodeCost(node, costs[node.leftChildIndex], costs[node.leftChildIndex + 1]);
+            subtreeLeafCounts[nodeID] = subtreeLeafCounts[node.leftChildIndex] + subtreeLeafCounts[node.leftChildIndex + 1];
+        } else {
+            costs[nodeID] = computeNodeCost(node, 0.0f, 0.0f);
+            subtreeLeafCounts[nodeID] = 1;
+        }
+    };
+    initSubtree(rootNodeID);
+
+    // Bottom-up: a treelet is optimized after all treelets below it. Restructuring only moves nodes within the subtree
+    // of the treelet root (and keeps the subtree sizes of the treelet leaves), so sibling subtrees can run in parallel.
+    uint32_t minTreeletRootLeaves = MIN_TREELET_ROOT_LEAVES;
+    std::function<void(uint32_t)> optimizeSubtree = [&](uint32_t nodeID) {
+        const auto& node = nodes[nodeID];
+        if (subtreeLeafCounts[nodeID] < minTreeletRootLeaves)
+            return;
+
+        uint32_t leftChildIndex = node.leftChildIndex;
+        if (mode == BvhBuildMode::Parallel && subtreeLeafCounts[nodeID] >= PARALLEL_OPTIMIZE_TASK_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&]() { optimizeSubtree(leftChildIndex); },
+                [&]() { optimizeSubtree(leftChildIndex + 1); });
+        } else {
+            optimizeSubtree(leftChildIndex);
+            optimizeSubtree(leftChildIndex + 1);
+        }
+
+        // The children may have been restructured
+        costs[nodeID] = computeNodeCost(nodes[nodeID], costs[leftChildIndex], costs[leftChildIndex + 1]);
+        optimizeTreelet(nodes, costs, nodeID);
+    };
+    // Later iterations only restructure the upper levels of the tree (where most of the cost is)
+    for (int i = 0; i < iterations; i++, minTreeletRootLeaves *= 2) {
+        optimizeSubtree(rootNodeID);
+        if (i + 1 < iterations)
+            initSubtree(rootNodeID); // Leaf counts changed
+    }
+}
+}
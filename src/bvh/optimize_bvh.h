@@ -0,0 +1,12 @@
+#pragma once
+#include "bvh_nodes.h"
+#include <span>
+
+namespace raytracer {
+
+// Treelet restructuring: replaces treelets (of up to 7 leaves) by the topology with the lowest SAH cost. Works on any
+// BVH (including refitted ones) without changing the number of nodes or the order of the triangles.
+// https://research.nvidia.com/sites/default/files/publications/karras2013hpg_paper.pdf
+void optimizeBVH(std::span<SubBVHNode> nodes, uint32_t rootNodeID, int iterations = 3, BvhBuildMode mode = BvhBuildMode::Parallel);
+
+}
@@ -0,0 +1,82 @@
+#include "quantized_bvh.h"
+#include <algorithm>
+#include <cmath>
+
+namespace raytracer {
+
+static constexpr int QUANTIZATION_STEPS = 255;
+static constexpr int MIN_EXPONENT = -126; // Keep 2^exponent a normal float
+
+// Must match the decoding in bvh.cl (q * 2^exponent is exact so fused multiply-add gives the same result)
+static float dequantize(float origin, int exponent, int quantized)
+{
+    return origin + static_cast<float>(quantized) * std::ldexp(1.0f, exponent);
+}
+
+static void setQuantizationFrame(QuantizedSubBVHNode& outNode, const AABB& bounds)
+{
+    for (int axis = 0; axis < 3; axis++) {
+        float origin = bounds.min[axis];
+        float extent = bounds.max[axis] - origin;
+
+        // Smallest power of 2 scale with which the quantized range covers the bounds
+        int exponent = MIN_EXPONENT;
+        if (extent > 0.0f)
+            exponent = std::max(MIN_EXPONENT, static_cast<int>(std::ceil(std::log2(extent / QUANTIZATION_STEPS))));
+        while (dequantize(origin, exponent, QUANTIZATION_STEPS) < bounds.max[axis])
+            exponent++;
+
+        outNode.origin[axis] = origin;
+        outNode.exponents[axis] = static_cast<int8_t>(exponent);
+    }
+}
+
+static void quantizeBounds(QuantizedSubBVHNode& outNode, const AABB& bounds, const QuantizedSubBVHNode& parent)
+{
+    for (int axis = 0; axis < 3; axis++) {
+        float origin = parent.origin[axis];
+        int exponent = parent.exponents[axis];
+        float scale = std::ldexp(1.0f, exponent);
+
+        // Round outwards and correct for rounding errors so the quantized bounds are conservative
+        int min = std::clamp(static_cast<int>(std::floor((bounds.min[axis] - origin) / scale)), 0, QUANTIZATION_STEPS);
+        int max = std::clamp(static_cast<int>(std::ceil((bounds.max[axis] - origin) / scale)), 0, QUANTIZATION_STEPS);
+        while (min > 0 && dequantize(origin, exponent, min) > bounds.min[axis])
+            min--;
+        while (max < QUANTIZATION_STEPS && dequantize(origin, exponent, max) < bounds.max[axis])
+            max++;
+
+        outNode.quantizedMin[axis] = static_cast<uint8_t>(min);
+        outNode.quantizedMax[axis] = static_cast<uint8_t>(max);
+    }
+}
+
+std::vector<QuantizedSubBVHNode> quantizeBVH(std::span<const SubBVHNode> nodes, uint32_t rootNodeID)
+{
+    std::vector<QuantizedSubBVHNode> outNodes(nodes.size());
+
+    // The bounds of the root are never tested (that is done by the top-level BVH)
+    outNodes[rootNodeID].quantizedMax[0] = outNodes[rootNodeID].quantizedMax[1] = outNodes[rootNodeID].quantizedMax[2] = QUANTIZATION_STEPS;
+
+    std::vector<uint32_t> stack = { rootNodeID };
+    while (!stack.empty()) {
+        uint32_t nodeID = stack.back();
+        stack.pop_back();
+
+        const auto& node = nodes[nodeID];
+        auto& outNode = outNodes[nodeID];
+        outNode.leftChildIndex = node.leftChildIndex;
+        outNode.triangleCount = node.triangleCount;
+        if (node.triangleCount != 0)
+            continue;
+
+        // Children are quantized relative to the (exact) bounds of the parent
+        setQuantizationFrame(outNode, node.bounds);
+        for (uint32_t childID : { node.leftChildIndex, node.leftChildIndex + 1 }) {
+            quantizeBounds(outNodes[childID], nodes[childID].bounds, outNode);
+            stack.push_back(childID);
+        }
+    }
+    return outNodes;
+}
+}
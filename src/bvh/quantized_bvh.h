@@ -0,0 +1,12 @@
+#pragma once
+#include "bvh_nodes.h"
+#include <span>
+#include <vector>
+
+namespace raytracer {
+
+// Converts the BVH to the quantized node format. Nodes keep their index; the quantized bounds are conservative (they
+// always contain the original bounds).
+std::vector<QuantizedSubBVHNode> quantizeBVH(std::span<const SubBVHNode> nodes, uint32_t rootNodeID);
+
+}
@@ -1,24 +1,152 @@
 #include "top_bvh_build.h"
+#include "bvh_morton.h"
 #include "scene.h"
 #include <algorithm>
 #include <array>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <numeric>
 #include <span>
 #include <stack>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 #include <vector>
 
 namespace raytracer {
 
-static uint32_t findBestMatch(std::span<const TopBVHNode> allNodes, std::span<uint32_t> indicesToConsider, uint32_t thisNodeID);
-static TopBVHNode createNode(const SceneNode& sceneNode, const glm::mat4& transform, std::span<const uint32_t> meshBvhOffsets);
+static constexpr uint32_t CLUSTER_SEARCH_RADIUS = 16;
+static constexpr uint32_t CLUSTER_SEARCH_GRAIN_SIZE = 1024;
+
+static constexpr float MAX_REFIT_COST_GROWTH = 1.3f; // Rebuild when refitting increased the SAH cost by more than 30%
+
+static void collectLeafs(const SceneNode& rootSceneNode, std::span<const uint32_t> meshBvhRoots, std::vector<TopBVHNode>& outBvhNodes, std::vector<TopBVHInstance>& outInstances, std::vector<const SceneNode*>& outSceneNodes);
+static uint32_t buildFromLeafs(std::vector<TopBVHNode>& bvhNodes);
+static float calcCombinedSurfaceArea(const AABB& a, const AABB& b);
+static TopBVHNode createNode(const SceneNode& sceneNode, const glm::mat4& transform, std::span<const uint32_t> meshBvhRoots, uint32_t instanceIndex);
+static TopBVHInstance createInstance(const glm::mat4& transform);
 static TopBVHNode mergeNodes(uint32_t aID, const TopBVHNode nodeA, uint32_t bID, const TopBVHNode nodeB);
 static AABB calcTransformedAABB(const AABB& bounds, glm::mat4 transform);
+static glm::mat4 calcWorldTransform(const SceneNode& sceneNode);
+
+void TopBVH::update(const Scene& scene, std::span<const uint32_t> meshBvhRoots)
+{
+    if (m_nodes.empty() || scene.hasStructureChanged()) {
+        rebuild(scene, meshBvhRoots);
+        return;
+    }
+
+    m_changedNodes.clear();
+
+    // Dynamic meshes may have moved inside the sub BVH buffer (or got a different root node)
+    if (!std::equal(meshBvhRoots.begin(), meshBvhRoots.end(), m_meshBvhRoots.begin(), m_meshBvhRoots.end())) {
+        for (uint32_t nodeID = 0; nodeID < m_leafSceneNodes.size(); nodeID++) {
+            const auto& sceneNode = *m_leafSceneNodes[nodeID];
+            uint32_t subBvhNode = meshBvhRoots[*sceneNode.meshID];
+            if (m_nodes[nodeID].subBvhNode != subBvhNode) {
+                m_nodes[nodeID].subBvhNode = subBvhNode;
+                m_nodeChanged[nodeID] = true;
+                m_changedNodes.push_back(nodeID);
+            }
+        }
+        m_meshBvhRoots.assign(meshBvhRoots.begin(), meshBvhRoots.end());
+    }
+
+    for (const SceneNode* sceneNode : scene.getChangedNodes())
+        updateLeafs(*sceneNode, calcWorldTransform(*sceneNode), meshBvhRoots);
+
+    // Mark the ancestors of the changed leafs (stopping at nodes that were already marked through another leaf)
+    size_t numChangedLeafs = m_changedNodes.size();
+    for (size_t i = 0; i < numChangedLeafs; i++) {
+        for (uint32_t nodeID = m_parents[m_changedNodes[i]]; nodeID != m_rootNode && !m_nodeChanged[nodeID]; nodeID = m_parents[nodeID]) {
+            m_nodeChanged[nodeID] = true;
+            m_changedNodes.push_back(nodeID);
+        }
+    }
+    if (m_changedNodes.empty())
+        return;
+    if (!m_nodeChanged[m_rootNode])
+        m_changedNodes.push_back(m_rootNode);
+
+    // Inner nodes are always created after their children, so refitting in order of node ID is bottom-up
+    std::sort(m_changedNodes.begin(), m_changedNodes.end());
+    for (uint32_t nodeID : m_changedNodes) {
+        m_nodeChanged[nodeID] = false;
+
+        auto& node = m_nodes[nodeID];
+        if (node.isLeaf)
+            continue;
+
+        m_innerSurfaceAreaSum -= node.bounds.surfaceArea();
+        node.bounds = m_nodes[node.leftChildIndex].bounds + m_nodes[node.rightChildIndex].bounds;
+        m_innerSurfaceAreaSum += node.bounds.surfaceArea();
+    }
+
+    if (calcRelativeCost() > m_rebuildCost * MAX_REFIT_COST_GROWTH)
+        rebuild(scene, meshBvhRoots);
+}
+
+void TopBVH::rebuild(const Scene& scene, std::span<const uint32_t> meshBvhRoots)
+{
+    m_nodes.clear();
+    m_instances.clear();
+    m_leafSceneNodes.clear();
+    collectLeafs(scene.getRootNode(), meshBvhRoots, m_nodes, m_instances, m_leafSceneNodes);
+    m_rootNode = buildFromLeafs(m_nodes);
+
+    m_sceneNodeLeafs.clear();
+    for (uint32_t nodeID = 0; nodeID < m_leafSceneNodes.size(); nodeID++)
+        m_sceneNodeLeafs[m_leafSceneNodes[nodeID]] = nodeID;
+
+    m_parents.resize(m_nodes.size());
+    m_innerSurfaceAreaSum = 0.0f;
+    for (uint32_t nodeID = 0; nodeID < m_nodes.size(); nodeID++) {
+        const auto& node = m_nodes[nodeID];
+        if (node.isLeaf)
+            continue;
+
+        m_parents[node.leftChildIndex] = nodeID;
+        m_parents[node.rightChildIndex] = nodeID;
+        m_innerSurfaceAreaSum += node.bounds.surfaceArea();
+    }
+    if (!m_nodes.empty())
+        m_parents[m_rootNode] = m_rootNode;
+    m_rebuildCost = calcRelativeCost();
+
+    m_meshBvhRoots.assign(meshBvhRoots.begin(), meshBvhRoots.end());
+    m_nodeChanged.assign(m_nodes.size(), false);
+    m_changedNodes.resize(m_nodes.size());
+    std::iota(m_changedNodes.begin(), m_changedNodes.end(), 0);
+}
+
+void TopBVH::updateLeafs(const SceneNode& sceneNode, const glm::mat4& transform, std::span<const uint32_t> meshBvhRoots)
+{
+    if (sceneNode.meshID) {
+        uint32_t nodeID = m_sceneNodeLeafs[&sceneNode];
+        m_nodes[nodeID] = createNode(sceneNode, transform, meshBvhRoots, nodeID);
+        m_instances[nodeID] = createInstance(transform);
+        if (!m_nodeChanged[nodeID]) {
+            m_nodeChanged[nodeID] = true;
+            m_changedNodes.push_back(nodeID);
+        }
+    }
 
-BvhBuildReturnType buildTopBVH(const SceneNode& rootSceneNode, std::span<const uint32_t> meshBvhOffsets)
+    for (const auto& child : sceneNode.children)
+        updateLeafs(*child, transform * child->transform.matrix(), meshBvhRoots);
+}
+
+float TopBVH::calcRelativeCost() const
 {
-    std::vector<TopBVHNode> outBvhNodes;
+    // Normalized by the root surface area so that scaling the whole scene does not trigger a rebuild
+    if (m_nodes.empty())
+        return 0.0f;
+    float rootSurfaceArea = m_nodes[m_rootNode].bounds.surfaceArea();
+    return rootSurfaceArea > 0.0f ? m_innerSurfaceAreaSum / rootSurfaceArea : 0.0f;
+}
 
+static void collectLeafs(const SceneNode& rootSceneNode, std::span<const uint32_t> meshBvhRoots, std::vector<TopBVHNode>& outBvhNodes, std::vector<TopBVHInstance>& outInstances, std::vector<const SceneNode*>& outSceneNodes)
+{
     // Add the scene graph nodes to the top-level BVH buffer
-    std::vector<uint32_t> list;
     std::stack<std::pair<const SceneNode&, glm::mat4>> nodeStack;
     nodeStack.push(std::make_pair(std::ref(rootSceneNode), glm::mat4(1.0f)));
     while (!nodeStack.empty()) {
@@ -31,85 +159,132 @@ BvhBuildReturnType buildTopBVH(const SceneNode& rootSceneNode, std::span<const u
 
         // Skip internal nodes (no mesh attached) of the scene graph
         if (sceneNode.meshID) {
-            uint32_t nodeId = (uint32_t)outBvhNodes.size();
-            outBvhNodes.push_back(createNode(sceneNode, transformMatrix, meshBvhOffsets));
-            list.push_back(nodeId);
+            // The leafs are the first nodes so a leaf has the same index as its instance
+            outBvhNodes.push_back(createNode(sceneNode, transformMatrix, meshBvhRoots, (uint32_t)outInstances.size()));
+            outInstances.push_back(createInstance(transformMatrix));
+            outSceneNodes.push_back(&sceneNode);
         }
     }
+}
+
+static uint32_t buildFromLeafs(std::vector<TopBVHNode>& outBvhNodes)
+{
+    if (outBvhNodes.empty())
+        return 0;
+
+    // Sort the instances along the Morton curve through the centers of their bounds
+    AABB centerBounds;
+    for (const auto& node : outBvhNodes)
+        centerBounds.fit(node.bounds.center());
+
+    std::vector<MortonPrimitive> mortonPrimitives;
+    for (uint32_t nodeID = 0; nodeID < outBvhNodes.size(); nodeID++)
+        mortonPrimitives.push_back({ computeMortonCode(outBvhNodes[nodeID].bounds.center(), centerBounds), nodeID });
+    radixSort(mortonPrimitives);
+
+    std::vector<uint32_t> clusters;
+    for (const auto& mortonPrimitive : mortonPrimitives)
+        clusters.push_back(mortonPrimitive.primitiveIndex);
+
+    // Parallel Locally-Ordered Clustering: merge every cluster that is the nearest neighbour of its own nearest neighbour.
+    // Only clusters close by on the Morton curve are considered, making this O(n log n) instead of O(n^2) for the exact
+    // agglomerative clustering. For scenes with few instances all clusters are in range.
+    // https://meistdan.github.io/publications/ploc/paper.pdf
+    outBvhNodes.reserve(2 * outBvhNodes.size());
+    std::vector<AABB> clusterBounds;
+    std::vector<uint32_t> nearestNeighbours, nextClusters;
+    while (clusters.size() > 1) {
+        const uint32_t numClusters = static_cast<uint32_t>(clusters.size());
 
-    // Slide 50: http://www.cs.uu.nl/docs/vakken/magr/2016-2017/slides/lecture%2004%20-%20real-time%20ray%20tracing.pdf
-    // Fast Agglomerative Clustering for Rendering (Walter et al, 2008)
-    uint32_t nodeA = list.back(); // list.pop_back();
-    uint32_t nodeB = findBestMatch(outBvhNodes, list, nodeA);
-    while (list.size() > 1) {
-        uint32_t nodeC = findBestMatch(outBvhNodes, list, nodeB);
-        if (nodeA == nodeC) {
-            // http://stackoverflow.com/questions/39912/how-do-i-remove-an-item-from-a-stl-vector-with-a-certain-value
-            auto newEndA = std::remove(list.begin(), list.end(), nodeA);
-            list.erase(newEndA);
-            auto newEndB = std::remove(list.begin(), list.end(), nodeB);
-            list.erase(newEndB);
-
-            // A = new Node(A, B);
-            uint32_t nodeId = (uint32_t)outBvhNodes.size();
-            outBvhNodes.push_back(mergeNodes(nodeA, outBvhNodes[nodeA], nodeB, outBvhNodes[nodeB]));
-            nodeA = nodeId;
-
-            list.push_back(nodeA);
-            nodeB = findBestMatch(outBvhNodes, list, nodeA);
-        } else {
-            nodeA = nodeB;
-            nodeB = nodeC;
+        clusterBounds.resize(numClusters);
+        for (uint32_t i = 0; i < numClusters; i++)
+            clusterBounds[i] = outBvhNodes[clusters[i]].bounds;
+
+        // Ties are broken by index such that the globally closest pair is always mutual, guaranteeing progress
+        nearestNeighbours.resize(numClusters);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0, numClusters, CLUSTER_SEARCH_GRAIN_SIZE), [&](const tbb::blocked_range<uint32_t>& range) {
+            for (uint32_t i = range.begin(); i != range.end(); i++) {
+                uint32_t begin = i > CLUSTER_SEARCH_RADIUS ? i - CLUSTER_SEARCH_RADIUS : 0;
+                uint32_t end = std::min(i + CLUSTER_SEARCH_RADIUS + 1, numClusters);
+
+                // Start from the first candidate so that every cluster has a neighbour, even if no area is finite (empty or
+                // overflowing bounds). Those areas compare as the largest finite area so that the order stays strict.
+                uint32_t bestNeighbour = begin == i ? i + 1 : begin;
+                float bestSurfaceArea = calcCombinedSurfaceArea(clusterBounds[i], clusterBounds[bestNeighbour]);
+                if (!std::isfinite(bestSurfaceArea))
+                    bestSurfaceArea = std::numeric_limits<float>::max();
+                for (uint32_t j = bestNeighbour + 1; j < end; j++) {
+                    if (j == i)
+                        continue;
+
+                    float surfaceArea = calcCombinedSurfaceArea(clusterBounds[i], clusterBounds[j]);
+                    if (!std::isfinite(surfaceArea))
+                        surfaceArea = std::numeric_limits<float>::max();
+                    if (surfaceArea < bestSurfaceArea) {
+                        bestSurfaceArea = surfaceArea;
+                        bestNeighbour = j;
+                    }
+                }
+                nearestNeighbours[i] = bestNeighbour;
+            }
+        });
+
+        // The merged node takes the place of the cluster with the lowest index (keeping the clusters in Morton order)
+        nextClusters.clear();
+        for (uint32_t i = 0; i < numClusters; i++) {
+            uint32_t neighbour = nearestNeighbours[i];
+            if (nearestNeighbours[neighbour] != i) {
+                nextClusters.push_back(clusters[i]);
+            } else if (i < neighbour) {
+                uint32_t nodeID = (uint32_t)outBvhNodes.size();
+                outBvhNodes.push_back(mergeNodes(clusters[i], outBvhNodes[clusters[i]], clusters[neighbour], outBvhNodes[clusters[neighbour]]));
+                nextClusters.push_back(nodeID);
+            }
         }
+        assert(nextClusters.size() < clusters.size());
+        std::swap(clusters, nextClusters);
     }
 
-    uint32_t rootNode = (uint32_t)outBvhNodes.size() - 1;
-    return { rootNode, outBvhNodes }; // Root node is at the end
+    return (uint32_t)outBvhNodes.size() - 1;
 }
 
-static float calcCombinedSurfaceArea(const TopBVHNode& a, const TopBVHNode& b)
+static float calcCombinedSurfaceArea(const AABB& a, const AABB& b)
 {
-    AABB bounds = a.bounds + b.bounds;
-    glm::vec3 extents = bounds.max - bounds.min;
+    glm::vec3 extents = glm::max(glm::vec3(a.max), glm::vec3(b.max)) - glm::min(glm::vec3(a.min), glm::vec3(b.min));
     float leftArea = extents.z * extents.y;
     float topArea = extents.x * extents.y;
     float backArea = extents.x * extents.z;
     return 2.0f * (leftArea + topArea + backArea);
 }
 
-static uint32_t findBestMatch(std::span<const TopBVHNode> allNodes, std::span<uint32_t> indicesToConsider, uint32_t thisNodeID)
-{
-    auto iter = std::min_element(indicesToConsider.begin(), indicesToConsider.end(), [&](uint32_t a, uint32_t b) -> bool {
-        if (a == thisNodeID)
-            return false;
-        if (b == thisNodeID)
-            return true;
-
-        float surfaceAreaA = calcCombinedSurfaceArea(allNodes[thisNodeID], allNodes[a]);
-        float surfaceAreaB = calcCombinedSurfaceArea(allNodes[thisNodeID], allNodes[b]);
-        return surfaceAreaA < surfaceAreaB;
-    });
-    return *iter;
-}
-
-static TopBVHNode createNode(const SceneNode& sceneNode, const glm::mat4& transform, std::span<const uint32_t> meshBvhOffsets)
+static TopBVHNode createNode(const SceneNode& sceneNode, const glm::mat4& transform, std::span<const uint32_t> meshBvhRoots, uint32_t instanceIndex)
 {
-    assert(sceneNode.subBvhRootID);
     assert(sceneNode.meshID);
 
     TopBVHNode node;
-    node.subBvhNode = *sceneNode.subBvhRootID + meshBvhOffsets[*sceneNode.meshID];
+    node.subBvhNode = meshBvhRoots[*sceneNode.meshID];
     node.bounds = calcTransformedAABB(sceneNode.bounds, transform);
-    node.invTransform = glm::inverse(transform);
+    node.instanceIndex = instanceIndex;
     node.isLeaf = true;
     return node;
 }
 
+static TopBVHInstance createInstance(const glm::mat4& transform)
+{
+    // The last row of an affine transform is always (0, 0, 0, 1)
+    glm::mat4 invTransformRows = glm::transpose(glm::inverse(transform));
+
+    TopBVHInstance instance;
+    instance.invTransformRows[0] = invTransformRows[0];
+    instance.invTransformRows[1] = invTransformRows[1];
+    instance.invTransformRows[2] = invTransformRows[2];
+    return instance;
+}
+
 static TopBVHNode mergeNodes(uint32_t nodeAIndex, const TopBVHNode nodeA, uint32_t nodeBIndex, const TopBVHNode nodeB)
 {
     TopBVHNode node;
     node.bounds = nodeA.bounds + nodeB.bounds;
-    node.invTransform = glm::mat4(1.0f); // Identity
     node.leftChildIndex = nodeAIndex;
     node.rightChildIndex = nodeBIndex;
     node.isLeaf = false;
@@ -137,4 +312,12 @@ static AABB calcTransformedAABB(const AABB& bounds, glm::mat4 transform)
     return result;
 }
 
+static glm::mat4 calcWorldTransform(const SceneNode& sceneNode)
+{
+    glm::mat4 transform = sceneNode.transform.matrix();
+    for (const SceneNode* parent = sceneNode.parent; parent; parent = parent->parent)
+        transform = parent->transform.matrix() * transform;
+    return transform;
+}
+
 }
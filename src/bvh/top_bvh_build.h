@@ -1,14 +1,45 @@
 #pragma once
 #include "bvh_nodes.h"
 #include <span>
-#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 namespace raytracer {
 
+class Scene;
 struct SceneNode;
 
-using BvhBuildReturnType = std::pair<uint32_t, std::vector<TopBVHNode>>;
-BvhBuildReturnType buildTopBVH(const SceneNode& rootSceneNode, std::span<const uint32_t> meshBvhOffsets);
+// Top-level BVH that is kept between frames. Instances that moved (see Scene::setTransform) are refitted by updating the
+// bounds of their ancestors. The BVH is only rebuilt when the scene graph changed or when refitting made the tree too
+// expensive (SAH cost grew by more than a fixed factor since the last rebuild).
+class TopBVH {
+public:
+    void update(const Scene& scene, std::span<const uint32_t> meshBvhRoots);
+
+    uint32_t getRootNode() const { return m_rootNode; }
+    std::span<const TopBVHNode> getNodes() const { return m_nodes; }
+    std::span<const TopBVHInstance> getInstances() const { return m_instances; } // Instance i belongs to leaf node i
+    std::span<const uint32_t> getChangedNodes() const { return m_changedNodes; } // Sorted, all nodes after a rebuild
+
+private:
+    void rebuild(const Scene& scene, std::span<const uint32_t> meshBvhRoots);
+    void updateLeafs(const SceneNode& sceneNode, const glm::mat4& transform, std::span<const uint32_t> meshBvhRoots);
+    float calcRelativeCost() const;
+
+private:
+    uint32_t m_rootNode { 0 };
+    std::vector<TopBVHNode> m_nodes;
+    std::vector<TopBVHInstance> m_instances;
+    std::vector<uint32_t> m_parents;
+    std::vector<const SceneNode*> m_leafSceneNodes;
+    std::unordered_map<const SceneNode*, uint32_t> m_sceneNodeLeafs;
+    std::vector<uint32_t> m_meshBvhRoots;
+
+    std::vector<uint32_t> m_changedNodes;
+    std::vector<bool> m_nodeChanged;
+
+    float m_innerSurfaceAreaSum { 0.0f }; // Unnormalized SAH cost (excluding the leafs)
+    float m_rebuildCost { 0.0f }; // Relative cost directly after the last rebuild
+};
 
 }
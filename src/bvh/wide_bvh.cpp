@@ -0,0 +1,77 @@
+#include "wide_bvh.h"
+#include <algorithm>
+#include <array>
+
+namespace raytracer {
+
+static uint32_t collapseNode(std::span<const SubBVHNode> nodes, uint32_t nodeID, std::vector<WideSubBVHNode>& outNodes)
+{
+    uint32_t wideNodeID = static_cast<uint32_t>(outNodes.size());
+    outNodes.emplace_back();
+
+    std::array<uint32_t, WIDE_BVH_WIDTH> children;
+    uint32_t childCount = 0;
+    if (nodes[nodeID].triangleCount != 0) {
+        children[childCount++] = nodeID; // Only happens at the root
+    } else {
+        children[childCount++] = nodes[nodeID].leftChildIndex;
+        children[childCount++] = nodes[nodeID].leftChildIndex + 1;
+    }
+
+    // Replace the inner child with the largest surface area (the one most likely to be hit) by its children
+    while (childCount < WIDE_BVH_WIDTH) {
+        auto bestChild = std::max_element(children.begin(), children.begin() + childCount, [&](uint32_t a, uint32_t b) {
+            bool aIsInner = nodes[a].triangleCount == 0;
+            bool bIsInner = nodes[b].triangleCount == 0;
+            if (aIsInner != bIsInner)
+                return bIsInner;
+            return nodes[a].bounds.surfaceArea() < nodes[b].bounds.surfaceArea();
+        });
+        if (nodes[*bestChild].triangleCount != 0)
+            break; // Only leaves left
+
+        uint32_t leftChildIndex = nodes[*bestChild].leftChildIndex;
+        *bestChild = leftChildIndex;
+        children[childCount++] = leftChildIndex + 1;
+    }
+
+    std::array<uint32_t, WIDE_BVH_WIDTH> wideChildren = {};
+    for (uint32_t i = 0; i < childCount; i++) {
+        const auto& child = nodes[children[i]];
+        if (child.triangleCount == 0)
+            wideChildren[i] = collapseNode(nodes, children[i], outNodes);
+        else
+            wideChildren[i] = child.firstTriangleIndex;
+    }
+
+    // Recursion may have reallocated the array
+    auto& wideNode = outNodes[wideNodeID];
+    for (uint32_t i = 0; i < childCount; i++) {
+        const auto& child = nodes[children[i]];
+        wideNode.minX[i] = child.bounds.min.x;
+        wideNode.maxX[i] = child.bounds.max.x;
+        wideNode.minY[i] = child.bounds.min.y;
+        wideNode.maxY[i] = child.bounds.max.y;
+        wideNode.minZ[i] = child.bounds.min.z;
+        wideNode.maxZ[i] = child.bounds.max.z;
+        wideNode.children[i] = wideChildren[i];
+        wideNode.triangleCounts[i] = child.triangleCount;
+    }
+    wideNode.childCount = childCount;
+    return wideNodeID;
+}
+
+std::vector<WideSubBVHNode> collapseToWideBVH(std::span<const SubBVHNode> nodes, uint32_t rootNodeID)
+{
+    std::vector<WideSubBVHNode> outNodes;
+    outNodes.reserve(maxNumWideBvhNodes(static_cast<uint32_t>(nodes.size())));
+    collapseNode(nodes, rootNodeID, outNodes);
+    return outNodes;
+}
+
+uint32_t maxNumWideBvhNodes(uint32_t numBinaryNodes)
+{
+    // Every wide node replaces at least one binary inner node (or the root leaf), of which there are at most half
+    return numBinaryNodes / 2 + 1;
+}
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "bvh_nodes.h"
+#include <span>
+#include <vector>
+
+namespace raytracer {
+
+// Collapses a binary BVH into a BVH with up to WIDE_BVH_WIDTH children per node by repeatedly pulling up the children
+// of the child with the largest surface area. The root of the wide BVH is the first node (even if the binary root is a leaf).
+std::vector<WideSubBVHNode> collapseToWideBVH(std::span<const SubBVHNode> nodes, uint32_t rootNodeID);
+
+// Number of wide nodes that collapseToWideBVH produces at most for a binary BVH of the given size
+uint32_t maxNumWideBvhNodes(uint32_t numBinaryNodes);
+
+}
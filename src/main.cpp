@@ -4,6 +4,7 @@
 #include "imgui/imgui.h"
 #include "imgui/imgui_impl_glfw.h"
 #include "imgui/imgui_impl_opengl3.h"
+#include "opencl/compaction_benchmark.h"
 #include "opencl/texture.h"
 #include "raytracer.h"
 #include "scene.h"
@@ -11,6 +12,7 @@
 #include "transform.h"
 #include "ui/gloutput.h"
 #include "ui/window.h"
+#include <cmath>
 #include <glm/glm.hpp>
 #include <string_view>
 #include <filesystem>
@@ -25,7 +27,7 @@ static const uint32_t screenHeight = 720;
 static const double cameraViewSpeed = 0.05;
 static const double cameraMoveSpeed = 1.0;
 
-void createScene(Scene& scene, UniqueTextureArray& textureArray);
+SceneNode& createScene(Scene& scene, UniqueTextureArray& textureArray); // Returns the node of the bunny
 void createSkydome(const std::filesystem::path& filePath, bool isLinear, float brightnessMultiplier, UniqueTextureArray& textureArray);
 
 void cameraLookHandler(Camera& camera, glm::dvec2 mousePosition, bool ignoreMovement);
@@ -37,6 +39,19 @@ int main(int argc, char* argv[])
     auto scene = std::make_shared<Scene>();
     UniqueTextureArray materialTextures;
     createScene(*scene, materialTextures);
+    testTopBvhRefit(*scene);
+
+    // Compare the quality and build times of the different BVH builders and the memory locality of the node layouts
+    for (auto filePath : { "assets/3dmodels/sponza-crytek/sponza.obj", "assets/3dmodels/stanford/bunny/bun_zipper.ply" }) {
+        auto mesh = std::make_shared<Mesh>(basePath / filePath, materialTextures);
+        BvhTester tester(mesh);
+        tester.compareBuilders();
+        tester.compareNodeLayouts();
+    }
+
+    system("PAUSE");
+#elif 0 // Benchmark ray queue appends only
+    benchmarkQueueCompaction();
 
     system("PAUSE");
 #else
@@ -50,7 +65,10 @@ int main(int argc, char* argv[])
 
     auto scene = std::make_shared<Scene>();
     UniqueTextureArray materialTextures;
-    createScene(*scene, materialTextures);
+    SceneNode& bunnyNode = createScene(*scene, materialTextures);
+    const Transform bunnyTransform = bunnyNode.transform;
+    bool animateBunny = false;
+    double animationTime = 0.0;
     UniqueTextureArray skydomeTextures;
     createSkydome(basePath  / "assets/skydome/DF360_005_Ref.hdr", true, 75.0f, skydomeTextures);
 
@@ -96,6 +114,17 @@ int main(int argc, char* argv[])
 
         ImGui::Separator();
 
+        bool persistentThreads = rayTracer.getPersistentThreads();
+        if (ImGui::Checkbox("Persistent threads traversal", &persistentThreads))
+            rayTracer.setPersistentThreads(persistentThreads);
+        bool raySorting = rayTracer.getRaySorting();
+        if (ImGui::Checkbox("Sort rays", &raySorting))
+            rayTracer.setRaySorting(raySorting);
+        bool materialSortedShading = rayTracer.getMaterialSortedShading();
+        if (ImGui::Checkbox("Material sorted shading", &materialSortedShading))
+            rayTracer.setMaterialSortedShading(materialSortedShading);
+        ImGui::Checkbox("Animate bunny", &animateBunny);
+
         ImGui::Text("%d / %d samples per pixel", rayTracer.getSamplesPerPixel(), rayTracer.getMaxSamplesPerPixel());
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
@@ -111,6 +140,16 @@ int main(int argc, char* argv[])
         window.processInput();
         cameraMoveHandler(camera, window, dt);
 
+        if (animateBunny) {
+            // Moves the bunny instance through the top-level BVH refit
+            animationTime += dt;
+            Transform transform = bunnyTransform;
+            transform.location.y += 0.1f * (float)std::sin(animationTime);
+            transform.orientation = glm::quat(glm::vec3(0.0f, (float)animationTime, 0.0f)) * transform.orientation;
+            scene->setTransform(bunnyNode, transform);
+            rayTracer.frameTick();
+        }
+
         rayTracer.rayTrace(camera);
         output.render();
 
@@ -120,7 +159,7 @@ int main(int argc, char* argv[])
 #endif
 }
 
-void createScene(Scene& scene, UniqueTextureArray& textureArray)
+SceneNode& createScene(Scene& scene, UniqueTextureArray& textureArray)
 {
     // Light plane
     {
@@ -152,7 +191,7 @@ void createScene(Scene& scene, UniqueTextureArray& textureArray)
             textureArray);
         BvhTester bvhTest(bunny);
         bvhTest.test();
-        scene.addNode(bunny, transform);
+        return scene.addNode(bunny, transform);
     }
 }
 
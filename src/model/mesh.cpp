@@ -1,5 +1,6 @@
 #include "mesh.h"
 #include "bvh/bvh_build.h"
+#include "bvh/bvh_layout.h"
 #include "mesh_helpers.h"
 #include "timer.h"
 #include <assimp/Importer.hpp>
@@ -196,6 +197,9 @@ void Mesh::loadFromFile(
         storeBvh(bvhFileName.c_str());
     }
 
+    // Also applied to loaded BVHs because older BVH files were stored in the order of the builder
+    m_bvhRootNode = reorderBVHNodes(m_bvhNodes, m_bvhRootNode, BvhNodeLayout::DepthFirst);
+
     collectEmissiveTriangles();
 }
 
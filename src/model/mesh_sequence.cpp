@@ -12,26 +12,26 @@
 
 namespace raytracer {
 
-MeshSequence::MeshSequence(std::string_view fileName, bool refitting, UniqueTextureArray& textureArray)
-    : m_refitting(refitting)
+MeshSequence::MeshSequence(std::string_view fileName, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray)
+    : m_rebuildStrategy(rebuildStrategy)
 {
     loadFile(fileName, {}, textureArray);
 }
 
-MeshSequence::MeshSequence(std::string_view fileName, const Transform& transform, bool refitting, UniqueTextureArray& textureArray)
-    : m_refitting(refitting)
+MeshSequence::MeshSequence(std::string_view fileName, const Transform& transform, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray)
+    : m_rebuildStrategy(rebuildStrategy)
 {
     loadFile(fileName, transform, textureArray);
 }
 
-MeshSequence::MeshSequence(std::span<std::string_view> files, bool refitting, UniqueTextureArray& textureArray)
-    : m_refitting(refitting)
+MeshSequence::MeshSequence(std::span<std::string_view> files, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray)
+    : m_rebuildStrategy(rebuildStrategy)
 {
     loadFiles(files, {}, textureArray);
 }
 
-MeshSequence::MeshSequence(std::span<std::string_view> files, const Transform& transform, bool refitting, UniqueTextureArray& textureArray)
-    : m_refitting(refitting)
+MeshSequence::MeshSequence(std::span<std::string_view> files, const Transform& transform, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray)
+    : m_rebuildStrategy(rebuildStrategy)
 {
     loadFiles(files, transform, textureArray);
 }
@@ -71,9 +71,10 @@ uint32_t MeshSequence::maxNumMaterials() const
 
 uint32_t MeshSequence::maxNumBvhNodes() const
 {
+    // A binary BVH (with the root allocated as a pair) never has more than twice as many nodes as triangles
     uint32_t max = 0;
     for (auto& frame : m_frames) {
-        max = std::max(max, (uint32_t)frame.triangles.size());
+        max = std::max(max, 2 * (uint32_t)frame.triangles.size());
     }
     return max;
 }
@@ -85,14 +86,14 @@ void MeshSequence::buildBvh()
     m_bvhNeedsUpdate = false;
 
     MeshFrame& frame = m_frames[m_currentFrame];
-    if (m_refitting) {
+    if (m_rebuildStrategy == BvhRebuildStrategy::Refit) {
         refitBVH(m_bvhNodes, m_bvhRootNode, frame.vertices, frame.triangles);
-    } else {
-        // Clear bvh nodes list
-        m_bvhNodes.clear();
-
+    } else if (m_rebuildStrategy == BvhRebuildStrategy::BinnedSAH) {
         // Create a new bvh using the fast binned builder
         std::tie(m_bvhRootNode, frame.triangles, m_bvhNodes) = buildBinnedFastBVH(frame.vertices, frame.triangles);
+    } else {
+        // Create a new bvh using the linear builder
+        std::tie(m_bvhRootNode, frame.triangles, m_bvhNodes) = buildLinearBVH(frame.vertices, frame.triangles);
     }
 }
 
@@ -221,7 +222,7 @@ void MeshSequence::loadFiles(std::span<std::string_view> files, const Transform&
         loadFile(fileName, offset, textureArray);
     }
 
-    if (m_refitting) {
+    if (m_rebuildStrategy == BvhRebuildStrategy::Refit) {
         auto& f0 = m_frames[0];
         //SbvhBuilder builder;
         //m_bvhRootNode = builder.build(f0.vertices, f0.triangles, m_bvhNodes);
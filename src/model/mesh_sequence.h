@@ -13,12 +13,18 @@ struct aiMesh;
 struct aiScene;
 
 namespace raytracer {
+enum class BvhRebuildStrategy {
+    Refit, // Build a spatial split BVH for the first frame and refit it for the other frames
+    BinnedSAH, // Rebuild with the fast binned SAH builder every frame
+    Linear // Rebuild with the linear (Morton code) builder every frame
+};
+
 class MeshSequence : public IMesh {
 public:
-    MeshSequence(std::string_view fileName, bool refitting, UniqueTextureArray& textureArray);
-    MeshSequence(std::string_view fileName, const Transform& transform, bool refitting, UniqueTextureArray& textureArray);
-    MeshSequence(std::span<std::string_view> files, bool refitting, UniqueTextureArray& textureArray);
-    MeshSequence(std::span<std::string_view> files, const Transform& transform, bool refitting, UniqueTextureArray& textureArray);
+    MeshSequence(std::string_view fileName, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray);
+    MeshSequence(std::string_view fileName, const Transform& transform, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray);
+    MeshSequence(std::span<std::string_view> files, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray);
+    MeshSequence(std::span<std::string_view> files, const Transform& transform, BvhRebuildStrategy rebuildStrategy, UniqueTextureArray& textureArray);
     ~MeshSequence() = default;
 
     void goToNextFrame();
@@ -61,7 +67,7 @@ private:
 
     bool m_bvhNeedsUpdate = false;
 
-    bool m_refitting;
+    BvhRebuildStrategy m_rebuildStrategy;
     std::vector<SubBVHNode> m_bvhNodes;
     uint32_t m_bvhRootNode;
 
@@ -18,6 +18,21 @@ void timeOpenCL(cl::Event& ev, std::string_view operationName)
 #endif
 }
 
+void timeOpenCL(std::span<cl::Event> events, std::string_view operationName)
+{
+#ifdef PROFILE_OPENCL
+    double totalTime = 0.0;
+    for (auto& ev : events) {
+        ev.wait();
+        cl_ulong startTime, stopTime;
+        ev.getProfilingInfo(CL_PROFILING_COMMAND_START, &startTime);
+        ev.getProfilingInfo(CL_PROFILING_COMMAND_END, &stopTime);
+        totalTime += stopTime - startTime;
+    }
+    std::cout << "Timing (" << operationName << "): " << (totalTime / 1000000.0) << "ms" << std::endl;
+#endif
+}
+
 void __checkClErr(cl_int errorCode, std::string_view file, int line, std::string_view message)
 {
     if (errorCode != CL_SUCCESS) {
@@ -1,5 +1,6 @@
 #include "opencl/cl_gl_includes.h"
 #include <glm/glm.hpp>
+#include <span>
 #include <string_view>
 
 #define CL_VEC3(NAME)                  \
@@ -16,6 +17,7 @@
 
 cl_float3 glmToCl(glm::vec3 vec);
 void timeOpenCL(cl::Event& ev, std::string_view operationName);
+void timeOpenCL(std::span<cl::Event> events, std::string_view operationName); // Total time of all events
 
 // http://developer.amd.com/tools-and-sdks/opencl-zone/opencl-resources/introductory-tutorial-to-opencl/
 void __checkClErr(cl_int errorCode, std::string_view file, int line, std::string_view message);
@@ -0,0 +1,137 @@
+#include "compaction_benchmark.h"
+#include "opencl/cl_gl_includes.h"
+#include "opencl/cl_helpers.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+static const std::filesystem::path basePath = BASE_PATH;
+
+static constexpr uint32_t NUM_THREADS = 1280 * 720; // Same as the number of rays per pass
+static constexpr uint32_t WORK_GROUP_SIZE = 64;
+static constexpr int NUM_REPETITIONS = 20;
+
+static cl::Kernel loadBenchmarkKernel(const cl::Context& context, const cl::Device& device, bool workGroupCompaction);
+static std::vector<uint32_t> expectedQueue(uint32_t activeThreshold);
+
+void benchmarkQueueCompaction()
+{
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    for (auto& platform : platforms) {
+        std::vector<cl::Device> devices;
+        platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+        for (auto& device : devices) {
+            std::string deviceName;
+            device.getInfo(CL_DEVICE_NAME, &deviceName);
+            std::cout << "Device: " << deviceName << std::endl;
+
+            cl_int err;
+            cl::Context context(std::vector<cl::Device> { device }, nullptr, nullptr, nullptr, &err);
+            checkClErr(err, "cl::Context");
+            cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+            checkClErr(err, "cl::CommandQueue");
+            cl::Buffer counterBuffer(context, CL_MEM_READ_WRITE, sizeof(uint32_t), nullptr, &err);
+            checkClErr(err, "cl::Buffer");
+            cl::Buffer queueBuffer(context, CL_MEM_READ_WRITE, NUM_THREADS * sizeof(uint32_t), nullptr, &err);
+            checkClErr(err, "cl::Buffer");
+
+            for (bool workGroupCompaction : { false, true }) {
+                cl::Kernel kernel = loadBenchmarkKernel(context, device, workGroupCompaction);
+                kernel.setArg(0, counterBuffer);
+                kernel.setArg(1, queueBuffer);
+
+                for (uint32_t activeThreshold : { 64u, 128u, 192u, 256u }) {
+                    kernel.setArg(2, activeThreshold);
+
+                    double totalTime = 0.0;
+                    for (int i = 0; i < NUM_REPETITIONS; i++) {
+                        uint32_t zero = 0;
+                        queue.enqueueWriteBuffer(counterBuffer, CL_TRUE, 0, sizeof(uint32_t), &zero);
+
+                        cl::Event event;
+                        err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(NUM_THREADS), cl::NDRange(WORK_GROUP_SIZE), nullptr, &event);
+                        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+                        event.wait();
+
+                        cl_ulong startTime, stopTime;
+                        event.getProfilingInfo(CL_PROFILING_COMMAND_START, &startTime);
+                        event.getProfilingInfo(CL_PROFILING_COMMAND_END, &stopTime);
+                        totalTime += stopTime - startTime;
+                    }
+
+                    // Every active thread should have been appended exactly once (in any order)
+                    std::vector<uint32_t> expected = expectedQueue(activeThreshold);
+                    uint32_t count;
+                    queue.enqueueReadBuffer(counterBuffer, CL_TRUE, 0, sizeof(uint32_t), &count);
+                    std::vector<uint32_t> result(std::min(count, NUM_THREADS));
+                    queue.enqueueReadBuffer(queueBuffer, CL_TRUE, 0, result.size() * sizeof(uint32_t), result.data());
+                    std::sort(result.begin(), result.end());
+                    bool correct = (count == expected.size() && result == expected);
+
+                    double averageTime = totalTime / NUM_REPETITIONS / 1000000.0;
+                    std::cout << (workGroupCompaction ? "Atomic per work group, " : "Atomic per thread,     ")
+                              << (activeThreshold * 100 / 256) << "% active: " << averageTime << "ms ("
+                              << NUM_THREADS / averageTime / 1000.0 << " million threads/s)"
+                              << (correct ? "" : " INCORRECT RESULT") << std::endl;
+                }
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+static cl::Kernel loadBenchmarkKernel(const cl::Context& context, const cl::Device& device, bool workGroupCompaction)
+{
+    auto filePath = basePath / "assets/cl/compaction_benchmark.cl";
+    std::ifstream file(filePath);
+    checkClErr(file.is_open() ? CL_SUCCESS : -1, "Cannot open file: " + filePath.string());
+
+    std::string prog(std::istreambuf_iterator<char>(file), (std::istreambuf_iterator<char>()));
+    cl::Program::Sources sources;
+    sources.push_back(std::make_pair(prog.c_str(), prog.length()));
+    cl::Program program(context, sources);
+
+    std::string opts = "-I " + basePath.string() + "/assets/cl/ ";
+    if (workGroupCompaction)
+        opts += "-D USE_WORKGROUP_COMPACTION ";
+
+    cl_int err = program.build(std::vector<cl::Device> { device }, opts.c_str());
+    if (err != CL_SUCCESS) {
+        std::cout << "Cannot build program: " << filePath << std::endl;
+
+        std::string error;
+        program.getBuildInfo(device, CL_PROGRAM_BUILD_LOG, &error);
+        std::cout << error << std::endl;
+
+#ifdef _WIN32
+        system("PAUSE");
+#endif
+        exit(EXIT_FAILURE);
+    }
+
+    cl::Kernel kernel(program, "appendToQueue", &err);
+    checkClErr(err, "Cannot create kernel: " + filePath.string());
+    return kernel;
+}
+
+static std::vector<uint32_t> expectedQueue(uint32_t activeThreshold)
+{
+    // Same hash as appendToQueue
+    std::vector<uint32_t> result;
+    for (uint32_t gid = 0; gid < NUM_THREADS; gid++) {
+        uint32_t hash = gid;
+        hash = (hash ^ 61) ^ (hash >> 16);
+        hash *= 9;
+        hash = hash ^ (hash >> 4);
+        hash *= 0x27d4eb2d;
+        hash = hash ^ (hash >> 15);
+        if ((hash & 0xFF) < activeThreshold)
+            result.push_back(gid);
+    }
+    return result;
+}
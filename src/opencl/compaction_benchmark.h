@@ -0,0 +1,5 @@
+#pragma once
+
+// Measures the throughput of appending to a ray queue (workgroup_counter_inc in atomic.cl) with one global atomic per
+// thread and with one per work group, on every OpenCL device in the system.
+void benchmarkQueueCompaction();
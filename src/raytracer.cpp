@@ -1,6 +1,8 @@
 #include "raytracer.h"
 
+#include "bvh/quantized_bvh.h"
 #include "bvh/top_bvh_build.h"
+#include "bvh/wide_bvh.h"
 #include "camera.h"
 #include "opencl/cl_gl_includes.h"
 #include "opencl/cl_helpers.h"
@@ -9,13 +11,17 @@
 #include "scene.h"
 //#include "texture.h"
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <clRNG/lfsr113.h>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <numeric>
 #include <random>
 #include <stdlib.h>
+#include <string_view>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -24,7 +30,16 @@ const std::filesystem::path basePath = BASE_PATH;
 const std::filesystem::path clRngIncludeDir = CLRNG_INCLUDE_DIR;
 
 static size_t toMultipleOf(size_t N, size_t base);
-static int roundUp(int numToRound, int multiple);
+
+static raytracer::IntersectTriangle createIntersectTriangle(const raytracer::IMesh& mesh, const raytracer::TriangleSceneData& triangle);
+static uint32_t numGpuBvhNodes(uint32_t numBvhNodes);
+static uint32_t appendSubBvh(const raytracer::IMesh& mesh, uint32_t startTriangle, std::vector<raytracer::SubBVHNode>& outNodes);
+static uint32_t appendSubBvh(const raytracer::IMesh& mesh, uint32_t startTriangle, std::vector<raytracer::QuantizedSubBVHNode>& outNodes);
+static uint32_t appendSubBvh(const raytracer::IMesh& mesh, uint32_t startTriangle, std::vector<raytracer::WideSubBVHNode>& outNodes);
+template <typename T>
+static uint32_t calcTraversalStackSize(std::span<const T> nodes, uint32_t nodeID);
+static uint32_t calcTraversalStackSize(std::span<const raytracer::WideSubBVHNode> nodes, uint32_t nodeID);
+static uint32_t calcTraversalStackSize(std::span<const raytracer::TopBVHNode> nodes, uint32_t rootNodeID);
 
 template <typename T>
 static void writeToBuffer(cl::CommandQueue& queue, cl::Buffer& buffer, std::span<T> items, size_t offset = 0);
@@ -34,10 +49,44 @@ static void writeToBuffer(cl::CommandQueue& queue, cl::Buffer& buffer, std::span
 //#define OUTPUT_AVERAGE_GRAYSCALE
 //#define RANDOM_XOR32
 #define RANDOM_LFSR113
+//#define USE_WIDE_BVH // Collapse the sub BVHs to WIDE_BVH_WIDTH wide nodes, the traversal tests all children of a node at once
+//#define USE_QUANTIZED_BVH // Store the sub BVH bounds with 8 bits per coordinate (32 instead of 48 byte nodes)
+//#define USE_WHILE_WHILE_TRAVERSAL // Separate inner node and leaf loops in the sub BVH traversal (binary BVH only)
+//#define COUNT_TRAVERSAL // Print the average number of node and triangle visits per ray
+//#define USE_WORKGROUP_COMPACTION // Append the output rays with one global atomic per work group instead of per ray
+
+#if defined(USE_WIDE_BVH) && defined(USE_QUANTIZED_BVH)
+#error "The wide BVH does not support quantized nodes"
+#endif
+#if defined(USE_WIDE_BVH) && defined(USE_WHILE_WHILE_TRAVERSAL)
+#error "The while-while traversal is only implemented for the binary BVH"
+#endif
+
+#ifdef USE_WIDE_BVH
+using GPUSubBVHNode = raytracer::WideSubBVHNode;
+#elif defined(USE_QUANTIZED_BVH)
+using GPUSubBVHNode = raytracer::QuantizedSubBVHNode;
+#else
+using GPUSubBVHNode = raytracer::SubBVHNode;
+#endif
 
 static constexpr uint32_t MAX_SAMPLES_PER_PIXEL = 20000000;
 static constexpr uint32_t MAX_NUM_LIGHTS = 256;
 static constexpr uint32_t MAX_ACTIVE_RAYS = 1280 * 720; // Number of rays per pass (top performance = all pixels in 1 pass but very large buffer sizes at high res)
+static constexpr uint32_t RAY_QUEUE_BYTES_PER_RAY = 64; // Sum of the stream sizes of a RayQueue (ray_queue.cl)
+static constexpr uint32_t MIN_TRAVERSAL_STACK_SIZE = 32; // Size of the traversal stack unless the BVHs require more (see calcTraversalStackSize)
+static constexpr uint32_t TRAVERSAL_SHORT_STACK_SIZE = 16; // Top entries of the stack that are kept in local memory (the rest spills to global memory)
+static constexpr uint32_t KERNEL_DATA_READBACK_LATENCY = 2; // Iterations that are enqueued before the counters of an iteration are checked
+static constexpr uint32_t PERSISTENT_WORK_GROUPS_PER_COMPUTE_UNIT = 8; // Enough work groups to hide memory latency
+static constexpr uint32_t RAY_SORT_KEY_BITS = 24; // 9 bits direction + 15 bits origin (see computeRaySortKeys)
+static constexpr uint32_t RADIX_SORT_BITS = 4; // Must match RADIX_BITS in radix_sort.cl
+static constexpr uint32_t RADIX_SORT_SIZE = 1 << RADIX_SORT_BITS;
+static constexpr uint32_t RADIX_SORT_SCAN_WORK_GROUP_SIZE = 256; // Must match RADIX_SCAN_WORK_GROUP_SIZE in radix_sort.cl
+static constexpr uint32_t RADIX_SORT_SCAN_BLOCK_SIZE = 1024; // Must match RADIX_SCAN_BLOCK_SIZE in radix_sort.cl
+static constexpr uint32_t RADIX_SORT_HISTOGRAM_ENTRIES = RADIX_SORT_SIZE * (MAX_ACTIVE_RAYS / 64); // One per digit per work group
+static constexpr uint32_t RADIX_SORT_SCAN_BLOCKS = (RADIX_SORT_HISTOGRAM_ENTRIES + RADIX_SORT_SCAN_BLOCK_SIZE - 1) / RADIX_SORT_SCAN_BLOCK_SIZE;
+static_assert(RADIX_SORT_SCAN_BLOCKS <= RADIX_SORT_SCAN_BLOCK_SIZE, "The block totals of the radix sort are scanned by a single work group");
+static constexpr uint32_t NUM_MATERIAL_TYPES = 5; // Number of MaterialType values (material.h), one shading kernel each
 
 struct KernelData {
     raytracer::CameraData camera;
@@ -55,8 +104,20 @@ struct KernelData {
     unsigned numInRays;
     unsigned numOutRays;
     unsigned numShadowRays;
+    unsigned numMaterialRays[NUM_MATERIAL_TYPES];
     unsigned maxRays;
     unsigned newRays;
+
+    // Used by the persistent threads traversal
+    unsigned rayFetchCounter;
+
+    // Totals of the frame with COUNT_TRAVERSAL
+    unsigned numTraversedRays;
+    unsigned numNodeVisits;
+    unsigned numTriangleVisits;
+
+    // Set when a traversal stack was too small for the BVHs
+    unsigned traversalStackOverflow;
 };
 
 namespace raytracer {
@@ -69,12 +130,11 @@ RayTracer::RayTracer(int width, int height, std::shared_ptr<Scene> scene, const
     , m_topBvhRootNode { 0, 0 }
     , m_numEmissiveTriangles { 0, 0 }
 {
-    m_generateRaysKernel = loadKernel(basePath  / "assets/cl/kernel.cl", "generatePrimaryRays");
-    m_intersectShadowsKernel = loadKernel(basePath  / "assets/cl/kernel.cl", "intersectShadows");
-    m_intersectWalkKernel = loadKernel(basePath / "assets/cl/kernel.cl", "intersectWalk");
-    m_shadingKernel = loadKernel(basePath / "assets/cl/kernel.cl", "shade");
-    m_updateKernelDataKernel = loadKernel(basePath / "assets/cl/kernel.cl", "updateKernelData");
-    m_accumulateKernel = loadKernel(basePath / "assets/cl/accumulate.cl", "accumulate");
+    // The kernels are loaded once the size of the traversal stack is known (see resizeTraversalStack)
+
+    // The traversal stack buffer is sized for MAX_ACTIVE_RAYS threads
+    size_t numComputeUnits = m_clContext.getDevice().getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    m_numPersistentThreads = std::min<size_t>(numComputeUnits * PERSISTENT_WORK_GROUPS_PER_COMPUTE_UNIT * 64, MAX_ACTIVE_RAYS);
 
     initBuffersAndTransferStaticData(scene, materialTextures);
     initAndTransferSkydome(skydomeTextures);
@@ -83,6 +143,9 @@ RayTracer::RayTracer(int width, int height, std::shared_ptr<Scene> scene, const
 
 RayTracer::~RayTracer()
 {
+    // The non-blocking top-level BVH copy reads from host memory owned by this object
+    if (m_topBvhUpdatesUploadEvent() != nullptr)
+        m_topBvhUpdatesUploadEvent.wait();
 }
 
 void RayTracer::rayTrace(const Camera& camera)
@@ -185,6 +248,12 @@ void RayTracer::frameTick()
     // Lot of CPU work
     transferDynamicData();
 
+    // The samples of the previous scene state no longer match
+    if (!m_topBvh.getChangedNodes().empty()) {
+        clearAccumulationBuffer();
+        m_samplesPerPixel = 0;
+    }
+
     m_activeBuffer = (m_activeBuffer + 1) % 2;
 }
 
@@ -198,13 +267,123 @@ int RayTracer::getMaxSamplesPerPixel() const
     return MAX_SAMPLES_PER_PIXEL;
 }
 
+bool RayTracer::getPersistentThreads() const
+{
+    return m_usePersistentThreads;
+}
+
+void RayTracer::setPersistentThreads(bool enabled)
+{
+    m_usePersistentThreads = enabled;
+}
+
+bool RayTracer::getRaySorting() const
+{
+    return m_useRaySorting;
+}
+
+void RayTracer::setRaySorting(bool enabled)
+{
+    m_useRaySorting = enabled;
+}
+
+bool RayTracer::getMaterialSortedShading() const
+{
+    return m_useMaterialSortedShading;
+}
+
+void RayTracer::setMaterialSortedShading(bool enabled)
+{
+    m_useMaterialSortedShading = enabled;
+}
+
+void RayTracer::loadKernels()
+{
+    m_generateRaysKernel = loadKernel(basePath  / "assets/cl/kernel.cl", "generatePrimaryRays");
+    m_intersectShadowsKernel = loadKernel(basePath  / "assets/cl/kernel.cl", "intersectShadows");
+    m_intersectWalkKernel = loadKernel(basePath / "assets/cl/kernel.cl", "intersectWalk");
+    m_intersectWalkPersistentKernel = loadKernel(basePath / "assets/cl/kernel.cl", "intersectWalkPersistent");
+    m_shadingKernel = loadKernel(basePath / "assets/cl/kernel.cl", "shade");
+    m_classifyHitsKernel = loadKernel(basePath / "assets/cl/kernel.cl", "classifyHits");
+    m_shadeMaterialKernels[0] = loadKernel(basePath / "assets/cl/kernel.cl", "shadeDiffuse");
+    m_shadeMaterialKernels[1] = loadKernel(basePath / "assets/cl/kernel.cl", "shadePbr");
+    m_shadeMaterialKernels[2] = loadKernel(basePath / "assets/cl/kernel.cl", "shadeRefractive");
+    m_shadeMaterialKernels[3] = loadKernel(basePath / "assets/cl/kernel.cl", "shadeBasicRefractive");
+    m_shadeMaterialKernels[4] = loadKernel(basePath / "assets/cl/kernel.cl", "shadeEmissive");
+    m_updateKernelDataKernel = loadKernel(basePath / "assets/cl/kernel.cl", "updateKernelData");
+    m_computeRaySortKeysKernel = loadKernel(basePath / "assets/cl/kernel.cl", "computeRaySortKeys");
+    m_reorderRaysKernel = loadKernel(basePath / "assets/cl/kernel.cl", "reorderRays");
+    m_scatterTopBvhUpdatesKernel = loadKernel(basePath / "assets/cl/kernel.cl", "scatterTopBvhUpdates");
+    m_radixSortHistogramKernel = loadKernel(basePath / "assets/cl/radix_sort.cl", "radixSortHistogram");
+    m_radixSortScanBlocksKernel = loadKernel(basePath / "assets/cl/radix_sort.cl", "radixSortScanBlocks");
+    m_radixSortScanBlockSumsKernel = loadKernel(basePath / "assets/cl/radix_sort.cl", "radixSortScanBlockSums");
+    m_radixSortScatterKernel = loadKernel(basePath / "assets/cl/radix_sort.cl", "radixSortScatter");
+    m_accumulateKernel = loadKernel(basePath / "assets/cl/accumulate.cl", "accumulate");
+}
+
+void RayTracer::resizeTraversalStack(uint32_t requiredSize)
+{
+    // Grow in steps so that a BVH that gets slightly deeper every frame does not recompile the kernels every frame
+    requiredSize = std::max(requiredSize, MIN_TRAVERSAL_STACK_SIZE);
+    if (requiredSize <= m_traversalStackSize)
+        return;
+    m_traversalStackSize = (uint32_t)toMultipleOf(requiredSize, 8);
+
+    // Only the part that does not fit in local memory is stored in the buffer
+    cl_int err;
+    m_rayTraversalBuffer = cl::Buffer(m_clContext,
+        CL_MEM_READ_WRITE,
+        (size_t)MAX_ACTIVE_RAYS * (m_traversalStackSize - TRAVERSAL_SHORT_STACK_SIZE) * sizeof(uint32_t),
+        NULL,
+        &err);
+    checkClErr(err, "Buffer::Buffer()");
+
+    // The stack size is a compile time constant of the kernels
+    loadKernels();
+}
+
+bool RayTracer::reserveTopBvhBuffers(uint32_t numNodes)
+{
+    // Grow geometrically so that adding instances one at a time does not reallocate every frame
+    if (numNodes <= m_topBvhNodeCapacity && m_topBvhNodeCapacity > 0)
+        return false;
+    m_topBvhNodeCapacity = std::max({ 1u, numNodes, 2 * m_topBvhNodeCapacity });
+
+    // A binary tree with n leafs (instances) has 2n - 1 nodes
+    uint32_t instanceCapacity = (m_topBvhNodeCapacity + 1) / 2;
+
+    cl_int err;
+    for (int i = 0; i < 2; i++) {
+        m_topBvhBuffers[i] = cl::Buffer(m_clContext,
+            CL_MEM_READ_ONLY,
+            m_topBvhNodeCapacity * sizeof(TopBVHNode),
+            NULL,
+            &err);
+        checkClErr(err, "Buffer::Buffer()");
+        m_topBvhInstanceBuffers[i] = cl::Buffer(m_clContext,
+            CL_MEM_READ_ONLY,
+            instanceCapacity * sizeof(TopBVHInstance),
+            NULL,
+            &err);
+        checkClErr(err, "Buffer::Buffer()");
+    }
+
+    // At most every node changes
+    m_topBvhUpdatesBuffer = cl::Buffer(m_clContext,
+        CL_MEM_READ_ONLY,
+        m_topBvhNodeCapacity * sizeof(TopBVHNodeUpdate),
+        NULL,
+        &err);
+    checkClErr(err, "Buffer::Buffer()");
+    return true;
+}
+
 void RayTracer::initBuffersAndTransferStaticData(std::shared_ptr<Scene> scene, const UniqueTextureArray& textureArray)
 {
     // Initialize buffers
     m_numStaticVertices = 0;
     m_numStaticTriangles = 0;
     m_numStaticMaterials = 0;
-    m_numStaticBvhNodes = 0;
 
     uint32_t numVertices = 0;
     uint32_t numTriangles = 0;
@@ -217,22 +396,29 @@ void RayTracer::initBuffersAndTransferStaticData(std::shared_ptr<Scene> scene, c
             numVertices += meshPtr->maxNumVertices();
             numTriangles += meshPtr->maxNumTriangles();
             numMaterials += meshPtr->maxNumMaterials();
-            numBvhNodes += meshPtr->maxNumBvhNodes();
+            numBvhNodes += numGpuBvhNodes(meshPtr->maxNumBvhNodes());
         } else {
             numVertices += (uint32_t)meshPtr->getVertices().size();
             numTriangles += (uint32_t)meshPtr->getTriangles().size();
             numMaterials += (uint32_t)meshPtr->getMaterials().size();
-            numBvhNodes += (uint32_t)meshPtr->getBvhNodes().size();
+            numBvhNodes += numGpuBvhNodes((uint32_t)meshPtr->getBvhNodes().size());
 
             m_numStaticVertices += (uint32_t)meshPtr->getVertices().size();
             m_numStaticTriangles += (uint32_t)meshPtr->getTriangles().size();
             m_numStaticMaterials += (uint32_t)meshPtr->getMaterials().size();
-            m_numStaticBvhNodes += (uint32_t)meshPtr->getBvhNodes().size();
         }
     }
 
-    initBuffers(numVertices, numTriangles, MAX_NUM_LIGHTS, numMaterials,
-        numBvhNodes, (uint32_t)scene->getMeshes().size() * 2);
+    // The top-level BVH buffers are allocated once the number of instances is known (see reserveTopBvhBuffers)
+    initBuffers(numVertices, numTriangles, MAX_NUM_LIGHTS, numMaterials, numBvhNodes);
+
+#ifdef USE_WIDE_BVH
+    auto& subBvhNodesHost = m_wideSubBvhNodesHost;
+#elif defined(USE_QUANTIZED_BVH)
+    auto& subBvhNodesHost = m_quantizedSubBvhNodesHost;
+#else
+    auto& subBvhNodesHost = m_subBvhNodesHost;
+#endif
 
     // Collect all static geometry and upload it to the GPU
     for (auto& meshBvhPair : scene->getMeshes()) {
@@ -256,30 +442,26 @@ void RayTracer::initBuffersAndTransferStaticData(std::shared_ptr<Scene> scene, c
             m_trianglesHost.push_back(triangle);
             m_trianglesHost.back().indices += startVertex;
             m_trianglesHost.back().materialIndex += startMaterial;
+            m_intersectTrianglesHost.push_back(createIntersectTriangle(*meshPtr, triangle));
         }
 
-        uint32_t startBvhNode = (uint32_t)m_subBvhNodesHost.size();
-        for (auto& bvhNode : meshPtr->getBvhNodes()) {
-            m_subBvhNodesHost.push_back(bvhNode);
-            auto& newNode = m_subBvhNodesHost.back();
-            if (newNode.triangleCount > 0)
-                newNode.firstTriangleIndex += startTriangle;
-            else
-                newNode.leftChildIndex += startBvhNode;
-        }
-        meshBvhPair.bvhIndexOffset = startBvhNode;
+        meshBvhPair.bvhRootNode = appendSubBvh(*meshPtr, startTriangle, subBvhNodesHost);
+        m_staticTraversalStackSize = std::max(m_staticTraversalStackSize, calcTraversalStackSize(std::span<const GPUSubBVHNode>(subBvhNodesHost), meshBvhPair.bvhRootNode));
     }
+    m_numStaticBvhNodes = (uint32_t)subBvhNodesHost.size();
 
     auto queue = m_clContext.getGraphicsQueue();
     writeToBuffer(queue, m_verticesBuffers[0], std::span(m_verticesHost));
     writeToBuffer(queue, m_trianglesBuffers[0], std::span(m_trianglesHost));
+    writeToBuffer(queue, m_intersectTrianglesBuffers[0], std::span(m_intersectTrianglesHost));
     writeToBuffer(queue, m_materialsBuffers[0], std::span(m_materialsHost));
-    writeToBuffer(queue, m_subBvhBuffers[0], std::span(m_subBvhNodesHost));
+    writeToBuffer(queue, m_subBvhBuffers[0], std::span(subBvhNodesHost));
 
     writeToBuffer(queue, m_verticesBuffers[1], std::span(m_verticesHost));
     writeToBuffer(queue, m_trianglesBuffers[1], std::span(m_trianglesHost));
+    writeToBuffer(queue, m_intersectTrianglesBuffers[1], std::span(m_intersectTrianglesHost));
     writeToBuffer(queue, m_materialsBuffers[1], std::span(m_materialsHost));
-    writeToBuffer(queue, m_subBvhBuffers[1], std::span(m_subBvhNodesHost));
+    writeToBuffer(queue, m_subBvhBuffers[1], std::span(subBvhNodesHost));
 
     m_materialTextures = std::make_unique<CLTextureArray>(textureArray, m_clContext, 1024, 1024, false);
 
@@ -305,8 +487,15 @@ void RayTracer::traceRays(const Camera& camera)
     data.numInRays = 0;
     data.numOutRays = 0;
     data.numShadowRays = 0;
+    std::fill(std::begin(data.numMaterialRays), std::end(data.numMaterialRays), 0);
     data.maxRays = MAX_ACTIVE_RAYS;
     data.newRays = 0;
+    data.rayFetchCounter = 0;
+
+    data.numTraversedRays = 0;
+    data.numNodeVisits = 0;
+    data.numTriangleVisits = 0;
+    data.traversalStackOverflow = 0;
 
     cl_int err = queue.enqueueWriteBuffer(
         m_kernelDataBuffer,
@@ -316,103 +505,96 @@ void RayTracer::traceRays(const Camera& camera)
         &data);
     checkClErr(err, "CommandQueue::enqueueWriteBuffer");
 
-    static_assert(MAX_ACTIVE_RAYS, "MAX_ACTIVE_RAYS must be a multiple of 64 (work group size)");
+    static_assert(MAX_ACTIVE_RAYS % 64 == 0, "MAX_ACTIVE_RAYS must be a multiple of 64 (work group size)");
+    // The kernels are launched over the whole ray buffer and read the number of rays from the kernel data, so the host
+    // does not need to know the counters. They are read back asynchronously and only checked a couple of iterations
+    // later to decide when to stop; the iterations that are enqueued in the mean time do no work.
+    std::array<KernelData, KERNEL_DATA_READBACK_LATENCY + 1> readbackKernelData;
+    std::array<cl::Event, KERNEL_DATA_READBACK_LATENCY + 1> readbackEvents;
     int inRayBuffer = 0;
     int outRayBuffer = 1;
-    uint32_t survivingRays = 0;
-    while (true) {
-        if (survivingRays != MAX_ACTIVE_RAYS) {
-            // Generate primary rays and fill the emptyness
-            m_generateRaysKernel.setArg(0, m_raysBuffer[inRayBuffer]);
-            m_generateRaysKernel.setArg(1, m_kernelDataBuffer);
-            m_generateRaysKernel.setArg(2, m_randomStreamBuffer);
-            err = queue.enqueueNDRangeKernel(
-                m_generateRaysKernel,
-                cl::NullRange,
-                cl::NDRange(roundUp(MAX_ACTIVE_RAYS - survivingRays, 32)),
-                cl::NullRange); //cl::NDRange(64));
-            checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
-        }
-
-        // Output data
-        m_intersectWalkKernel.setArg(0, m_shadingRequestBuffer);
-        // Input data
-        m_intersectWalkKernel.setArg(1, m_raysBuffer[inRayBuffer]);
-        m_intersectWalkKernel.setArg(2, m_rayTraversalBuffer);
-        m_intersectWalkKernel.setArg(3, m_kernelDataBuffer);
-        m_intersectWalkKernel.setArg(4, m_verticesBuffers[m_activeBuffer]);
-        m_intersectWalkKernel.setArg(5, m_trianglesBuffers[m_activeBuffer]);
-        m_intersectWalkKernel.setArg(6, m_subBvhBuffers[m_activeBuffer]);
-        m_intersectWalkKernel.setArg(7, m_topBvhBuffers[m_activeBuffer]);
-        m_intersectWalkKernel.setArg(8, m_accumulationBuffer);
-
+    std::vector<cl::Event> traversalEvents, sortEvents;
+    for (uint32_t iteration = 0;; iteration++) {
+        // Generate primary rays and fill the emptyness
+        m_generateRaysKernel.setArg(0, m_raysBuffer[inRayBuffer]);
+        m_generateRaysKernel.setArg(1, m_kernelDataBuffer);
+        m_generateRaysKernel.setArg(2, m_randomStreamBuffer);
         err = queue.enqueueNDRangeKernel(
-            m_intersectWalkKernel,
+            m_generateRaysKernel,
             cl::NullRange,
             cl::NDRange(MAX_ACTIVE_RAYS),
-            cl::NDRange(64));
+            cl::NullRange); //cl::NDRange(64));
         checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
 
+        // Both variants take the same arguments
+        cl::Kernel& intersectKernel = m_usePersistentThreads ? m_intersectWalkPersistentKernel : m_intersectWalkKernel;
         // Output data
-        m_shadingKernel.setArg(0, m_accumulationBuffer);
-        m_shadingKernel.setArg(1, m_raysBuffer[outRayBuffer]);
-        m_shadingKernel.setArg(2, m_shadowRaysBuffer);
+        intersectKernel.setArg(0, m_shadingRequestBuffer);
         // Input data
-        m_shadingKernel.setArg(3, m_raysBuffer[inRayBuffer]);
-        m_shadingKernel.setArg(4, m_shadingRequestBuffer);
-        m_shadingKernel.setArg(5, m_kernelDataBuffer);
-        // Static input data
-        m_shadingKernel.setArg(6, m_verticesBuffers[m_activeBuffer]);
-        m_shadingKernel.setArg(7, m_trianglesBuffers[m_activeBuffer]);
-        m_shadingKernel.setArg(8, m_emissiveTrianglesBuffers[m_activeBuffer]);
-        m_shadingKernel.setArg(9, m_materialsBuffers[m_activeBuffer]);
-        m_shadingKernel.setArg(10, m_materialTextures->getImage2DArray());
-        m_shadingKernel.setArg(11, m_skydomeTextures->getImage2DArray());
-        m_shadingKernel.setArg(12, m_randomStreamBuffer);
+        intersectKernel.setArg(1, m_raysBuffer[inRayBuffer]);
+        intersectKernel.setArg(2, m_rayTraversalBuffer);
+        intersectKernel.setArg(3, m_kernelDataBuffer);
+        intersectKernel.setArg(4, m_intersectTrianglesBuffers[m_activeBuffer]);
+        intersectKernel.setArg(5, m_subBvhBuffers[m_activeBuffer]);
+        intersectKernel.setArg(6, m_topBvhBuffers[m_activeBuffer]);
+        intersectKernel.setArg(7, m_topBvhInstanceBuffers[m_activeBuffer]);
+        intersectKernel.setArg(8, m_accumulationBuffer);
 
         err = queue.enqueueNDRangeKernel(
-            m_shadingKernel,
+            intersectKernel,
             cl::NullRange,
-            cl::NDRange(MAX_ACTIVE_RAYS),
-            cl::NDRange(64));
+            cl::NDRange(m_usePersistentThreads ? m_numPersistentThreads : MAX_ACTIVE_RAYS),
+            cl::NDRange(64),
+            nullptr,
+            &traversalEvents.emplace_back());
         checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
 
-        // Request the output kernel data so we know the amount of surviving rays
-        cl::Event updatedKernelDataEvent;
-        KernelData updatedKernelData;
-        err = queue.enqueueReadBuffer(
-            m_kernelDataBuffer,
-            CL_TRUE,
-            0,
-            sizeof(KernelData),
-            &updatedKernelData);
-        survivingRays = updatedKernelData.numOutRays;
-        // Stop if we reach 0 rays and we processed the whole screen
-        //updatedKernelDataEvent.wait();
-        unsigned maxRays = m_screenWidth * m_screenHeight;
-        if (survivingRays == 0 && // We are out of rays
-            (updatedKernelData.rayOffset + updatedKernelData.newRays >= maxRays)) // And we wont generate new ones
-            break;
-        //survivingRays = MAX_ACTIVE_RAYS;
-
-        if (survivingRays != 0) {
-            m_intersectShadowsKernel.setArg(0, m_accumulationBuffer);
-            m_intersectShadowsKernel.setArg(1, m_shadowRaysBuffer);
-            m_intersectShadowsKernel.setArg(2, m_rayTraversalBuffer);
-            m_intersectShadowsKernel.setArg(3, m_kernelDataBuffer);
-            m_intersectShadowsKernel.setArg(4, m_verticesBuffers[m_activeBuffer]);
-            m_intersectShadowsKernel.setArg(5, m_trianglesBuffers[m_activeBuffer]);
-            m_intersectShadowsKernel.setArg(6, m_subBvhBuffers[m_activeBuffer]);
-            m_intersectShadowsKernel.setArg(7, m_topBvhBuffers[m_activeBuffer]);
+        if (m_useMaterialSortedShading) {
+            shadeMaterialSorted(m_raysBuffer[inRayBuffer], m_raysBuffer[outRayBuffer]);
+        } else {
+            // Output data
+            m_shadingKernel.setArg(0, m_accumulationBuffer);
+            m_shadingKernel.setArg(1, m_raysBuffer[outRayBuffer]);
+            m_shadingKernel.setArg(2, m_shadowRaysBuffer);
+            // Input data
+            m_shadingKernel.setArg(3, m_raysBuffer[inRayBuffer]);
+            m_shadingKernel.setArg(4, m_shadingRequestBuffer);
+            m_shadingKernel.setArg(5, m_kernelDataBuffer);
+            // Static input data
+            m_shadingKernel.setArg(6, m_verticesBuffers[m_activeBuffer]);
+            m_shadingKernel.setArg(7, m_trianglesBuffers[m_activeBuffer]);
+            m_shadingKernel.setArg(8, m_emissiveTrianglesBuffers[m_activeBuffer]);
+            m_shadingKernel.setArg(9, m_materialsBuffers[m_activeBuffer]);
+            m_shadingKernel.setArg(10, m_topBvhInstanceBuffers[m_activeBuffer]);
+            m_shadingKernel.setArg(11, m_materialTextures->getImage2DArray());
+            m_shadingKernel.setArg(12, m_skydomeTextures->getImage2DArray());
+            m_shadingKernel.setArg(13, m_randomStreamBuffer);
 
             err = queue.enqueueNDRangeKernel(
-                m_intersectShadowsKernel,
+                m_shadingKernel,
                 cl::NullRange,
-                cl::NDRange(roundUp(survivingRays, 64)),
+                cl::NDRange(MAX_ACTIVE_RAYS),
                 cl::NDRange(64));
             checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
         }
 
+        // The shadow rays are compacted into their own queue, threads past numShadowRays exit right away
+        m_intersectShadowsKernel.setArg(0, m_accumulationBuffer);
+        m_intersectShadowsKernel.setArg(1, m_shadowRaysBuffer);
+        m_intersectShadowsKernel.setArg(2, m_rayTraversalBuffer);
+        m_intersectShadowsKernel.setArg(3, m_kernelDataBuffer);
+        m_intersectShadowsKernel.setArg(4, m_intersectTrianglesBuffers[m_activeBuffer]);
+        m_intersectShadowsKernel.setArg(5, m_subBvhBuffers[m_activeBuffer]);
+        m_intersectShadowsKernel.setArg(6, m_topBvhBuffers[m_activeBuffer]);
+        m_intersectShadowsKernel.setArg(7, m_topBvhInstanceBuffers[m_activeBuffer]);
+
+        err = queue.enqueueNDRangeKernel(
+            m_intersectShadowsKernel,
+            cl::NullRange,
+            cl::NDRange(MAX_ACTIVE_RAYS),
+            cl::NDRange(64));
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
         // Set num input rays to num output rays and set num out rays and num shadow rays to 0
         m_updateKernelDataKernel.setArg(0, m_kernelDataBuffer);
         err = queue.enqueueNDRangeKernel(
@@ -422,13 +604,190 @@ void RayTracer::traceRays(const Camera& camera)
             cl::NDRange(1));
         checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
 
-        // What used to be output is now the input to the pass
-        std::swap(inRayBuffer, outRayBuffer);
+        // The tail iterations that are enqueued before the host sees that all rays have finished do not need sorting.
+        // Only the most recent readback is of use here (older ones have already been checked), so do not wait for it.
+        bool raysLeft = true;
+        if (iteration > 0) {
+            size_t prevIndex = (iteration - 1) % readbackKernelData.size();
+            if (readbackEvents[prevIndex].getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE) {
+                const KernelData& prevKernelData = readbackKernelData[prevIndex];
+                raysLeft = prevKernelData.numInRays > 0 || prevKernelData.rayOffset < m_screenWidth * m_screenHeight;
+            }
+        }
+
+        if (m_useRaySorting && raysLeft) {
+            // Sorted output is written to the input buffer of this pass (which has been consumed by now)
+            sortRays(m_raysBuffer[outRayBuffer], m_raysBuffer[inRayBuffer], sortEvents);
+        } else {
+            // What used to be output is now the input to the pass
+            std::swap(inRayBuffer, outRayBuffer);
+        }
+
+        // Request the updated kernel data so we know when all rays have finished
+        size_t readbackIndex = iteration % readbackKernelData.size();
+        err = queue.enqueueReadBuffer(
+            m_kernelDataBuffer,
+            CL_FALSE,
+            0,
+            sizeof(KernelData),
+            &readbackKernelData[readbackIndex],
+            nullptr,
+            &readbackEvents[readbackIndex]);
+        checkClErr(err, "CommandQueue::enqueueReadBuffer");
+        queue.flush();
+
+        if (iteration < KERNEL_DATA_READBACK_LATENCY)
+            continue;
+
+        // Stop if we are out of rays and we processed the whole screen (so we wont generate new ones)
+        size_t checkIndex = (iteration - KERNEL_DATA_READBACK_LATENCY) % readbackKernelData.size();
+        readbackEvents[checkIndex].wait();
+        const KernelData& checkKernelData = readbackKernelData[checkIndex];
+        if (checkKernelData.numInRays == 0 && checkKernelData.rayOffset >= m_screenWidth * m_screenHeight) {
+            // The remaining reads must finish before the kernel data goes out of scope
+            cl::Event::waitForEvents(std::vector<cl::Event>(readbackEvents.begin(), readbackEvents.end()));
+            const KernelData& finalKernelData = readbackKernelData[readbackIndex];
+            if (finalKernelData.traversalStackOverflow && !m_traversalStackOverflowReported) {
+                // Geometry is missing from the image, calcTraversalStackSize underestimates the depth of a BVH
+                std::cerr << "Traversal stack overflow: a stack size of " << m_traversalStackSize << " is too small for the scene" << std::endl;
+                m_traversalStackOverflowReported = true;
+            }
+#ifdef COUNT_TRAVERSAL
+            float numRays = (float)std::max(finalKernelData.numTraversedRays, 1u);
+            std::cout << "Node visits per ray: " << finalKernelData.numNodeVisits / numRays
+                      << ", triangle visits per ray: " << finalKernelData.numTriangleVisits / numRays << std::endl;
+#endif
+            break;
+        }
     }
 
+    // Compare the cost of sorting with the traversal time (with and without sorting)
+    timeOpenCL(sortEvents, "ray sorting");
+    timeOpenCL(traversalEvents, "traversal");
+
     m_samplesPerPixel += 1;
 }
 
+void RayTracer::sortRays(const cl::Buffer& inRays, const cl::Buffer& outRays, std::vector<cl::Event>& events)
+{
+    auto queue = m_clContext.getGraphicsQueue();
+
+    // Quantize the ray origins relative to the scene bounds
+    AABB sceneBounds(glm::vec3(0.0f), glm::vec3(1.0f));
+    if (!m_topBvh.getNodes().empty())
+        sceneBounds = m_topBvh.getNodes()[m_topBvh.getRootNode()].bounds;
+    glm::vec3 sceneInvExtent = 1.0f / glm::max(sceneBounds.max - sceneBounds.min, glm::vec3(1e-6f));
+
+    // The number of rays is only known on the device: rays past the end get the largest key and end up at the back
+    uint32_t numKeys = MAX_ACTIVE_RAYS;
+    cl::NDRange globalSize(MAX_ACTIVE_RAYS);
+    cl::NDRange localSize(64);
+    m_computeRaySortKeysKernel.setArg(0, inRays);
+    m_computeRaySortKeysKernel.setArg(1, m_kernelDataBuffer);
+    m_computeRaySortKeysKernel.setArg(2, glmToCl(sceneBounds.min));
+    m_computeRaySortKeysKernel.setArg(3, glmToCl(sceneInvExtent));
+    m_computeRaySortKeysKernel.setArg(4, m_raySortKeysBuffers[0]);
+    m_computeRaySortKeysKernel.setArg(5, m_raySortValuesBuffers[0]);
+    cl_int err = queue.enqueueNDRangeKernel(m_computeRaySortKeysKernel, cl::NullRange, globalSize, localSize, nullptr, &events.emplace_back());
+    checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
+    int in = 0;
+    for (uint32_t shift = 0; shift < RAY_SORT_KEY_BITS; shift += RADIX_SORT_BITS) {
+        m_radixSortHistogramKernel.setArg(0, m_raySortKeysBuffers[in]);
+        m_radixSortHistogramKernel.setArg(1, numKeys);
+        m_radixSortHistogramKernel.setArg(2, shift);
+        m_radixSortHistogramKernel.setArg(3, m_raySortHistogramBuffer);
+        err = queue.enqueueNDRangeKernel(m_radixSortHistogramKernel, cl::NullRange, globalSize, localSize, nullptr, &events.emplace_back());
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
+        // Two level scan: the blocks of the histogram are scanned in parallel, the scanned block totals are added back
+        // in by the scatter kernel
+        m_radixSortScanBlocksKernel.setArg(0, m_raySortHistogramBuffer);
+        m_radixSortScanBlocksKernel.setArg(1, RADIX_SORT_HISTOGRAM_ENTRIES);
+        m_radixSortScanBlocksKernel.setArg(2, m_raySortBlockSumsBuffer);
+        err = queue.enqueueNDRangeKernel(
+            m_radixSortScanBlocksKernel,
+            cl::NullRange,
+            cl::NDRange(RADIX_SORT_SCAN_BLOCKS * RADIX_SORT_SCAN_WORK_GROUP_SIZE),
+            cl::NDRange(RADIX_SORT_SCAN_WORK_GROUP_SIZE),
+            nullptr,
+            &events.emplace_back());
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
+        m_radixSortScanBlockSumsKernel.setArg(0, m_raySortBlockSumsBuffer);
+        m_radixSortScanBlockSumsKernel.setArg(1, RADIX_SORT_SCAN_BLOCKS);
+        err = queue.enqueueNDRangeKernel(
+            m_radixSortScanBlockSumsKernel,
+            cl::NullRange,
+            cl::NDRange(RADIX_SORT_SCAN_WORK_GROUP_SIZE),
+            cl::NDRange(RADIX_SORT_SCAN_WORK_GROUP_SIZE),
+            nullptr,
+            &events.emplace_back());
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
+        m_radixSortScatterKernel.setArg(0, m_raySortKeysBuffers[in]);
+        m_radixSortScatterKernel.setArg(1, m_raySortValuesBuffers[in]);
+        m_radixSortScatterKernel.setArg(2, numKeys);
+        m_radixSortScatterKernel.setArg(3, shift);
+        m_radixSortScatterKernel.setArg(4, m_raySortHistogramBuffer);
+        m_radixSortScatterKernel.setArg(5, m_raySortBlockSumsBuffer);
+        m_radixSortScatterKernel.setArg(6, m_raySortKeysBuffers[1 - in]);
+        m_radixSortScatterKernel.setArg(7, m_raySortValuesBuffers[1 - in]);
+        err = queue.enqueueNDRangeKernel(m_radixSortScatterKernel, cl::NullRange, globalSize, localSize, nullptr, &events.emplace_back());
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+        in = 1 - in;
+    }
+
+    m_reorderRaysKernel.setArg(0, inRays);
+    m_reorderRaysKernel.setArg(1, m_raySortValuesBuffers[in]);
+    m_reorderRaysKernel.setArg(2, m_kernelDataBuffer);
+    m_reorderRaysKernel.setArg(3, outRays);
+    err = queue.enqueueNDRangeKernel(m_reorderRaysKernel, cl::NullRange, globalSize, localSize, nullptr, &events.emplace_back());
+    checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+}
+
+void RayTracer::shadeMaterialSorted(const cl::Buffer& inRays, const cl::Buffer& outRays)
+{
+    auto queue = m_clContext.getGraphicsQueue();
+    cl::NDRange globalSize(MAX_ACTIVE_RAYS);
+    cl::NDRange localSize(64);
+
+    // Shades the misses and bins the hits per material type
+    m_classifyHitsKernel.setArg(0, m_accumulationBuffer);
+    m_classifyHitsKernel.setArg(1, m_materialQueuesBuffer);
+    m_classifyHitsKernel.setArg(2, inRays);
+    m_classifyHitsKernel.setArg(3, m_shadingRequestBuffer);
+    m_classifyHitsKernel.setArg(4, m_kernelDataBuffer);
+    m_classifyHitsKernel.setArg(5, m_trianglesBuffers[m_activeBuffer]);
+    m_classifyHitsKernel.setArg(6, m_materialsBuffers[m_activeBuffer]);
+    m_classifyHitsKernel.setArg(7, m_skydomeTextures->getImage2DArray());
+    cl_int err = queue.enqueueNDRangeKernel(m_classifyHitsKernel, cl::NullRange, globalSize, localSize);
+    checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+
+    // The queue sizes are only known on the device: threads past the end of their queue only take part in the compaction
+    for (cl::Kernel& kernel : m_shadeMaterialKernels) {
+        // Output data
+        kernel.setArg(0, m_accumulationBuffer);
+        kernel.setArg(1, outRays);
+        kernel.setArg(2, m_shadowRaysBuffer);
+        // Input data
+        kernel.setArg(3, m_materialQueuesBuffer);
+        kernel.setArg(4, inRays);
+        kernel.setArg(5, m_shadingRequestBuffer);
+        kernel.setArg(6, m_kernelDataBuffer);
+        // Static input data
+        kernel.setArg(7, m_verticesBuffers[m_activeBuffer]);
+        kernel.setArg(8, m_trianglesBuffers[m_activeBuffer]);
+        kernel.setArg(9, m_emissiveTrianglesBuffers[m_activeBuffer]);
+        kernel.setArg(10, m_materialsBuffers[m_activeBuffer]);
+        kernel.setArg(11, m_topBvhInstanceBuffers[m_activeBuffer]);
+        kernel.setArg(12, m_materialTextures->getImage2DArray());
+        kernel.setArg(13, m_randomStreamBuffer);
+        err = queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalSize, localSize);
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+    }
+}
+
 void RayTracer::accumulate(const Camera& camera)
 {
 #ifdef OPENCL_GL_INTEROP
@@ -508,13 +867,25 @@ void RayTracer::transferDynamicData()
 
     int copyBuffers = (m_activeBuffer + 1) % 2;
     std::vector<cl::Event> waitEvents;
+    std::vector<std::pair<std::string_view, size_t>> uploads; // Name and first event in waitEvents of every upload
+    auto beginUpload = [&](std::string_view name) { uploads.emplace_back(name, waitEvents.size()); };
+
+#ifdef USE_WIDE_BVH
+    auto& subBvhNodesHost = m_wideSubBvhNodesHost;
+#elif defined(USE_QUANTIZED_BVH)
+    auto& subBvhNodesHost = m_quantizedSubBvhNodesHost;
+#else
+    auto& subBvhNodesHost = m_subBvhNodesHost;
+#endif
 
     m_verticesHost.resize(m_numStaticVertices);
     m_trianglesHost.resize(m_numStaticTriangles);
+    m_intersectTrianglesHost.resize(m_numStaticTriangles);
     m_materialsHost.resize(m_numStaticMaterials);
-    m_subBvhNodesHost.resize(m_numStaticBvhNodes);
+    subBvhNodesHost.resize(m_numStaticBvhNodes);
 
     // Collect all static geometry and upload it to the GPU
+    uint32_t subBvhStackSize = m_staticTraversalStackSize;
     for (auto& meshBvhPair : m_scene->getMeshes()) {
         auto meshPtr = meshBvhPair.meshPtr;
         if (!meshPtr->isDynamic())
@@ -538,59 +909,121 @@ void RayTracer::transferDynamicData()
             m_trianglesHost.push_back(triangle);
             m_trianglesHost.back().indices += startVertex;
             m_trianglesHost.back().materialIndex += startMaterial;
+            m_intersectTrianglesHost.push_back(createIntersectTriangle(*meshPtr, triangle));
         }
 
-        uint32_t startBvhNode = (uint32_t)m_subBvhNodesHost.size();
-        for (const auto& bvhNode : meshPtr->getBvhNodes()) {
-            m_subBvhNodesHost.push_back(bvhNode);
-            auto& newNode = m_subBvhNodesHost.back();
-            if (newNode.triangleCount > 0)
-                newNode.firstTriangleIndex += startTriangle;
-            else
-                newNode.leftChildIndex += startBvhNode;
-        }
-        meshBvhPair.bvhIndexOffset = startBvhNode;
+        meshBvhPair.bvhRootNode = appendSubBvh(*meshPtr, startTriangle, subBvhNodesHost);
+        subBvhStackSize = std::max(subBvhStackSize, calcTraversalStackSize(std::span<const GPUSubBVHNode>(subBvhNodesHost), meshBvhPair.bvhRootNode));
     }
 
     // Get the light emmiting triangles transformed by the scene graph
     m_emissiveTrianglesHost.clear();
     collectTransformedLights(&m_scene->getRootNode(), glm::mat4(1.0f));
     m_numEmissiveTriangles[copyBuffers] = (uint32_t)m_emissiveTrianglesHost.size();
+    beginUpload("emissive triangles upload");
     writeToBuffer(copyQueue, m_emissiveTrianglesBuffers[copyBuffers], std::span(m_emissiveTrianglesHost), 0, waitEvents);
 
     if (m_verticesHost.size() > static_cast<size_t>(m_numStaticVertices)) // Only copy if there is any dynamic geometry
     {
         // Dynamic data is appended after the static data
+        beginUpload("vertex upload");
         writeToBuffer(copyQueue, m_verticesBuffers[copyBuffers], std::span(m_verticesHost), m_numStaticVertices, waitEvents);
+        beginUpload("triangle upload");
         writeToBuffer(copyQueue, m_trianglesBuffers[copyBuffers], std::span(m_trianglesHost), m_numStaticTriangles, waitEvents);
+        beginUpload("intersect triangle upload");
+        writeToBuffer(copyQueue, m_intersectTrianglesBuffers[copyBuffers], std::span(m_intersectTrianglesHost), m_numStaticTriangles, waitEvents);
+        beginUpload("material upload");
         writeToBuffer(copyQueue, m_materialsBuffers[copyBuffers], std::span(m_materialsHost), m_numStaticMaterials, waitEvents);
-        writeToBuffer(copyQueue, m_subBvhBuffers[copyBuffers], std::span(m_subBvhNodesHost), m_numStaticBvhNodes, waitEvents);
+        beginUpload("sub bvh upload");
+        writeToBuffer(copyQueue, m_subBvhBuffers[copyBuffers], std::span(subBvhNodesHost), m_numStaticBvhNodes, waitEvents);
     }
 
     // Update the top level BVH and copy it to the GPU on a separate copy queue
-    std::vector<uint32_t> meshBvhOffsets;
-    for (auto [meshPtr, bvhIndexOffset] : m_scene->getMeshes())
-        meshBvhOffsets.push_back(bvhIndexOffset);
-
-    auto [topBvhRootNodeID, topBvhRootNodes] = buildTopBVH(m_scene->getRootNode(), meshBvhOffsets);
-    m_topBvhRootNode[copyBuffers] = topBvhRootNodeID;
-    m_topBvhNodesHost = std::move(topBvhRootNodes);
-    writeToBuffer(copyQueue, m_topBvhBuffers[copyBuffers], std::span(m_topBvhNodesHost), 0, waitEvents);
-
-    if (m_verticesHost.size() > static_cast<size_t>(m_numStaticVertices)) {
-        timeOpenCL(waitEvents[0], "vertex upload");
-        timeOpenCL(waitEvents[1], "triangle upload");
-        timeOpenCL(waitEvents[2], "material upload");
-        timeOpenCL(waitEvents[3], "sub bvh upload");
-        timeOpenCL(waitEvents[4], "emissive triangles upload");
-        timeOpenCL(waitEvents[5], "top bvh upload");
-    } else {
-        //timeOpenCL(waitEvents[0], "emissive triangles upload");
-        //timeOpenCL(waitEvents[1], "top bvh upload");
+    std::vector<uint32_t> meshBvhRoots;
+    for (auto [meshPtr, bvhRootNode] : m_scene->getMeshes())
+        meshBvhRoots.push_back(bvhRootNode);
+
+    m_topBvh.update(*m_scene, meshBvhRoots);
+    m_scene->clearChanges();
+    m_topBvhRootNode[copyBuffers] = m_topBvh.getRootNode();
+
+    // The sub BVH entries are pushed on top of the remaining top-level entries (also loads the kernels on the first frame)
+    if (!m_topBvh.getChangedNodes().empty())
+        m_topBvhStackSize = calcTraversalStackSize(m_topBvh.getNodes(), m_topBvh.getRootNode());
+    resizeTraversalStack(m_topBvhStackSize + subBvhStackSize);
+
+    // Newly allocated buffers are empty, so both of them need all nodes (the other one during the next frame)
+    auto changedNodes = m_topBvh.getChangedNodes();
+    std::vector<uint32_t> allNodes;
+    if (reserveTopBvhBuffers((uint32_t)m_topBvh.getNodes().size())) {
+        allNodes.resize(m_topBvh.getNodes().size());
+        std::iota(allNodes.begin(), allNodes.end(), 0u);
+        changedNodes = allNodes;
+    }
+
+    // The copy buffer also missed the changes of the previous frame (which went to the other buffer)
+    std::vector<uint32_t> uploadNodes;
+    std::set_union(changedNodes.begin(), changedNodes.end(), m_prevTopBvhChangedNodes.begin(), m_prevTopBvhChangedNodes.end(), std::back_inserter(uploadNodes));
+    m_prevTopBvhChangedNodes.assign(changedNodes.begin(), changedNodes.end());
+
+    // The changed nodes are scattered over the whole array, so they are packed into one non-blocking copy and
+    // scattered into place by a kernel. The host array has to outlive the previous copy before it can be refilled.
+    if (m_topBvhUpdatesUploadEvent() != nullptr)
+        m_topBvhUpdatesUploadEvent.wait();
+    auto nodes = m_topBvh.getNodes();
+    auto instances = m_topBvh.getInstances();
+    m_topBvhUpdatesHost.clear();
+    for (uint32_t nodeID : uploadNodes) {
+        if (nodeID >= nodes.size())
+            break; // Sorted, the rest belongs to a previous (larger) tree
+
+        auto& update = m_topBvhUpdatesHost.emplace_back();
+        update.node = nodes[nodeID];
+        if (nodeID < instances.size())
+            update.instance = instances[nodeID];
+        update.nodeIndex = nodeID;
+    }
+
+    cl_int err;
+    if (!m_topBvhUpdatesHost.empty()) {
+        beginUpload("top bvh upload");
+        err = copyQueue.enqueueWriteBuffer(
+            m_topBvhUpdatesBuffer,
+            CL_FALSE,
+            0,
+            m_topBvhUpdatesHost.size() * sizeof(TopBVHNodeUpdate),
+            m_topBvhUpdatesHost.data(),
+            nullptr,
+            &m_topBvhUpdatesUploadEvent);
+        checkClErr(err, "CommandQueue::enqueueWriteBuffer");
+        waitEvents.push_back(m_topBvhUpdatesUploadEvent);
+
+        m_scatterTopBvhUpdatesKernel.setArg(0, m_topBvhUpdatesBuffer);
+        m_scatterTopBvhUpdatesKernel.setArg(1, (cl_uint)m_topBvhUpdatesHost.size());
+        m_scatterTopBvhUpdatesKernel.setArg(2, (cl_uint)instances.size());
+        m_scatterTopBvhUpdatesKernel.setArg(3, m_topBvhBuffers[copyBuffers]);
+        m_scatterTopBvhUpdatesKernel.setArg(4, m_topBvhInstanceBuffers[copyBuffers]);
+        // The copy queue is in order, so the kernel runs after the copy (and the next copy after the kernel)
+        err = copyQueue.enqueueNDRangeKernel(
+            m_scatterTopBvhUpdatesKernel,
+            cl::NullRange,
+            cl::NDRange(toMultipleOf(m_topBvhUpdatesHost.size(), 64)),
+            cl::NDRange(64),
+            nullptr,
+            &waitEvents.emplace_back());
+        checkClErr(err, "CommandQueue::enqueueNDRangeKernel()");
+    }
+
+    // An upload consists of all events up to the first event of the next upload
+    for (size_t i = 0; i < uploads.size(); i++) {
+        auto [name, firstEvent] = uploads[i];
+        size_t endEvent = i + 1 < uploads.size() ? uploads[i + 1].second : waitEvents.size();
+        if (endEvent > firstEvent)
+            timeOpenCL(std::span(waitEvents).subspan(firstEvent, endEvent - firstEvent), name);
     }
 
     // Make sure the main queue waits for the copy to finish
-    cl_int err = graphicsQueue.enqueueBarrierWithWaitList(&waitEvents);
+    err = graphicsQueue.enqueueBarrierWithWaitList(&waitEvents);
     checkClErr(err, "CommandQueue::enqueueBarrierWithWaitList");
 }
 
@@ -625,8 +1058,7 @@ void RayTracer::initBuffers(
     uint32_t numTriangles,
     uint32_t numEmissiveTriangles,
     uint32_t numMaterials,
-    uint32_t numSubBvhNodes,
-    uint32_t numTopBvhNodes)
+    uint32_t numSubBvhNodes)
 {
     cl_int err;
 
@@ -654,6 +1086,19 @@ void RayTracer::initBuffers(
         &err);
     checkClErr(err, "Buffer::Buffer()");
 
+    m_intersectTrianglesBuffers[0] = cl::Buffer(m_clContext,
+        CL_MEM_READ_ONLY,
+        std::max(1u, numTriangles) * sizeof(IntersectTriangle),
+        NULL,
+        &err);
+    checkClErr(err, "Buffer::Buffer()");
+    m_intersectTrianglesBuffers[1] = cl::Buffer(m_clContext,
+        CL_MEM_READ_ONLY,
+        std::max(1u, numTriangles) * sizeof(IntersectTriangle),
+        NULL,
+        &err);
+    checkClErr(err, "Buffer::Buffer()");
+
     m_emissiveTrianglesBuffers[0] = cl::Buffer(m_clContext,
         CL_MEM_READ_ONLY,
         std::max(1u, numEmissiveTriangles) * sizeof(EmissiveTriangle),
@@ -680,39 +1125,55 @@ void RayTracer::initBuffers(
 
     m_subBvhBuffers[0] = cl::Buffer(m_clContext,
         CL_MEM_READ_ONLY,
-        std::max(1u, numSubBvhNodes) * sizeof(SubBVHNode),
+        std::max(1u, numSubBvhNodes) * sizeof(GPUSubBVHNode),
         NULL,
         &err);
     m_subBvhBuffers[1] = cl::Buffer(m_clContext,
         CL_MEM_READ_ONLY,
-        std::max(1u, numSubBvhNodes) * sizeof(SubBVHNode),
+        std::max(1u, numSubBvhNodes) * sizeof(GPUSubBVHNode),
         NULL,
         &err);
     checkClErr(err, "Buffer::Buffer()");
 
-    m_topBvhBuffers[0] = cl::Buffer(m_clContext,
-        CL_MEM_READ_ONLY,
-        numTopBvhNodes * sizeof(TopBVHNode), // TODO: Make this dynamic so we dont have a fixed max of 256 top level BVH nodes.
+    m_kernelDataBuffer = cl::Buffer(m_clContext,
+        CL_MEM_READ_WRITE,
+        sizeof(KernelData),
         NULL,
         &err);
     checkClErr(err, "Buffer::Buffer()");
-    m_topBvhBuffers[1] = cl::Buffer(m_clContext,
-        CL_MEM_READ_ONLY,
-        numTopBvhNodes * sizeof(TopBVHNode), // TODO: Make this dynamic so we dont have a fixed max of 256 top level BVH nodes.
+
+    // Ray sorting (keys and values are ping-ponged between the radix sort passes)
+    for (int i = 0; i < 2; i++) {
+        m_raySortKeysBuffers[i] = cl::Buffer(m_clContext,
+            CL_MEM_READ_WRITE,
+            MAX_ACTIVE_RAYS * sizeof(uint32_t),
+            NULL,
+            &err);
+        checkClErr(err, "Buffer::Buffer()");
+        m_raySortValuesBuffers[i] = cl::Buffer(m_clContext,
+            CL_MEM_READ_WRITE,
+            MAX_ACTIVE_RAYS * sizeof(uint32_t),
+            NULL,
+            &err);
+        checkClErr(err, "Buffer::Buffer()");
+    }
+    m_raySortHistogramBuffer = cl::Buffer(m_clContext,
+        CL_MEM_READ_WRITE,
+        RADIX_SORT_HISTOGRAM_ENTRIES * sizeof(uint32_t),
         NULL,
         &err);
     checkClErr(err, "Buffer::Buffer()");
-
-    m_rayTraversalBuffer = cl::Buffer(m_clContext,
+    m_raySortBlockSumsBuffer = cl::Buffer(m_clContext,
         CL_MEM_READ_WRITE,
-        MAX_ACTIVE_RAYS * 32 * sizeof(uint32_t),
+        RADIX_SORT_SCAN_BLOCKS * sizeof(uint32_t),
         NULL,
         &err);
     checkClErr(err, "Buffer::Buffer()");
 
-    m_kernelDataBuffer = cl::Buffer(m_clContext,
+    // Indices of the hit rays, binned per material type (MAX_ACTIVE_RAYS per type)
+    m_materialQueuesBuffer = cl::Buffer(m_clContext,
         CL_MEM_READ_WRITE,
-        sizeof(KernelData),
+        NUM_MATERIAL_TYPES * MAX_ACTIVE_RAYS * sizeof(uint32_t),
         NULL,
         &err);
     checkClErr(err, "Buffer::Buffer()");
@@ -757,28 +1218,28 @@ void RayTracer::initBuffers(
         &err);
     checkClErr(err, "cl::Buffer");
 
-    const int rayDataStructSize = 80;
+    // Ray queues, every ray field is stored as a separate stream (see ray_queue.cl)
     m_raysBuffer[0] = cl::Buffer(m_clContext,
         CL_MEM_READ_WRITE,
-        (size_t)MAX_ACTIVE_RAYS * rayDataStructSize,
+        (size_t)MAX_ACTIVE_RAYS * RAY_QUEUE_BYTES_PER_RAY,
         nullptr,
         &err);
     checkClErr(err, "cl::Buffer");
     m_raysBuffer[1] = cl::Buffer(m_clContext,
         CL_MEM_READ_WRITE,
-        (size_t)MAX_ACTIVE_RAYS * rayDataStructSize,
+        (size_t)MAX_ACTIVE_RAYS * RAY_QUEUE_BYTES_PER_RAY,
         nullptr,
         &err);
     checkClErr(err, "cl::Buffer");
 
     m_shadowRaysBuffer = cl::Buffer(m_clContext,
         CL_MEM_READ_WRITE,
-        (size_t)MAX_ACTIVE_RAYS * rayDataStructSize,
+        (size_t)MAX_ACTIVE_RAYS * RAY_QUEUE_BYTES_PER_RAY,
         nullptr,
         &err);
     checkClErr(err, "cl::Buffer");
 
-    const int shadingDataStructSize = 64;
+    const int shadingDataStructSize = 24; // sizeof(ShadingData) in kernel_data.cl
     m_shadingRequestBuffer = cl::Buffer(m_clContext,
         CL_MEM_READ_WRITE,
         (size_t)MAX_ACTIVE_RAYS * shadingDataStructSize,
@@ -812,6 +1273,21 @@ cl::Kernel RayTracer::loadKernel(const std::filesystem::path& filePath, const st
 #elif defined(RANDOM_LFSR113)
     opts += "-D RANDOM_LFSR113 ";
 #endif
+#ifdef USE_WIDE_BVH
+    opts += "-D USE_WIDE_BVH -D WIDE_BVH_WIDTH=" + std::to_string(WIDE_BVH_WIDTH) + " ";
+#elif defined(USE_QUANTIZED_BVH)
+    opts += "-D USE_QUANTIZED_BVH ";
+#endif
+#ifdef USE_WHILE_WHILE_TRAVERSAL
+    opts += "-D USE_WHILE_WHILE_TRAVERSAL ";
+#endif
+#ifdef COUNT_TRAVERSAL
+    opts += "-D COUNT_TRAVERSAL ";
+#endif
+#ifdef USE_WORKGROUP_COMPACTION
+    opts += "-D USE_WORKGROUP_COMPACTION ";
+#endif
+    opts += "-D TRAVERSAL_STACK_SIZE=" + std::to_string(m_traversalStackSize) + " -D TRAVERSAL_SHORT_STACK_SIZE=" + std::to_string(TRAVERSAL_SHORT_STACK_SIZE) + " ";
 
 #if defined(_DEBUG)
     //opts += "-cl-std=CL1.2 -g -O0"; // -g is not supported on all compilers. If you have problems, remove this option
@@ -853,17 +1329,121 @@ static size_t toMultipleOf(size_t N, size_t base)
     return static_cast<size_t>((ceil((double)N / (double)base) * base));
 }
 
-// http://stackoverflow.com/questions/3407012/c-rounding-up-to-the-nearest-multiple-of-a-number
-static int roundUp(int numToRound, int multiple)
+static raytracer::IntersectTriangle createIntersectTriangle(const raytracer::IMesh& mesh, const raytracer::TriangleSceneData& triangle)
+{
+    // Indices are relative to the mesh
+    auto vertices = mesh.getVertices();
+    glm::vec4 vertex0 = vertices[triangle.indices[0]].vertex;
+    bool isEmissive = mesh.getMaterials()[triangle.materialIndex].type == raytracer::Material::MaterialType::EMISSIVE;
+
+    raytracer::IntersectTriangle result;
+    result.vertex0 = glm::vec4(glm::vec3(vertex0), isEmissive ? 1.0f : 0.0f);
+    result.edge1 = vertices[triangle.indices[1]].vertex - vertex0;
+    result.edge2 = vertices[triangle.indices[2]].vertex - vertex0;
+    return result;
+}
+
+// Number of nodes in the sub BVH buffers that a binary BVH with the given number of nodes may occupy
+static uint32_t numGpuBvhNodes(uint32_t numBvhNodes)
+{
+#ifdef USE_WIDE_BVH
+    return raytracer::maxNumWideBvhNodes(numBvhNodes);
+#else
+    return numBvhNodes;
+#endif
+}
+
+// Appends the BVH of the mesh to the sub BVH array and returns the index of the mesh's root node in that array
+static uint32_t appendSubBvh(const raytracer::IMesh& mesh, uint32_t startTriangle, std::vector<raytracer::SubBVHNode>& outNodes)
+{
+    uint32_t startBvhNode = (uint32_t)outNodes.size();
+    for (const auto& bvhNode : mesh.getBvhNodes()) {
+        outNodes.push_back(bvhNode);
+        auto& newNode = outNodes.back();
+        if (newNode.triangleCount > 0)
+            newNode.firstTriangleIndex += startTriangle;
+        else
+            newNode.leftChildIndex += startBvhNode;
+    }
+    return startBvhNode + mesh.getBvhRootNode();
+}
+
+static uint32_t appendSubBvh(const raytracer::IMesh& mesh, uint32_t startTriangle, std::vector<raytracer::QuantizedSubBVHNode>& outNodes)
+{
+    uint32_t startBvhNode = (uint32_t)outNodes.size();
+    for (auto quantizedNode : raytracer::quantizeBVH(mesh.getBvhNodes(), mesh.getBvhRootNode())) {
+        if (quantizedNode.triangleCount > 0)
+            quantizedNode.firstTriangleIndex += startTriangle;
+        else
+            quantizedNode.leftChildIndex += startBvhNode;
+        outNodes.push_back(quantizedNode);
+    }
+    return startBvhNode + mesh.getBvhRootNode();
+}
+
+static uint32_t appendSubBvh(const raytracer::IMesh& mesh, uint32_t startTriangle, std::vector<raytracer::WideSubBVHNode>& outNodes)
+{
+    uint32_t startBvhNode = (uint32_t)outNodes.size();
+    for (auto wideNode : raytracer::collapseToWideBVH(mesh.getBvhNodes(), mesh.getBvhRootNode())) {
+        for (uint32_t i = 0; i < wideNode.childCount; i++) {
+            if (wideNode.triangleCounts[i] > 0)
+                wideNode.children[i] += startTriangle;
+            else
+                wideNode.children[i] += startBvhNode;
+        }
+        outNodes.push_back(wideNode);
+    }
+
+    // The root of the wide BVH is always the first node
+    return startBvhNode;
+}
+
+// Number of stack entries that traversing the (sub) BVH from the given node requires at most. The traversal kernels push
+// all inner children of a node that were hit before continuing with the closest one.
+template <typename T>
+static uint32_t calcTraversalStackSize(std::span<const T> nodes, uint32_t nodeID)
 {
-    if (multiple == 0)
-        return numToRound;
+    const auto& node = nodes[nodeID];
+    if (node.triangleCount != 0)
+        return 0;
+
+    uint32_t childStackSize = std::max(calcTraversalStackSize(nodes, node.leftChildIndex), calcTraversalStackSize(nodes, node.leftChildIndex + 1));
+    return 1 + std::max(1u, childStackSize);
+}
+
+static uint32_t calcTraversalStackSize(std::span<const raytracer::WideSubBVHNode> nodes, uint32_t nodeID)
+{
+    const auto& node = nodes[nodeID];
+    uint32_t numInnerChildren = 0;
+    uint32_t childStackSize = 0;
+    for (uint32_t i = 0; i < node.childCount; i++) {
+        if (node.triangleCounts[i] != 0)
+            continue;
 
-    int remainder = numToRound % multiple;
-    if (remainder == 0)
-        return numToRound;
+        numInnerChildren++;
+        childStackSize = std::max(childStackSize, calcTraversalStackSize(nodes, node.children[i]));
+    }
 
-    return numToRound + multiple - remainder;
+    // All but one of the pushed children stay on the stack while the closest child is traversed
+    return numInnerChildren == 0 ? 0 : numInnerChildren - 1 + std::max(1u, childStackSize);
+}
+
+static uint32_t calcTraversalStackSize(std::span<const raytracer::TopBVHNode> nodes, uint32_t rootNodeID)
+{
+    if (nodes.empty())
+        return 0;
+
+    // The top-level BVH may be too deep for recursion. Inner nodes are always created after their children, so the node
+    // IDs are a bottom-up order.
+    std::vector<uint32_t> stackSizes(nodes.size(), 0);
+    for (uint32_t nodeID = 0; nodeID < nodes.size(); nodeID++) {
+        const auto& node = nodes[nodeID];
+        if (!node.isLeaf)
+            stackSizes[nodeID] = 1 + std::max(1u, std::max(stackSizes[node.leftChildIndex], stackSizes[node.rightChildIndex]));
+    }
+
+    // The root itself is pushed as well
+    return std::max(1u, stackSizes[rootNodeID]);
 }
 
 template <typename T>
@@ -908,3 +1488,4 @@ static void writeToBuffer(
     events.push_back(ev);
     checkClErr(err, "CommandQueue::enqueueWriteBuffer");
 }
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include "bvh/top_bvh_build.h"
 #include "model/material.h"
 #include "scene.h"
 #include "opencl/texture.h"
@@ -29,12 +30,23 @@ public:
     int getSamplesPerPixel() const;
     int getMaxSamplesPerPixel() const;
 
+    bool getPersistentThreads() const;
+    void setPersistentThreads(bool enabled); // Use the persistent threads variant of the intersection kernel
+    bool getRaySorting() const;
+    void setRaySorting(bool enabled); // Sort the rays by direction and origin before every traversal pass
+    bool getMaterialSortedShading() const;
+    void setMaterialSortedShading(bool enabled); // Bin the hits per material type and shade every type with its own kernel
+
 private:
+    void loadKernels();
+    void resizeTraversalStack(uint32_t requiredSize); // Recompiles the kernels if the stack has to grow
     void initBuffersAndTransferStaticData(std::shared_ptr<Scene> scene, const UniqueTextureArray& textureArray);
     void initAndTransferSkydome(const UniqueTextureArray& skydomeTextureArray);
     void initTarget(GLuint glTexture);
 
     void traceRays(const Camera& camera);
+    void sortRays(const cl::Buffer& inRays, const cl::Buffer& outRays, std::vector<cl::Event>& events);
+    void shadeMaterialSorted(const cl::Buffer& inRays, const cl::Buffer& outRays);
 
     void accumulate(const Camera& camera);
     void clearAccumulationBuffer();
@@ -48,8 +60,8 @@ private:
         uint32_t numTriangles,
         uint32_t numEmissiveTriangles,
         uint32_t numMaterials,
-        uint32_t numSubBvhNodes,
-        uint32_t numTopBvhNodes);
+        uint32_t numSubBvhNodes);
+    bool reserveTopBvhBuffers(uint32_t numNodes); // Returns true if the buffers were reallocated (losing their contents)
 
     cl::Kernel loadKernel(const std::filesystem::path& filePath, const std::string& funcName);
 
@@ -67,11 +79,35 @@ private:
 
     cl::Kernel m_generateRaysKernel;
     cl::Kernel m_intersectWalkKernel;
+    cl::Kernel m_intersectWalkPersistentKernel;
+    size_t m_numPersistentThreads;
+    bool m_usePersistentThreads = false;
+
+    cl::Kernel m_computeRaySortKeysKernel;
+    cl::Kernel m_reorderRaysKernel;
+    cl::Kernel m_scatterTopBvhUpdatesKernel;
+    cl::Kernel m_radixSortHistogramKernel;
+    cl::Kernel m_radixSortScanBlocksKernel;
+    cl::Kernel m_radixSortScanBlockSumsKernel;
+    cl::Kernel m_radixSortScatterKernel;
+    cl::Buffer m_raySortKeysBuffers[2];
+    cl::Buffer m_raySortValuesBuffers[2];
+    cl::Buffer m_raySortHistogramBuffer;
+    cl::Buffer m_raySortBlockSumsBuffer;
+    bool m_useRaySorting = false;
     cl::Kernel m_shadingKernel;
+    cl::Kernel m_classifyHitsKernel;
+    cl::Kernel m_shadeMaterialKernels[5]; // One per MaterialType
+    cl::Buffer m_materialQueuesBuffer;
+    bool m_useMaterialSortedShading = false;
     cl::Kernel m_intersectShadowsKernel;
     cl::Kernel m_updateKernelDataKernel;
 
     cl::Buffer m_rayTraversalBuffer;
+    uint32_t m_traversalStackSize = 0; // Entries per ray, passed to the kernels as TRAVERSAL_STACK_SIZE
+    uint32_t m_staticTraversalStackSize = 0; // Required by the BVHs of the static meshes
+    uint32_t m_topBvhStackSize = 0; // Required by the top-level BVH
+    bool m_traversalStackOverflowReported = false; // Only report the first frame in which the kernels dropped a push
     cl::Buffer m_kernelDataBuffer;
     cl::Buffer m_randomStreamBuffer;
     cl::Buffer m_raysBuffer[2];
@@ -85,10 +121,16 @@ private:
 
     std::vector<VertexSceneData> m_verticesHost;
     std::vector<TriangleSceneData> m_trianglesHost;
+    std::vector<IntersectTriangle> m_intersectTrianglesHost;
     std::vector<EmissiveTriangle> m_emissiveTrianglesHost;
     std::vector<Material> m_materialsHost;
-    std::vector<TopBVHNode> m_topBvhNodesHost;
+    TopBVH m_topBvh;
+    std::vector<uint32_t> m_prevTopBvhChangedNodes; // Not yet uploaded to the active buffer
+    std::vector<TopBVHNodeUpdate> m_topBvhUpdatesHost; // Read by the non-blocking copy of m_topBvhUpdatesUploadEvent
+    cl::Event m_topBvhUpdatesUploadEvent;
     std::vector<SubBVHNode> m_subBvhNodesHost;
+    std::vector<QuantizedSubBVHNode> m_quantizedSubBvhNodesHost; // Used instead of m_subBvhNodesHost with USE_QUANTIZED_BVH
+    std::vector<WideSubBVHNode> m_wideSubBvhNodesHost; // Used instead of m_subBvhNodesHost with USE_WIDE_BVH
 
     unsigned m_activeBuffer = 0;
     cl_uint m_numStaticVertices;
@@ -100,9 +142,13 @@ private:
 
     cl::Buffer m_verticesBuffers[2];
     cl::Buffer m_trianglesBuffers[2];
+    cl::Buffer m_intersectTrianglesBuffers[2];
     cl::Buffer m_emissiveTrianglesBuffers[2];
     cl::Buffer m_materialsBuffers[2];
     cl::Buffer m_topBvhBuffers[2];
+    cl::Buffer m_topBvhInstanceBuffers[2];
+    cl::Buffer m_topBvhUpdatesBuffer; // Changed nodes, scattered into m_topBvhBuffers by m_scatterTopBvhUpdatesKernel
+    uint32_t m_topBvhNodeCapacity = 0; // Of both m_topBvhBuffers, m_topBvhInstanceBuffers hold (capacity + 1) / 2 instances
     cl::Buffer m_subBvhBuffers[2];
 };
 }
@@ -10,7 +10,7 @@ Scene::Scene()
 {
 }
 
-const SceneNode& Scene::addNode(std::shared_ptr<IMesh> object, const Transform& transform, SceneNode* parent)
+SceneNode& Scene::addNode(std::shared_ptr<IMesh> object, const Transform& transform, SceneNode* parent)
 {
     if (!parent)
         parent = &m_rootNode;
@@ -30,11 +30,23 @@ const SceneNode& Scene::addNode(std::shared_ptr<IMesh> object, const Transform&
         {},
         object->getBounds(),
         transform,
-        meshID,
-        object->getBvhRootNode() });
+        meshID });
     SceneNode& newChildRef = *newChild.get();
     parent->children.push_back(std::move(newChild));
+    m_structureChanged = true;
     return newChildRef;
 }
 
+void Scene::setTransform(SceneNode& node, const Transform& transform)
+{
+    node.transform = transform;
+    m_changedNodes.push_back(&node);
+}
+
+void Scene::clearChanges()
+{
+    m_changedNodes.clear();
+    m_structureChanged = false;
+}
+
 }
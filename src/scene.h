@@ -16,17 +16,16 @@ struct SceneNode {
     AABB bounds;
     Transform transform;
     std::optional<uint32_t> meshID;
-    std::optional<uint32_t> subBvhRootID;
 };
 
 struct MeshBvhPair {
-    MeshBvhPair(std::shared_ptr<IMesh>& meshPtr, uint32_t bvhIndexOffset)
+    MeshBvhPair(std::shared_ptr<IMesh>& meshPtr, uint32_t bvhRootNode)
         : meshPtr(meshPtr)
-        , bvhIndexOffset(bvhIndexOffset)
+        , bvhRootNode(bvhRootNode)
     {
     }
     std::shared_ptr<IMesh> meshPtr;
-    uint32_t bvhIndexOffset; // Offset of meshes bvh into the global bvh array
+    uint32_t bvhRootNode; // Root node of the meshes bvh in the global bvh array
 };
 
 class Scene {
@@ -36,7 +35,13 @@ public:
     Scene();
     ~Scene() = default;
 
-    const SceneNode& addNode(const std::shared_ptr<IMesh> object, const Transform& transform = {}, SceneNode* parent = nullptr);
+    SceneNode& addNode(const std::shared_ptr<IMesh> object, const Transform& transform = {}, SceneNode* parent = nullptr);
+    void setTransform(SceneNode& node, const Transform& transform); // Moves the node and all its children
+
+    // Changes since the last call to clearChanges(), used to incrementally update the top-level BVH
+    std::span<const SceneNode* const> getChangedNodes() const { return m_changedNodes; }
+    bool hasStructureChanged() const { return m_structureChanged; }
+    void clearChanges();
 
     SceneNode& getRootNode() { return m_rootNode; }
     const SceneNode& getRootNode() const { return m_rootNode; }
@@ -47,5 +52,8 @@ private:
 
     std::unordered_map<const IMesh*, uint32_t> m_meshIDMapping;
     std::vector<MeshBvhPair> m_meshes;
+
+    std::vector<const SceneNode*> m_changedNodes; // Nodes of which the transform changed
+    bool m_structureChanged { true };
 };
 }
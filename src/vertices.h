@@ -15,6 +15,14 @@ struct VertexSceneData {
     std::byte __padding[8];
 };
 
+// Triangle data used by the intersection kernels (precomputed Moller-Trumbore edges). Stored in the same (BVH leaf)
+// order as the triangles so that only the shading kernel has to fetch the vertices.
+struct IntersectTriangle {
+    glm::vec4 vertex0; // w = 1 for emissive triangles (ignored by shadow rays)
+    glm::vec4 edge1; // vertex1 - vertex0
+    glm::vec4 edge2; // vertex2 - vertex0
+};
+
 struct EmissiveTriangle {
     glm::vec4 vertices[3];
     Material material;